@@ -0,0 +1,131 @@
+#include "config.h"
+#include <map>
+#include <arx/Thread.h>
+#include <arx/LinearAlgebra.h>
+#include "GainCompensator.h"
+
+using namespace arx;
+using namespace std;
+
+namespace prec {
+  /** Step between sampled pixels of downscaled images, overlap means don't need every pixel. */
+  static const int OVERLAP_SAMPLE_STEP = 2;
+
+  /**
+   * Overlap of a pair of images.
+   */
+  struct Overlap {
+    size_t a, b;          /**< Indices of the images in the panorama. */
+    float size;           /**< Number of sampled pixels in the overlap. */
+    float meanA, meanB;   /**< Mean intensities of the images over the overlap. */
+  };
+
+
+  /**
+   * @return                           Transformation from pixels of the downscaled image to rays in the coordinate system of the reference camera.
+   */
+  static Matrix3f downScaledToRay(const PanoImage& image) {
+    float w = (float) image.getOriginal().getWidth(), h = (float) image.getOriginal().getHeight();
+    return
+      image.getHomography().getInverseMatrix() *
+      Matrix3f::scale(image.getKeyPointScaleFactor()) *
+      Matrix3f::translation(w / -2.0f, h / -2.0f) *
+      Matrix3f::scale(w / image.getDownScaled().getWidth(), h / image.getDownScaled().getHeight());
+  }
+
+
+  /**
+   * OverlapTask calculates overlaps of image matches in parallel. Pixels of the second image of a
+   * match are mapped into the first one, and intensities of both images are averaged over the
+   * pixels that fall inside it.
+   */
+  class GainCompensator::OverlapTask {
+  private:
+    const ArrayList<ImageMatch>& matches;
+    const map<int, size_t>& indices;
+    vector<Overlap>& overlaps;
+
+  public:
+    OverlapTask(const ArrayList<ImageMatch>& matches, const map<int, size_t>& indices, vector<Overlap>& overlaps):
+      matches(matches), indices(indices), overlaps(overlaps) {}
+
+    void operator() (size_t k) {
+      const PanoImage& a = this->matches[k].getPanoImage(0);
+      const PanoImage& b = this->matches[k].getPanoImage(1);
+      const Image1f& imageA = a.getDownScaled();
+      const Image1f& imageB = b.getDownScaled();
+
+      /* Sign of the transformation is kept, so that points behind the first camera have negative
+       * homogeneous coordinate. */
+      Matrix3f m = downScaledToRay(a).inverse() * downScaledToRay(b);
+      float maxX = (float) (imageA.getWidth() - 1), maxY = (float) (imageA.getHeight() - 1);
+
+      double size = 0, sumA = 0, sumB = 0;
+      for(int y = 0; y < imageB.getHeight(); y += OVERLAP_SAMPLE_STEP) {
+        const float* row = imageB.getRow(y);
+        for(int x = 0; x < imageB.getWidth(); x += OVERLAP_SAMPLE_STEP) {
+          Vector3f q = m * Vector3f((float) x, (float) y, 1);
+          if(q[2] < EPS)
+            continue;
+          float sx = q[0] / q[2], sy = q[1] / q[2];
+          if(sx < 0 || sx >= maxX || sy < 0 || sy >= maxY)
+            continue;
+
+          size += 1;
+          sumA += imageA.getPixelInterpolated(sx, sy);
+          sumB += row[x];
+        }
+      }
+
+      Overlap& overlap = this->overlaps[k];
+      overlap.a = this->indices.find(a.getId())->second;
+      overlap.b = this->indices.find(b.getId())->second;
+      overlap.size = (float) size;
+      overlap.meanA = (size > 0) ? (float) (sumA / size) : 0.0f;
+      overlap.meanB = (size > 0) ? (float) (sumB / size) : 0.0f;
+    }
+  };
+
+
+  vector<float> GainCompensator::compensate(Panorama p) const {
+    map<int, size_t> indices;
+    for(size_t i = 0; i < p.size(); i++)
+      indices[p.getImage(i).getId()] = i;
+
+    const ArrayList<ImageMatch>& matches = p.getImageMatches();
+    vector<Overlap> overlaps(matches.size());
+    OverlapTask task(matches, indices, overlaps);
+    parallel_for(0, matches.size(), this->threadNumber, task);
+
+    /* Normal equations. Each image also gets a prior of the weight of one pixel, so that the system
+     * is positive definite even if some images don't overlap any other. */
+    size_t n = p.size();
+    float invN2 = 1.0f / (this->intensityDeviation * this->intensityDeviation);
+    float invG2 = 1.0f / (this->gainDeviation * this->gainDeviation);
+    MatrixXf a(n, n, 0.0f);
+    VectorXf b(n, 0.0f);
+    for(size_t i = 0; i < n; i++) {
+      a(i, i) += invG2;
+      b[i] += invG2;
+    }
+    for(size_t k = 0; k < overlaps.size(); k++) {
+      const Overlap& o = overlaps[k];
+      if(o.size == 0 || o.a == o.b)
+        continue;
+
+      a(o.a, o.a) += o.size * (o.meanA * o.meanA * invN2 + invG2);
+      a(o.b, o.b) += o.size * (o.meanB * o.meanB * invN2 + invG2);
+      a(o.a, o.b) -= o.size * o.meanA * o.meanB * invN2;
+      a(o.b, o.a) -= o.size * o.meanA * o.meanB * invN2;
+      b[o.a] += o.size * invG2;
+      b[o.b] += o.size * invG2;
+    }
+
+    vector<float> gains(n, 1.0f);
+    if(n > 0 && solveCholesky(a, b))
+      for(size_t i = 0; i < n; i++)
+        gains[i] = b[i];
+    return gains;
+  }
+
+} // namespace prec
@@ -0,0 +1,72 @@
+#ifndef __GAINCOMPENSATOR_H__
+#define __GAINCOMPENSATOR_H__
+
+#include "config.h"
+#include <vector>
+#include "Panorama.h"
+
+namespace prec {
+  /**
+   * GainCompensator equalizes exposure differences between the images of a panorama (see
+   * <i> Automatic Panoramic Image Stitching using Invariant Features </i> by Brown and Lowe). For
+   * each image match, mean intensities of both images over their overlap are calculated from
+   * downscaled images. Gains then minimize
+   *
+   * \f[ \sum_{ij} N_{ij} \left( (g_i I_{ij} - g_j I_{ji})^2 / \sigma_N^2 + ((1 - g_i)^2 + (1 - g_j)^2) / \sigma_g^2 \right), \f]
+   *
+   * where the sum is over image matches, \f$N_{ij}\f$ is the size of the overlap, and \f$I_{ij}\f$
+   * is the mean intensity of image i over it. The second term keeps gains close to 1. This is a
+   * small linear least squares problem with one unknown per image.
+   */
+  class GainCompensator {
+  private:
+    float intensityDeviation;
+    float gainDeviation;
+    unsigned int threadNumber;
+
+    class OverlapTask;
+
+  public:
+    GainCompensator(): intensityDeviation(10.0f / 255.0f), gainDeviation(0.1f), threadNumber(0) {}
+
+    /**
+     * @param intensityDeviation       Standard deviation of intensity differences, intensities are in [0, 1].
+     * @param gainDeviation            Standard deviation of gains.
+     */
+    void setDeviations(float intensityDeviation, float gainDeviation) {
+      this->intensityDeviation = intensityDeviation;
+      this->gainDeviation = gainDeviation;
+    }
+
+    float getIntensityDeviation() const {
+      return this->intensityDeviation;
+    }
+
+    float getGainDeviation() const {
+      return this->gainDeviation;
+    }
+
+    /**
+     * @param threadNumber             Number of threads that process image matches, zero means the number of processors.
+     */
+    void setThreadNumber(unsigned int threadNumber) {
+      this->threadNumber = threadNumber;
+    }
+
+    unsigned int getThreadNumber() const {
+      return this->threadNumber;
+    }
+
+    /**
+     * Calculates gains of the images of the given panorama. Overlaps are found with the homographies
+     * of the images, so they must be already optimized.
+     *
+     * @param p                        Panorama.
+     * @return                         Gains of the images, in the order of the images of the panorama.
+     */
+    std::vector<float> compensate(Panorama p) const;
+  };
+
+} // namespace prec
+
+#endif // __GAINCOMPENSATOR_H__
@@ -135,6 +135,114 @@ namespace prec {
         return getInverseRotationPart() * getInverseScalePartDerivative();
     }
 
+    /**
+     * Calculates matrix, inverse matrix and their derivatives by all the parameters at once. Rotation 
+     * part is calculated only once, so this is much faster than calling getMatrix, getInverseMatrix,
+     * getMatrixDerivative and getInverseMatrixDerivative one by one.
+     *
+     * @param matrix                   (out) Matrix.
+     * @param inverse                  (out) Inverse matrix.
+     * @param derivatives              (out) Array of 4 matrix derivatives.
+     * @param inverseDerivatives       (out) Array of 4 inverse matrix derivatives.
+     */
+    void getMatrices(arx::Matrix3f& matrix, arx::Matrix3f& inverse, arx::Matrix3f* derivatives, arx::Matrix3f* inverseDerivatives) const {
+      arx::Matrix3f r = getRotationPart();
+      arx::Matrix3f rt = r.transpose();
+      arx::Matrix3f s = getScalePart();
+      arx::Matrix3f s1 = getInverseScalePart();
+
+      matrix = s * r;
+      inverse = rt * s1;
+
+      /* Rotation derivatives are products of rotation and generators of so(3). */
+      for(unsigned int k = 0; k < 3; k++) {
+        arx::Matrix3f g(0);
+        g[(k + 2) % 3][(k + 1) % 3] = 1;
+        g[(k + 1) % 3][(k + 2) % 3] = -1;
+        arx::Matrix3f dr = r * g;
+        derivatives[k] = s * dr;
+        inverseDerivatives[k] = dr.transpose() * s1;
+      }
+      derivatives[3] = getScalePartDerivative() * r;
+      inverseDerivatives[3] = rt * getInverseScalePartDerivative();
+    }
+
+    /**
+     * Finds rotate-scale transformation that is closest to the given matrix. Matrix is first
+     * divided by the scale part, and then the closest rotation is found as its orthonormal polar
+     * factor and converted into axis angle with the logarithmic map.
+     *
+     * @param m                        Matrix, defined up to a scale factor.
+     * @param result                   (out) Closest rotate-scale transformation.
+     * @return                         false if the given matrix is degenerate, true otherwise.
+     */
+    static bool fromMatrix(const arx::Matrix3f& m, Homography& result) {
+      using namespace std;
+
+      float rowNorms[3];
+      for(int r = 0; r < 3; r++)
+        rowNorms[r] = sqrt(arx::sqr(m[r][0]) + arx::sqr(m[r][1]) + arx::sqr(m[r][2]));
+      if(!(rowNorms[2] > EPS))
+        return false;
+      float scale = 0.5f * (rowNorms[0] + rowNorms[1]) / rowNorms[2];
+      if(!(scale > EPS))
+        return false;
+
+      /* Remove scale part. Sign of the matrix is chosen so that it's not a reflection. */
+      arx::Matrix3f r = getScalePart(1 / (scale * rowNorms[2])) * m;
+      r[2][0] /= rowNorms[2];
+      r[2][1] /= rowNorms[2];
+      r[2][2] /= rowNorms[2];
+      float det = r[0][0] * (r[1][1] * r[2][2] - r[1][2] * r[2][1]) -
+                  r[0][1] * (r[1][0] * r[2][2] - r[1][2] * r[2][0]) +
+                  r[0][2] * (r[1][0] * r[2][1] - r[1][1] * r[2][0]);
+      if(!(abs(det) > EPS))
+        return false;
+      if(det < 0)
+        r *= -1.0f;
+
+      /* Newton iteration for polar decomposition, R = (R + R^-T) / 2. */
+      for(int i = 0; i < 20; i++) {
+        arx::Matrix3f inverse = r.inverse();
+        float change = 0.0f;
+        for(int k = 0; k < 3; k++) {
+          for(int l = 0; l < 3; l++) {
+            float value = 0.5f * (r[k][l] + inverse[l][k]);
+            change += abs(value - r[k][l]);
+            r[k][l] = value;
+          }
+        }
+        if(change < EPS)
+          break;
+      }
+
+      /* Logarithmic map. Antisymmetric part of rotation matrix is sin(angle) * hat(axis). */
+      float cosAngle = max(-1.0f, min(1.0f, 0.5f * (r[0][0] + r[1][1] + r[2][2] - 1)));
+      float angle = acos(cosAngle);
+      float v[3] = {r[2][1] - r[1][2], r[0][2] - r[2][0], r[1][0] - r[0][1]};
+      float sinAngle = sin(angle);
+      if(sinAngle > 1.0e-3f) {
+        float factor = 0.5f * angle / sinAngle;
+        result = Homography(v[0] * factor, v[1] * factor, v[2] * factor, scale);
+      } else if(cosAngle > 0) {
+        /* Angle is close to zero, sin(angle) ~ angle. */
+        result = Homography(0.5f * v[0], 0.5f * v[1], 0.5f * v[2], scale);
+      } else {
+        /* Angle is close to PI, so R ~ 2 * axis * axis^T - I. */
+        int k = 0;
+        for(int i = 1; i < 3; i++)
+          if(r[i][i] > r[k][k])
+            k = i;
+        float a[3];
+        a[k] = sqrt(max(0.0f, 0.5f * (r[k][k] + 1)));
+        for(int i = 0; i < 3; i++)
+          if(i != k)
+            a[i] = 0.25f * (r[k][i] + r[i][k]) / a[k];
+        result = Homography(a[0] * angle, a[1] * angle, a[2] * angle, scale);
+      }
+      return true;
+    }
+
     Homography() {
       this->axis[0] = 0;
       this->axis[1] = 0;
@@ -1,6 +1,7 @@
 #include "config.h"
 #include "Image.h"
 #include <fstream>
+#include <climits>
 
 #ifdef INCLUDE_OPENCV
 #  include <highgui.h>
@@ -137,6 +138,66 @@ namespace prec {
   }
 
 
+// -------------------------------------------------------------------------- //
+// BmpWriter
+// -------------------------------------------------------------------------- //
+  BmpWriter::BmpWriter(const std::string& fileName, int width, int height): fileName(fileName), width(width), rowsLeft(height) {
+    assert(width > 0 && height > 0);
+
+    f.open(fileName.c_str(), ios_base::out | ios_base::binary);
+    if(!f.is_open())
+      throw std::runtime_error("Could not open image file \"" + fileName + "\"");
+
+    /* Sizes don't fit into header fields for images larger than 2 GB. Zero image size is allowed 
+     * for uncompressed bitmaps, and readers calculate it from the dimensions. */
+    int bmpStep = (width * 3 + 3) & -4;
+    double fileSize = (double) bmpStep * height + sizeof(BMPHeader) + sizeof(BMPInfoHeader);
+    int imageSize = (fileSize < INT_MAX) ? (int) fileSize : 0;
+
+    BMPHeader hdr;
+    hdr.type = 0x4D42;
+    hdr.size = imageSize;
+    hdr.reserved1 = 0;
+    hdr.reserved2 = 0;
+    hdr.offset = sizeof(BMPHeader) + sizeof(BMPInfoHeader);
+    f.write((char *) &hdr, sizeof(hdr));
+
+    BMPInfoHeader infoHdr;
+    infoHdr.size = sizeof(BMPInfoHeader);
+    infoHdr.width = width;
+    infoHdr.height = height;
+    infoHdr.planes = 1;
+    infoHdr.bitsPerPixel = 24;
+    infoHdr.compression = 0;
+    infoHdr.imageSize = imageSize;
+    infoHdr.xPelsPerMeter = 0;
+    infoHdr.yPelsPerMeter = 0;
+    infoHdr.clrUsed = 0;
+    infoHdr.clrImportant = 0;
+    f.write((char *) &infoHdr, sizeof(infoHdr));
+
+    if(f.fail())
+      throw std::runtime_error("Error while writing image file \"" + fileName + "\": could not write bitmap header");
+  }
+
+  void BmpWriter::writeRows(const Image3b& image, int rowNumber) {
+    assert(image.getWidth() == this->width && rowNumber <= image.getHeight() && rowNumber <= this->rowsLeft);
+
+    /* Image rows may be shorter than bmp rows, so padding is written separately. */
+    const char padding[3] = {0, 0, 0};
+    int rowSize = this->width * 3;
+    int paddingSize = ((rowSize + 3) & -4) - rowSize;
+    for(int y = rowNumber - 1; y >= 0; y--) {
+      f.write((const char *) image.getRow(y), rowSize);
+      f.write(padding, paddingSize);
+    }
+    this->rowsLeft -= rowNumber;
+
+    if(f.fail())
+      throw std::runtime_error("Error while writing image file \"" + fileName + "\": write failed");
+  }
+
+
 // -------------------------------------------------------------------------- //
 // Image3b
 // -------------------------------------------------------------------------- //
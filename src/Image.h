@@ -24,10 +24,13 @@
 #include <exception>
 #include <cassert>
 #include <string>
+#include <fstream>
+#include <vector>
 #include <arx/smart_ptr.h>
 #include <arx/Utility.h>
 #include <arx/Mpl.h>
 #include <arx/LinearAlgebra.h>
+#include <arx/Thread.h>
 
 #ifdef INCLUDE_IPPI
 #  include <ipp.h>
@@ -1044,6 +1047,26 @@ namespace prec {
   };
 #endif
 
+// -------------------------------------------------------------------------- //
+// Mipmaps
+// -------------------------------------------------------------------------- //
+  /** Abstract base class for caches of mip levels, so that GenericImageData can own them without knowing the image type. */
+  class ImageMipmapBase {
+  public:
+    virtual ~ImageMipmapBase() {}
+  };
+
+  /** 
+   * Cache of mip levels of an image.
+   *
+   * @param Image                  Image type.
+   */
+  template<class Image> class ImageMipmap: public ImageMipmapBase {
+  public:
+    std::vector<Image> levels; /**< Levels starting from level 1, level 0 is the image itself. */
+  };
+
+
 // -------------------------------------------------------------------------- //
 // GenericImageData
 // -------------------------------------------------------------------------- //
@@ -1061,9 +1084,11 @@ namespace prec {
     int bufferHeight; /**< Height of an image buffer in pixels. */
     int wStep; /**< Size of aligned image row in bytes. */
     ImageDeallocator* deallocator; /**< ImageDeallocator to use with this image. */
+    ImageMipmapBase* mipmap; /**< Cached mip levels, or NULL if none were requested. */
+    arx::mutex mipmapMutex; /**< Guards mip level cache. */
 
     /** Constructor. */
-    GenericImageData(int width, int height): width(width), height(height), deallocator(NULL) {
+    GenericImageData(int width, int height): width(width), height(height), deallocator(NULL), mipmap(NULL) {
       assert(width > 0 && height > 0);
 
       /* Allocate memory. */
@@ -1076,12 +1101,13 @@ namespace prec {
 
     /** Constructor. */
     GenericImageData(int width, int height, int wStep, void* pixels, ImageDeallocator* deallocator): 
-      width(width), height(height), wStep(wStep), pixels(pixels), deallocator(deallocator) {
+      width(width), height(height), wStep(wStep), pixels(pixels), deallocator(deallocator), mipmap(NULL) {
       assert(width > 0 && height > 0 && wStep >= (width * pixel_size) && pixels != NULL);
     }
 
     /** Destructor. */
     ~GenericImageData() {
+      delete this->mipmap;
       if(deallocator == NULL) {
         ImageAllocator<pixel_size>()(this->pixels);
       } else {
@@ -1232,6 +1258,60 @@ namespace prec {
       getPixelReference(x, y) = value;
     }
 
+    /** 
+     * @return                         Number of mip levels of this image, including the image itself. Levels are halved
+     *                                 while both sides stay at least 2 pixels long.
+     */
+    int getMipLevelNumber() const {
+      int n = 1;
+      while((this->data->width >> n) >= 2 && (this->data->height >> n) >= 2)
+        n++;
+      return n;
+    }
+
+    /**
+     * Returns a mip level of this image. Level 0 is the image itself, and each next level is the previous one
+     * blurred and downscaled by a factor of 2, so that point (x, y) of this image is point (x / 2^k, y / 2^k)
+     * of level k. Levels are built on first request and cached in the shared image data, concurrent requests
+     * are safe. The cache is dropped on assignment, but not when pixels are modified directly - call 
+     * dropMipLevels in that case.
+     *
+     * Levels are returned by reference, so that threads sampling them don't copy image handles. The cache 
+     * never reallocates, so the reference stays valid until the cache is dropped.
+     *
+     * @param level                    Mip level, less than getMipLevelNumber().
+     */
+    const derived_type& getMipLevel(int level) const {
+      assert(level >= 0 && level < getMipLevelNumber());
+      const derived_type& self = static_cast<const derived_type&>(*this);
+      if(level == 0)
+        return self;
+
+      typedef ImageMipmap<derived_type> mipmap_type;
+      arx::lock_guard<arx::mutex> lock(this->data->mipmapMutex);
+      if(this->data->mipmap == NULL) {
+        mipmap_type* mipmap = new mipmap_type();
+        this->data->mipmap = mipmap;
+        mipmap->levels.reserve(getMipLevelNumber() - 1);
+      }
+      std::vector<derived_type>& levels = static_cast<mipmap_type*>(this->data->mipmap)->levels;
+      while((int) levels.size() < level) {
+        const derived_type& previous = levels.empty() ? self : levels.back();
+        levels.push_back(previous.gaussianBlur(1.0f).resize(0.5f, 0.5f));
+      }
+      return levels[level - 1];
+    }
+
+    /** 
+     * Drops cached mip levels, so that they are rebuilt from the current pixels on next request. References
+     * returned by getMipLevel become invalid.
+     */
+    void dropMipLevels() {
+      arx::lock_guard<arx::mutex> lock(this->data->mipmapMutex);
+      delete this->data->mipmap;
+      this->data->mipmap = NULL;
+    }
+
     /** 
      * Draws a line that connects two points (x1, y1) and (x2, y2) using the given color value. 
      */
@@ -1351,12 +1431,14 @@ namespace prec {
 
       Matrix3f m_1 = m.inverse();
 
+      /* Homogeneous source coordinates are stepped incrementally along a row. */
+      Vector3f step(m_1(0, 0), m_1(1, 0), m_1(2, 0));
       for(int y = y0; y < y1; y++) {
-        for(int x = x0; x < x1; x++) {
-          Vector3f v = m_1 * Vector3f((float) x, (float) y, 1);
-          v /= v[2];
-          if(v[0] >= 0 && v[0] < that.getWidth() - 1 && v[1] >= 0 && v[1] < that.getHeight() - 1)
-            this->setPixel(x, y, blendFunc(this->getPixel(x, y), that.getPixelInterpolated(v[0], v[1])));
+        Vector3f v = m_1 * Vector3f((float) x0, (float) y, 1);
+        for(int x = x0; x < x1; x++, v += step) {
+          float sx = v[0] / v[2], sy = v[1] / v[2];
+          if(sx >= 0 && sx < that.getWidth() - 1 && sy >= 0 && sy < that.getHeight() - 1)
+            this->setPixel(x, y, blendFunc(this->getPixel(x, y), that.getPixelInterpolated(sx, sy)));
         }
       }
     }
@@ -1405,6 +1487,7 @@ namespace prec {
        * It is not needed in case we have allocated data anew, but I don't see any point in protecting it with if. */
       this->data->width = that.getWidth();
       this->data->height = that.getHeight();
+      this->dropMipLevels();
 
       return this->ref();
     }
@@ -1502,12 +1585,12 @@ namespace prec {
     typedef typename arx::if_c<materialized, materialized_type&, materialized_type>::type materialized_ref_type;
     typedef typename arx::if_c<materialized, const materialized_type&, materialized_type>::type materialized_const_ref_type;
 
+  public:
     /** Returns suitable size of a Gaussian kernel for the given sigma (standard deviation of the Gaussian distribution). */
     static int getGaussianKernelSize(float sigma) {
       return max(3, ((int) (sigma * GAUSS_TRUNCATE)) * 2 + 1);
     }
 
-  public:
     /** 
      * Performs image subtraction.
      *
@@ -1759,6 +1842,43 @@ namespace prec {
 #undef IMAGE_DERIVE
 
 
+// -------------------------------------------------------------------------- //
+// BmpWriter
+// -------------------------------------------------------------------------- //
+  /**
+   * BmpWriter writes a 24-bit bmp file row by row, so that images that don't fit in memory can be
+   * saved. Rows of bmp files are stored bottom-up, so they must be supplied starting from the last one.
+   */
+  class BmpWriter: public arx::noncopyable {
+  private:
+    std::ofstream f;
+    std::string fileName;
+    int width;
+    int rowsLeft;
+
+  public:
+    /**
+     * Constructor. Creates the file and writes bitmap headers into it.
+     *
+     * @param fileName                 Name of the file to write.
+     * @param width                    Image width in pixels.
+     * @param height                   Image height in pixels.
+     */
+    BmpWriter(const std::string& fileName, int width, int height);
+
+    /**
+     * Writes rows of the given image into the file. They are placed right above the rows written before.
+     *
+     * @param image                    Image to take rows from, must be exactly as wide as the file.
+     * @param rowNumber                Number of rows to write, starting from the first row of the image.
+     */
+    void writeRows(const Image3b& image, int rowNumber);
+
+    /** @return                        Number of rows that are yet to be written. */
+    int getRowsLeft() const { return this->rowsLeft; }
+  };
+
+
 // -------------------------------------------------------------------------- //
 // Converter specializations.
 // -------------------------------------------------------------------------- //
@@ -4,10 +4,86 @@
 #include "config.h"
 #include <limits>
 #include <iostream>
+#include <algorithm>
 #include <arx/LinearAlgebra.h>
+#include <arx/SparseLinearAlgebra.h>
 
 namespace prec {
+  namespace detail {
+    /**
+     * LevMarDamping implements the damping term update strategy by Nielsen (see <i> Damping
+     * Parameter in Marquardt's Method </i>). Damping term is adjusted according to the ratio of
+     * actual and predicted error decrease, which needs fewer rejected steps than simple 
+     * multiplication and division by 10.
+     */
+    template<class T>
+    class LevMarDamping {
+    private:
+      T dampingTerm;
+      T nu;
+
+    public:
+      /**
+       * Initializes damping term relative to the magnitude of \f$J^T * J\f$.
+       *
+       * @param maxDiagonal            Maximal diagonal element of \f$J^T * J\f$.
+       */
+      void init(T maxDiagonal) {
+        this->dampingTerm = static_cast<T>(1.0e-3) * maxDiagonal;
+        if(!(this->dampingTerm > 0))
+          this->dampingTerm = static_cast<T>(1.0e-3);
+        this->nu = 2;
+      }
+
+      /** @return                      Current damping term. */
+      T get() const {
+        return this->dampingTerm;
+      }
+
+      /**
+       * Updates damping term after a successful step.
+       *
+       * @param actualDecrease         Actual decrease of residual error.
+       * @param predictedDecrease      Decrease of residual error predicted by linear model, \f$h^T (\lambda h + g)\f$.
+       */
+      void accept(T actualDecrease, T predictedDecrease) {
+        T factor = static_cast<T>(1) / 3;
+        if(predictedDecrease > 0) {
+          T rho = 2 * actualDecrease / predictedDecrease - 1;
+          factor = std::max(factor, 1 - rho * rho * rho);
+        }
+        this->dampingTerm *= factor;
+        this->nu = 2;
+      }
+
+      /** Updates damping term after a rejected step. */
+      void reject() {
+        this->dampingTerm *= this->nu;
+        this->nu *= 2;
+      }
+    };
+
+    /**
+     * @return                         Decrease of residual error predicted by linear model for the given step, 
+     *                                 assuming that it is the solution of damped normal equations.
+     */
+    template<class Vector, class T>
+    T predictedDecrease(const Vector& step, const Vector& grad, T dampingTerm) {
+      T result = 0;
+      for(std::size_t i = 0; i < step.size(); i++)
+        result += step[i] * (dampingTerm * step[i] + grad[i]);
+      return result;
+    }
+
+  } // namespace detail
 
+  /**
+   * LevMar implements Levenberg-Marquardt nonlinear minimization method for models that 
+   * calculate a dense Jacobian. Normal equations are formed once per iteration, and each
+   * damping term retry only updates their diagonal, so no allocations are made in the retry loop.
+   *
+   * @see LevMarModel
+   */
   template<class LevMarModel>
   class LevMar {
   public:
@@ -33,7 +109,7 @@ namespace prec {
       size_t paramN = model.getParamNumber();
       size_t residN = model.getResidualNumber();
 
-      value_type dampingTerm = 1;
+      detail::LevMarDamping<value_type> damping;
 
       value_type error;
 
@@ -43,16 +119,25 @@ namespace prec {
       param_vector_type grad(paramN);                      /* Gradient. */
       param_vector_type step(paramN);                      /* Step. */
       param_vector_type newP(paramN);                      /* New parameters. */
+      hessn_matrix_type jtj(paramN, paramN);               /* J^T * J. */
       hessn_matrix_type a(paramN, paramN);                 /* Matrix for linear solver. */
 
-      /* Initialize. */
+      /* Initialize. Residual error is the squared norm of residuals vector, so there is no need to call the model for it. */
       model.nextIteration(p, j, x);
-      error = model.calculateResidualError(p); /* This double residual calculation doesn't add too much overhead and simplifies the LevMarModel interface. */
+      error = x.normSqr();
 
       /* Iterate. */
-      while(true) {
-        /* Calculate gradient. */
+      for(bool first = true; ; first = false) {
+        /* Calculate normal equations. They stay the same for all damping term retries. */
         grad = j.transpose() * -x;
+        jtj = j.transpose() * j;
+
+        if(first) {
+          value_type maxDiagonal = 0;
+          for(size_t i = 0; i < paramN; i++)
+            maxDiagonal = std::max(maxDiagonal, jtj(i, i));
+          damping.init(maxDiagonal);
+        }
         
         /* Drop out in case gradient magnitude hits threshold. */
         if(grad.normSqr() < gradientMagnitudeThresholdSqr)
@@ -62,19 +147,21 @@ namespace prec {
         while(true) {
           iterationN++;
 
-          a = j.transpose() * j + hessn_matrix_type::identity(paramN) * dampingTerm;
           step = grad;
+          a = jtj;
+          for(size_t i = 0; i < paramN; i++)
+            a(i, i) += damping.get();
           solveLinearSystem(a, step); /* this modifies step! */
 
           value_type newError = model.calculateResidualError(newP = p + step);
 
           if(newError < error) {
+            damping.accept(error - newError, detail::predictedDecrease(step, grad, damping.get()));
             error = newError;
             p = newP;
-            dampingTerm /= 10;
             break;
           } else
-            dampingTerm *= 10;
+            damping.reject();
 
           if(iterationN > maxIterations)
             break;
@@ -95,6 +182,119 @@ namespace prec {
 
   };
 
+  /**
+   * SparseLevMar implements Levenberg-Marquardt nonlinear minimization method for models that
+   * build normal equations themselves, in a block-sparse form. Such models never form a Jacobian, 
+   * and normal equations are solved with preconditioned conjugate gradient method. Small systems
+   * are converted into dense form and solved with Cholesky decomposition instead.
+   *
+   * @see SparseLevMarModel
+   */
+  template<class LevMarModel>
+  class SparseLevMar {
+  public:
+    typedef typename LevMarModel::value_type value_type;
+    typedef typename LevMarModel::param_vector_type param_vector_type; 
+    typedef typename LevMarModel::hessn_matrix_type hessn_matrix_type;
+
+    /**
+     * Fits the given model using Levenberg-Marquardt nonlinear minimization method.
+     *
+     * @param model                    Model to fit.
+     * @param p                        (in, out) Initial parameters approximation, final result.
+     */
+    void fit(const LevMarModel& model, param_vector_type& p) {
+      value_type gradientMagnitudeThresholdSqr = 0.0000001f;
+      value_type stepMagnitudeThresholdSqr = 0.0000001f;
+      value_type errorThresholdSqr = 0.0000001f;
+      unsigned int maxIterations = 100;
+      size_t maxDenseParamN = 512;
+
+      unsigned int iterationN = 0;
+      size_t paramN = model.getParamNumber();
+      bool useDense = paramN <= maxDenseParamN;
+
+      detail::LevMarDamping<value_type> damping;
+
+      value_type error;
+
+      /* Allocate memory for everything. */
+      hessn_matrix_type jtj = model.createHessianMatrix(); /* J^T * J. */
+      hessn_matrix_type a = jtj;                           /* Matrix for linear solver. */
+      param_vector_type grad(paramN);                      /* Gradient. */
+      param_vector_type step(paramN);                      /* Step. */
+      param_vector_type newP(paramN);                      /* New parameters. */
+      arx::BlockSparseConjugateGradient<value_type, hessn_matrix_type::block_size> solver;
+      arx::DynamicMatrix<value_type> denseJtj(useDense ? paramN : 1, useDense ? paramN : 1); /* Dense J^T * J for small systems. */
+      arx::CholeskyDecomposition<value_type> cholesky;
+
+      /* Initialize. */
+      model.nextIteration(p, jtj, grad);
+      error = model.calculateResidualError(p);
+
+      value_type maxDiagonal = 0;
+      for(size_t i = 0; i < jtj.getBlockRows(); i++)
+        for(size_t k = 0; k < hessn_matrix_type::block_size; k++)
+          maxDiagonal = std::max(maxDiagonal, jtj.getBlock(i)[k][k]);
+      damping.init(maxDiagonal);
+
+      /* Iterate. */
+      while(true) {
+        /* Drop out in case gradient magnitude hits threshold. */
+        if(grad.normSqr() < gradientMagnitudeThresholdSqr)
+          break;
+
+        if(useDense)
+          jtj.toDense(denseJtj);
+
+        /* Inner loop - adjust dampingTerm and update current parameters approximation. */
+        while(true) {
+          iterationN++;
+
+          step = grad;
+          if(useDense) {
+            if(!cholesky.decompose(denseJtj, damping.get())) {
+              damping.reject();
+              if(iterationN > maxIterations)
+                break;
+              continue;
+            }
+            cholesky.solve(step);
+          } else {
+            a = jtj;
+            a.addToDiagonal(damping.get());
+            solver.solve(a, step.data(), static_cast<unsigned int>(paramN), 1.0e-6f); /* this modifies step! */
+          }
+
+          value_type newError = model.calculateResidualError(newP = p + step);
+
+          if(newError < error) {
+            damping.accept(error - newError, detail::predictedDecrease(step, grad, damping.get()));
+            error = newError;
+            p = newP;
+            break;
+          } else
+            damping.reject();
+
+          if(iterationN > maxIterations)
+            break;
+        }
+
+        if(iterationN > maxIterations)
+          break;
+
+        if(step.normSqr() < stepMagnitudeThresholdSqr)
+          break;
+
+        if(error < errorThresholdSqr)
+          break;
+
+        model.nextIteration(p, jtj, grad);
+      }
+    }
+
+  };
+
   template<class T> 
   class LevMarModel {
   public:
@@ -123,8 +323,8 @@ namespace prec {
     std::size_t getResidualNumber() const;
 
     /**
-     * This function calculates residual error at p. It may be called several times 
-     * during single iteration.
+     * This function calculates residual error at p, i.e. the sum of squared residuals. 
+     * It may be called several times during single iteration.
      *
      * @param p                        Parameters vector.
      * @return                         Residual error.
@@ -142,6 +342,47 @@ namespace prec {
     void nextIteration(const param_vector_type& p, jacob_matrix_type& j, resid_vector_type& r) const;
   };
 
+  template<class T, std::size_t B> 
+  class SparseLevMarModel {
+  public:
+    typedef T value_type;
+
+    /** Type for parameters vector. */
+    typedef arx::DynamicVector<value_type> param_vector_type; 
+
+    /** Type for hessian matrix, \f$H = J^T * J\f$. Parameters are grouped into blocks of size B, e.g. one block per camera. B must not exceed 9. **/
+    typedef arx::BlockSparseMatrix<value_type, B> hessn_matrix_type;
+
+    /**
+     * @return                         Number of parameters in the model.
+     */
+    std::size_t getParamNumber() const;
+
+    /**
+     * @return                         Zero hessian matrix with the structure of non-zero blocks of the model.
+     */
+    hessn_matrix_type createHessianMatrix() const;
+
+    /**
+     * This function calculates residual error at p, i.e. the sum of squared residuals. 
+     * It may be called several times during single iteration.
+     *
+     * @param p                        Parameters vector.
+     * @return                         Residual error.
+     */
+    value_type calculateResidualError(const param_vector_type& p) const;
+
+    /**
+     * This function is called by SparseLevMar once at the beginning of each iteration. 
+     * It calculates normal equations at p.
+     *
+     * @param p                        Parameters vector.
+     * @param jtj                      (out) \f$J^T * J\f$ at p, structure is the one returned by createHessianMatrix.
+     * @param grad                     (out) Gradient \f$-J^T * r\f$ at p.
+     */
+    void nextIteration(const param_vector_type& p, hessn_matrix_type& jtj, param_vector_type& grad) const;
+  };
+
 
 
 } // namespace prec
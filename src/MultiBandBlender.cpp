@@ -0,0 +1,141 @@
+#include "config.h"
+#include <cassert>
+#include <arx/Thread.h>
+#include "MultiBandBlender.h"
+
+using namespace arx;
+using namespace std;
+
+namespace prec {
+  /**
+   * BandTask extracts bands from Gaussian pyramids of an image and adds them to the blend. Bands
+   * are independent once the pyramids are built, so they are processed in parallel.
+   */
+  class MultiBandBlender::BandTask {
+  private:
+    const vector<Image3f>& colors;
+    const vector<Image1f>& masks;
+    vector<Image3f>& bands;
+    vector<Image1f>& weights;
+
+  public:
+    BandTask(const vector<Image3f>& colors, const vector<Image1f>& masks, vector<Image3f>& bands, vector<Image1f>& weights):
+      colors(colors), masks(masks), bands(bands), weights(weights) {}
+
+    void operator() (size_t k) {
+      /* Band is the difference between a pyramid level and the next level upsampled. The last
+       * level is the low-pass residual. */
+      Image3f upsampled;
+      if(k + 1 < this->colors.size())
+        upsampled = this->colors[k + 1].resize(2.0f, 2.0f);
+
+      const Image3f& color = this->colors[k];
+      const Image1f& mask = this->masks[k];
+      for(int y = 0; y < color.getHeight(); y++) {
+        const Color3f* c = color.getRow(y);
+        const Color3f* u = upsampled.isNull() ? NULL : upsampled.getRow(y);
+        const float* m = mask.getRow(y);
+        Color3f* b = this->bands[k].getRow(y);
+        float* w = this->weights[k].getRow(y);
+        for(int x = 0; x < color.getWidth(); x++) {
+          if(m[x] == 0.0f)
+            continue;
+          if(u != NULL) {
+            b[x].r += (c[x].r - u[x].r) * m[x];
+            b[x].g += (c[x].g - u[x].g) * m[x];
+            b[x].b += (c[x].b - u[x].b) * m[x];
+          } else {
+            b[x].r += c[x].r * m[x];
+            b[x].g += c[x].g * m[x];
+            b[x].b += c[x].b * m[x];
+          }
+          w[x] += m[x];
+        }
+      }
+    }
+  };
+
+
+  MultiBandBlender::MultiBandBlender(int width, int height, int bandNumber, unsigned int threadNumber):
+    width(width), height(height), bandNumber(bandNumber), threadNumber(threadNumber) {
+    assert(bandNumber >= 0 && width % (1 << bandNumber) == 0 && height % (1 << bandNumber) == 0);
+
+    for(int k = 0; k <= bandNumber; k++) {
+      this->bands.push_back(Image3f(width >> k, height >> k));
+      this->bands.back().fill(Color3f(0, 0, 0));
+      this->weights.push_back(Image1f(width >> k, height >> k));
+      this->weights.back().fill(0.0f);
+    }
+  }
+
+  void MultiBandBlender::feed(const Image3f& color, const Image1f& coverage, const Image1f& mask) {
+    assert(color.getWidth() == this->width && color.getHeight() == this->height);
+    assert(coverage.getWidth() == this->width && coverage.getHeight() == this->height);
+    assert(mask.getWidth() == this->width && mask.getHeight() == this->height);
+
+    /* Gaussian pyramids of colors and mask. Blur before downsampling suppresses aliasing. Colors
+     * are blurred premultiplied by coverage and then divided by blurred coverage. */
+    vector<Image3f> colors(this->bandNumber + 1);
+    vector<Image1f> masks(this->bandNumber + 1);
+    colors[0] = color;
+    masks[0] = mask;
+    Image1f levelCoverage = coverage;
+    for(int k = 0; k < this->bandNumber; k++) {
+      Image3f premultiplied(colors[k].getWidth(), colors[k].getHeight());
+      for(int y = 0; y < premultiplied.getHeight(); y++) {
+        const Color3f* c = colors[k].getRow(y);
+        const float* a = levelCoverage.getRow(y);
+        Color3f* p = premultiplied.getRow(y);
+        for(int x = 0; x < premultiplied.getWidth(); x++)
+          p[x] = Color3f(c[x].r * a[x], c[x].g * a[x], c[x].b * a[x]);
+      }
+
+      colors[k + 1] = premultiplied.gaussianBlur(1.0f).resize(0.5f, 0.5f);
+      levelCoverage = levelCoverage.gaussianBlur(1.0f).resize(0.5f, 0.5f);
+      masks[k + 1] = masks[k].gaussianBlur(1.0f).resize(0.5f, 0.5f);
+
+      for(int y = 0; y < colors[k + 1].getHeight(); y++) {
+        Color3f* c = colors[k + 1].getRow(y);
+        float* a = levelCoverage.getRow(y);
+        for(int x = 0; x < colors[k + 1].getWidth(); x++) {
+          if(a[x] > EPS) {
+            float invA = 1.0f / a[x];
+            c[x] = Color3f(c[x].r * invA, c[x].g * invA, c[x].b * invA);
+            a[x] = 1.0f;
+          }
+        }
+      }
+    }
+
+    BandTask task(colors, masks, this->bands, this->weights);
+    parallel_for(0, this->bandNumber + 1, this->threadNumber, task);
+  }
+
+  void MultiBandBlender::blend(Image3f& result) const {
+    /* Collapse the pyramid starting from the residual, normalizing each band by the sum of masks. */
+    for(int k = this->bandNumber; k >= 0; k--) {
+      Image3f level;
+      if(k == this->bandNumber) {
+        level = Image3f(this->width >> k, this->height >> k);
+        level.fill(Color3f(0, 0, 0));
+      } else
+        level = result.resize(2.0f, 2.0f);
+
+      for(int y = 0; y < level.getHeight(); y++) {
+        Color3f* l = level.getRow(y);
+        const Color3f* b = this->bands[k].getRow(y);
+        const float* w = this->weights[k].getRow(y);
+        for(int x = 0; x < level.getWidth(); x++) {
+          if(w[x] > EPS) {
+            float invW = 1.0f / w[x];
+            l[x].r += b[x].r * invW;
+            l[x].g += b[x].g * invW;
+            l[x].b += b[x].b * invW;
+          }
+        }
+      }
+      result = level;
+    }
+  }
+
+} // namespace prec
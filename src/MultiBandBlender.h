@@ -0,0 +1,77 @@
+#ifndef __MULTIBANDBLENDER_H__
+#define __MULTIBANDBLENDER_H__
+
+#include "config.h"
+#include <vector>
+#include "Image.h"
+
+namespace prec {
+  /**
+   * MultiBandBlender blends overlapping images with Laplacian pyramids (see <i> A Multiresolution
+   * Spline With Application to Image Mosaics </i> by Burt and Adelson). Each image is split into
+   * frequency bands, and each band is blended with a blend mask smoothed to the scale of the band,
+   * so low frequencies are blended over wide transition zones, and high frequencies over narrow
+   * ones. This hides exposure differences without blurring details, and unlike linear feathering
+   * it doesn't produce ghosts of misaligned details.
+   *
+   * Pyramids are built with gaussianBlur and resize. Blender works on a region of a fixed size,
+   * so memory use depends on the region size only. Blending of a large image can be done in
+   * overlapping tiles, each tile having a margin wide enough for the coarsest band.
+   */
+  class MultiBandBlender {
+  private:
+    int width, height;
+    int bandNumber;
+    unsigned int threadNumber;
+    std::vector<Image3f> bands;   /**< Sums of bands of images multiplied by masks, finest first. */
+    std::vector<Image1f> weights; /**< Sums of masks for each band. */
+
+    class BandTask;
+
+  public:
+    /**
+     * Constructor.
+     *
+     * @param width, height            Size of the region, must be divisible by 2 ^ bandNumber.
+     * @param bandNumber               Number of bands, not counting the low-pass residual.
+     * @param threadNumber             Number of threads that process bands, zero means the number of processors.
+     */
+    MultiBandBlender(int width, int height, int bandNumber, unsigned int threadNumber);
+
+    /**
+     * @return                         Margin in pixels that tiles must have for the given number of bands, so
+     *                                 that blending of a tile is not affected by its borders.
+     */
+    static int getMargin(int bandNumber) {
+      /* Building level k + 1 reaches half of the blur kernel plus one pixel of resampling into level k, 
+       * and collapsing the pyramid reaches one pixel of level k + 1, i.e. two pixels of level k. A pixel 
+       * of level k is 2^k pixels of the region. */
+      int reach = Image3f::getGaussianKernelSize(1.0f) / 2 + 3;
+      int margin = 0;
+      for(int k = 0; k < bandNumber; k++)
+        margin += reach << k;
+      return margin;
+    }
+
+    /**
+     * Adds an image to the blend. Coarse levels of the color pyramid are normalized by coverage, so
+     * colors are extended beyond image borders instead of fading to black.
+     *
+     * @param color                    Image colors, of the size of the region.
+     * @param coverage                 Coverage of the region by the image, 1 where image pixels are defined, 0 elsewhere.
+     * @param mask                     Blend mask, of the size of the region. Masks of all the images should sum to 1
+     *                                 in the covered part of the region.
+     */
+    void feed(const Image3f& color, const Image1f& coverage, const Image1f& mask);
+
+    /**
+     * Collapses the blended pyramid.
+     *
+     * @param result                   (out) Blended image of the size of the region.
+     */
+    void blend(Image3f& result) const;
+  };
+
+} // namespace prec
+
+#endif // __MULTIBANDBLENDER_H__
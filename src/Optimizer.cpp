@@ -1,7 +1,13 @@
 #include "config.h"
 #include "Optimizer.h"
+#include <vector>
+#include <queue>
+#include <utility>
+#include <algorithm>
 #include <arx/Collections.h>
 #include <arx/LinearAlgebra.h>
+#include <arx/SparseLinearAlgebra.h>
+#include <arx/Thread.h>
 #include "LevMar.h"
 #include "Homography.h"
 
@@ -21,40 +27,311 @@ namespace prec {
 
 
   /**
-   * Bundle adjustment model for Levenberg-Marquardt
+   * Robust loss function for bundle adjustment. Cost of a residual r is rho(r), scaled so that 
+   * rho(r) = r^2 for small r. With iteratively reweighted least squares, each residual is weighted
+   * by rho'(r) / (2 * r) in normal equations, which makes their right-hand side the exact gradient 
+   * of the total cost.
+   */
+  class RobustLoss {
+  private:
+    Optimizer::LossFunction function;
+    float scale, scaleSqr;
+
+  public:
+    RobustLoss(Optimizer::LossFunction function, float scale): function(function), scale(scale), scaleSqr(scale * scale) {}
+
+    /**
+     * @param rSqr                     Squared residual.
+     * @return                         Cost of the residual.
+     */
+    float cost(float rSqr) const {
+      switch(this->function) {
+      case Optimizer::HUBER_LOSS:
+        return (rSqr <= this->scaleSqr) ? rSqr : 2 * this->scale * sqrt(rSqr) - this->scaleSqr;
+      case Optimizer::CAUCHY_LOSS:
+        return this->scaleSqr * log(1 + rSqr / this->scaleSqr);
+      default:
+        return rSqr;
+      }
+    }
+
+    /**
+     * @param r                        Residual.
+     * @return                         Weight of the residual in normal equations.
+     */
+    float weight(float r) const {
+      switch(this->function) {
+      case Optimizer::HUBER_LOSS:
+        return (r <= this->scale) ? 1.0f : this->scale / r;
+      case Optimizer::CAUCHY_LOSS:
+        return 1 / (1 + r * r / this->scaleSqr);
+      default:
+        return 1.0f;
+      }
+    }
+  };
+
+
+  /**
+   * Bundle adjustment model for Levenberg-Marquardt. 
+   *
+   * Each residual depends on the parameters of two images only, so normal equations are
+   * block-sparse: there is a 4x4 block for each image, and a 4x4 block for each matched pair 
+   * of images. These blocks are accumulated directly, without forming the Jacobian.
+   *
+   * Residuals are grouped by image pairs. Matrices of all the cameras and their derivatives are
+   * calculated once per iteration, and then products of these matrices are calculated once per
+   * pair, so that the loop over residuals of a pair uses only a few multiplications per residual.
+   *
+   * Residuals may be passed through a robust loss function, see RobustLoss.
    *
-   * @see LevMarModel
+   * Some of the cameras may be fixed. Parameters vector contains parameters of free cameras only, 
+   * and residual camera indexes greater or equal to the number of free cameras refer to fixed ones.
+   *
+   * Cameras and pairs are processed in parallel. Contribution of each pair is stored separately,
+   * and the contributions are summed up in pair order afterwards, so the result doesn't depend on
+   * the number of threads.
+   *
+   * @see SparseLevMarModel
    */
   class BundleAdjustmentLevMarModel {
   private:
-    ArrayList<Residual> residuals;
+    /** Group of residuals between the same two images. */
+    struct ImagePair {
+      size_t index0, index1;
+      size_t block;                        /**< Index of off-diagonal hessian block, or NO_BLOCK if any of the cameras is fixed. */
+      size_t begin, end;                   /**< Range of residuals of this pair. */
+    };
+
+    /** Matrices of a single camera, precomputed once per iteration. */
+    struct CameraMatrices {
+      Matrix3f m, inv;
+      Matrix3f dm[4], dinv[4];
+    };
+
+    /** Contribution of a single pair into residual error and normal equations. */
+    struct PairContribution {
+      float error;
+      float h[8][8];                       /**< Upper triangle of J^T * J for the parameters of both images. */
+      float g[8];                          /**< -J^T * r for the parameters of both images. */
+    };
+
+    /** Function object for parallel_for that calls the given method of the model. */
+    class Task {
+    private:
+      const BundleAdjustmentLevMarModel* model;
+      void (BundleAdjustmentLevMarModel::*method)(size_t) const;
+
+    public:
+      Task(const BundleAdjustmentLevMarModel* model, void (BundleAdjustmentLevMarModel::*method)(size_t) const): model(model), method(method) {}
+
+      void operator() (size_t index) const {
+        (this->model->*this->method)(index);
+      }
+    };
+
+    static const size_t NO_BLOCK = static_cast<size_t>(-1);
+
     size_t paramN;
     size_t residN;
+    size_t freeCameraN;
+    unsigned int threadNumber;
+    RobustLoss loss;
+    std::vector<float> x0, y0, x1, y1;     /**< Keypoint coordinates of residuals, grouped by pairs. */
+    std::vector<ImagePair> pairs;
+    BlockSparseMatrix<float, 4> structure; /**< Zero hessian with all the non-zero blocks. */
+
+    /* Per-iteration state, written from parallel tasks. Each task writes only to its own elements. */
+    mutable const Homography* homographies;
+    mutable std::vector<CameraMatrices> cameras;
+    mutable std::vector<PairContribution> contributions;
+
+    struct ResidualPairLess {
+      bool operator() (const Residual& l, const Residual& r) const {
+        return l.index0 < r.index0 || (l.index0 == r.index0 && l.index1 < r.index1);
+      }
+    };
 
-    float getDerivative(const Homography& h0, const Homography& h1, const Matrix3f& h0m, const Matrix3f& h1m1, const Vector2f& ab, const Matrix<float, 2, 3>& dab_dxyz, const float r, const Vector3f& u1, unsigned int derivativeIndex) const {
-      assert(derivativeIndex < 8);
+    void setParams(const VectorXf& p) const {
+      /* Get homographies array. */
+      this->homographies = reinterpret_cast<const Homography*>(p.data());
+
+      /* This one was dangerous. */
+      assert(p.size() * sizeof(float) == this->paramN * sizeof(Homography) / 4);
+    }
 
-      if(r == 0.0f)
-        return 0.0f; // TODO: what should I do with that? O_O
+    void prepareCamera(size_t index) const {
+      CameraMatrices& c = this->cameras[index];
+      c.m = this->homographies[index].getMatrix();
+      c.inv = this->homographies[index].getInverseMatrix();
+    }
 
-      Vector3f dxyz;
-      if(derivativeIndex < 4)
-        dxyz = h0.getMatrixDerivative(derivativeIndex) * h1m1 * u1;
-      else
-        dxyz = h0m * h1.getInverseMatrixDerivative(derivativeIndex - 4) * u1;
+    void prepareCameraDerivatives(size_t index) const {
+      CameraMatrices& c = this->cameras[index];
+      this->homographies[index].getMatrices(c.m, c.inv, c.dm, c.dinv);
+    }
+
+    void run(size_t n, void (BundleAdjustmentLevMarModel::*method)(size_t) const, size_t grainSize) const {
+      Task task(this, method);
+      parallel_for(0, n, this->threadNumber, task, grainSize);
+    }
+
+    /**
+     * @return                         Smallest number of pairs worth a separate thread, so that 
+     *                                 each thread gets about BUNDLE_ADJUSTMENT_GRAIN_RESIDUALS 
+     *                                 residuals.
+     */
+    size_t getPairGrainSize() const {
+      if(this->residN == 0)
+        return 1;
+      return std::max<size_t>(1, BUNDLE_ADJUSTMENT_GRAIN_RESIDUALS * this->pairs.size() / this->residN);
+    }
+
+    void calculatePairError(size_t index) const {
+      const ImagePair& pair = this->pairs[index];
+      Matrix3f t = this->cameras[pair.index0].m * this->cameras[pair.index1].inv;
+
+      float result = 0.0f;
+      for(size_t i = pair.begin; i < pair.end; i++) {
+        float x = t[0][0] * this->x1[i] + t[0][1] * this->y1[i] + t[0][2];
+        float y = t[1][0] * this->x1[i] + t[1][1] * this->y1[i] + t[1][2];
+        float z = t[2][0] * this->x1[i] + t[2][1] * this->y1[i] + t[2][2];
+        float a = this->x0[i] - x / z;
+        float b = this->y0[i] - y / z;
+        result += this->loss.cost(a * a + b * b);
+      }
+      this->contributions[index].error = result;
+    }
+
+    void calculatePairNormalEquations(size_t index) const {
+      const ImagePair& pair = this->pairs[index];
+      const CameraMatrices& c0 = this->cameras[pair.index0];
+      const CameraMatrices& c1 = this->cameras[pair.index1];
+
+      /* (x, y, z) = H0 * H1^-1 * u1, so its derivatives by the parameters of the first camera are
+       * H0' * H1^-1 * u1, and by the parameters of the second one - H0 * (H1^-1)' * u1. */
+      Matrix3f t = c0.m * c1.inv;
+      Matrix3f d[8];
+      for(unsigned int l = 0; l < 4; l++) {
+        d[l] = c0.dm[l] * c1.inv;
+        d[l + 4] = c0.m * c1.dinv[l];
+      }
+
+      PairContribution& c = this->contributions[index];
+      for(unsigned int l = 0; l < 8; l++) {
+        for(unsigned int m = 0; m < 8; m++)
+          c.h[l][m] = 0.0f;
+        c.g[l] = 0.0f;
+      }
 
-      Vector2f dab = arx::operator*(dab_dxyz, dxyz); // TODO: what the hell??? what's with adl?
-      return (ab[0] * dab[0] + ab[1] * dab[1]) / r;
+      for(size_t i = pair.begin; i < pair.end; i++) {
+        const float u = this->x1[i], v = this->y1[i];
+        float x = t[0][0] * u + t[0][1] * v + t[0][2];
+        float y = t[1][0] * u + t[1][1] * v + t[1][2];
+        float z = t[2][0] * u + t[2][1] * v + t[2][2];
+        float invZ = 1 / z;
+        float px = x * invZ;
+        float py = y * invZ;
+        float a = this->x0[i] - px;
+        float b = this->y0[i] - py;
+        float r = sqrt(a * a + b * b);
+        if(r == 0.0f)
+          continue; // TODO: what should I do with that? O_O
+
+        /* Then we calculate the row of jacobian.
+         *
+         * The formula for residual is as follows: 
+         *   r = sqrt(a^2 + b^2), where (a, b) = u0 - (x / z, y / z),
+         * therefore by chain rule
+         *   r' = (a*a' + b*b') / r,
+         *   a' = (-x' + x/z * z') / z,
+         *   b' = (-y' + y/z * z') / z.
+         * Collecting the terms, r' = cx * x' + cy * y' + cz * z'. */
+        float s = invZ / r;
+        float cx = -a * s;
+        float cy = -b * s;
+        float cz = (a * px + b * py) * s;
+
+        float j[8];
+        for(unsigned int l = 0; l < 8; l++) {
+          const Matrix3f& dl = d[l];
+          float dx = dl[0][0] * u + dl[0][1] * v + dl[0][2];
+          float dy = dl[1][0] * u + dl[1][1] * v + dl[1][2];
+          float dz = dl[2][0] * u + dl[2][1] * v + dl[2][2];
+          j[l] = cx * dx + cy * dy + cz * dz;
+        }
+
+        float w = this->loss.weight(r);
+        for(unsigned int l = 0; l < 8; l++) {
+          float wj = w * j[l];
+          for(unsigned int m = l; m < 8; m++)
+            c.h[l][m] += wj * j[m];
+          c.g[l] -= wj * r;
+        }
+      }
     }
 
   public:
-    BundleAdjustmentLevMarModel(size_t paramN, ArrayList<Residual> residuals): paramN(paramN), residuals(residuals), residN(residuals.size()) {}
+    /**
+     * Constructor.
+     *
+     * @param residuals                Residuals. Residuals between two fixed cameras are not allowed.
+     * @param freeCameraN              Number of free cameras.
+     * @param fixedCameras             Fixed cameras.
+     * @param loss                     Loss function.
+     * @param threadNumber             Number of threads to use, zero means the number of processors.
+     */
+    BundleAdjustmentLevMarModel(ArrayList<Residual> residuals, size_t freeCameraN, const std::vector<Homography>& fixedCameras, const RobustLoss& loss, unsigned int threadNumber): 
+      paramN(freeCameraN * 4), residN(residuals.size()), freeCameraN(freeCameraN), threadNumber(threadNumber), loss(loss), structure(freeCameraN), homographies(NULL), cameras(freeCameraN + fixedCameras.size()) 
+    {
+      for(size_t i = 0; i < fixedCameras.size(); i++) {
+        CameraMatrices& c = this->cameras[freeCameraN + i];
+        fixedCameras[i].getMatrices(c.m, c.inv, c.dm, c.dinv);
+      }
+
+      std::vector<Residual> sorted(residuals.begin(), residuals.end());
+      std::stable_sort(sorted.begin(), sorted.end(), ResidualPairLess());
+
+      this->x0.reserve(this->residN);
+      this->y0.reserve(this->residN);
+      this->x1.reserve(this->residN);
+      this->y1.reserve(this->residN);
+
+      /* Create an off-diagonal block for each pair of matched images. */
+      Map<std::pair<size_t, size_t>, size_t> blockIndexes;
+      for(size_t i = 0; i < this->residN; i++) {
+        const Residual& r = sorted[i];
+        assert(r.index0 < freeCameraN || r.index1 < freeCameraN);
+        if(this->pairs.empty() || this->pairs.back().index0 != r.index0 || this->pairs.back().index1 != r.index1) {
+          ImagePair pair;
+          pair.index0 = r.index0;
+          pair.index1 = r.index1;
+          pair.block = NO_BLOCK;
+          if(r.index0 < freeCameraN && r.index1 < freeCameraN) {
+            std::pair<size_t, size_t> key(std::min(r.index0, r.index1), std::max(r.index0, r.index1));
+            Map<std::pair<size_t, size_t>, size_t>::iterator pos = blockIndexes.find(key);
+            if(pos == blockIndexes.end())
+              pos = blockIndexes.insert(std::make_pair(key, this->structure.addBlock(key.first, key.second))).first;
+            pair.block = pos->second;
+          }
+
+          pair.begin = i;
+          pair.end = i;
+          this->pairs.push_back(pair);
+        }
+        this->pairs.back().end++;
+        this->x0.push_back(r.x0);
+        this->y0.push_back(r.y0);
+        this->x1.push_back(r.x1);
+        this->y1.push_back(r.y1);
+      }
+
+      this->contributions.resize(this->pairs.size());
+    }
 
     typedef float value_type;
     typedef VectorXf param_vector_type; 
-    typedef VectorXf resid_vector_type;
-    typedef MatrixXf jacob_matrix_type;
-    typedef MatrixXf hessn_matrix_type;
+    typedef BlockSparseMatrix<float, 4> hessn_matrix_type;
 
     size_t getParamNumber() const {
       return this->paramN;
@@ -64,162 +341,487 @@ namespace prec {
       return this->residN;
     }
 
-    float calculateResidualError(const VectorXf& p) const {
-      /* Get homographies array. */
-      const Homography* homographies = reinterpret_cast<const Homography*>(p.data());
+    hessn_matrix_type createHessianMatrix() const {
+      return this->structure;
+    }
 
-      /* This one was dangerous. */
-      assert(p.size() * sizeof(float) == this->paramN * sizeof(Homography) / 4);
+    float calculateResidualError(const VectorXf& p) const {
+      setParams(p);
+      run(this->freeCameraN, &BundleAdjustmentLevMarModel::prepareCamera, BUNDLE_ADJUSTMENT_GRAIN_CAMERAS);
+      run(this->pairs.size(), &BundleAdjustmentLevMarModel::calculatePairError, getPairGrainSize());
 
+      /* Ordered reduction. */
       float result = 0.0f;
+      for(size_t k = 0; k < this->pairs.size(); k++)
+        result += this->contributions[k].error;
+      return result;
+    }
 
-      for(unsigned int i = 0; i < getResidualNumber(); i++) {
-        Vector2f u0;
-        u0[0] = this->residuals[i].x0;
-        u0[1] = this->residuals[i].y0;
-        Vector3f u1;
-        u1[0] = this->residuals[i].x1;
-        u1[1] = this->residuals[i].y1;
-        u1[2] = 1;
-
-        size_t paramIndex0 = this->residuals[i].index0;
-        size_t paramIndex1 = this->residuals[i].index1;
-        const Homography h0 = homographies[paramIndex0];
-        const Homography h1 = homographies[paramIndex1];
-        Matrix3f h0m  = h0.getMatrix();
-        Matrix3f h1m1 = h1.getInverseMatrix();
+    void nextIteration(const VectorXf& p, hessn_matrix_type& jtj, VectorXf& grad) const {
+      setParams(p);
+      run(this->freeCameraN, &BundleAdjustmentLevMarModel::prepareCameraDerivatives, BUNDLE_ADJUSTMENT_GRAIN_CAMERAS);
+      run(this->pairs.size(), &BundleAdjustmentLevMarModel::calculatePairNormalEquations, getPairGrainSize());
+
+      /* Fill normal equations with zeros. */
+      jtj.fill(0);
+      grad.fill(0);
+
+      /* Accumulate contributions of the pairs into normal equations in pair order. Only upper 
+       * triangle of the hessian is stored, so the off-diagonal block is oriented by image indexes. 
+       * Derivatives by the parameters of fixed cameras are dropped. */
+      for(size_t k = 0; k < this->pairs.size(); k++) {
+        const ImagePair& pair = this->pairs[k];
+        const PairContribution& c = this->contributions[k];
+        if(pair.index0 < this->freeCameraN) {
+          Matrix4f& b00 = jtj.getBlock(pair.index0);
+          for(unsigned int l = 0; l < 4; l++) {
+            for(unsigned int m = 0; m < 4; m++)
+              b00[l][m] += (l <= m) ? c.h[l][m] : c.h[m][l];
+            grad[4 * pair.index0 + l] += c.g[l];
+          }
+        }
+        if(pair.index1 < this->freeCameraN) {
+          Matrix4f& b11 = jtj.getBlock(pair.index1);
+          for(unsigned int l = 0; l < 4; l++) {
+            for(unsigned int m = 0; m < 4; m++)
+              b11[l][m] += (l <= m) ? c.h[l + 4][m + 4] : c.h[m + 4][l + 4];
+            grad[4 * pair.index1 + l] += c.g[l + 4];
+          }
+        }
+        if(pair.block != NO_BLOCK) {
+          Matrix4f& b01 = jtj.getBlock(pair.block);
+          bool straight = pair.index0 < pair.index1;
+          for(unsigned int l = 0; l < 4; l++)
+            for(unsigned int m = 0; m < 4; m++)
+              b01[l][m] += straight ? c.h[l][m + 4] : c.h[m][l + 4];
+        }
+      }
+    }
+  };
 
-        Vector<float, 3> xyz = h0m * h1m1 * u1;
 
-        Vector<float, 2> xy;
-        xy[0] = xyz[0] / xyz[2];
-        xy[1] = xyz[1] / xyz[2];
 
-        Vector<float, 2> ab = u0 - xy;
-        result += ab.normSqr();
+  /**
+   * Set of matches between two images of a panorama. Keypoint coordinates are copied out of 
+   * ImageMatch, so that edges can be safely used from several threads.
+   */
+  struct MatchEdge {
+    size_t index0, index1;
+    Matrix3f transform;                    /**< Transformation from keypoint coordinates of the second image to keypoint coordinates of the first one. */
+    bool hasTransform;                     /**< Whether transform was found by verification, matches without RANSAC have none. */
+    std::vector<Residual> residuals;       /**< Matches, camera indexes of residuals are not used. */
+
+    MatchEdge(size_t index0, size_t index1, const ImageMatch& imageMatch): index0(index0), index1(index1), transform(imageMatch.getTransform()), hasTransform(imageMatch.hasTransform()) {
+      this->residuals.reserve(imageMatch.getMatches().size());
+      for(size_t j = 0; j < imageMatch.getMatches().size(); j++) {
+        const Match& m = imageMatch.getMatch(j);
+        this->residuals.push_back(Residual(index0, index1, m.getKey(0).getX(), m.getKey(0).getY(), m.getKey(1).getX(), m.getKey(1).getY()));
       }
+    }
+  };
 
-      return result;
+
+  /**
+   * Refines the given cameras with bundle adjustment.
+   *
+   * @param edges                      Matches between images.
+   * @param freeCameras                Indexes of the cameras to refine.
+   * @param fixedCameras               Indexes of the cameras that are used as constraints, but are not changed.
+   * @param homographies               (in/out) Cameras.
+   * @param loss                       Loss function.
+   * @param threadNumber               Number of threads to use.
+   */
+  static void adjust(const std::vector<MatchEdge>& edges, const std::vector<size_t>& freeCameras, const std::vector<size_t>& fixedCameras, std::vector<Homography>& homographies, const RobustLoss& loss, unsigned int threadNumber) {
+    if(freeCameras.empty())
+      return;
+
+    /* Camera index -> index in the model. */
+    const size_t NONE = static_cast<size_t>(-1);
+    std::vector<size_t> localIndexes(homographies.size(), NONE);
+    for(size_t i = 0; i < freeCameras.size(); i++)
+      localIndexes[freeCameras[i]] = i;
+    std::vector<Homography> fixed;
+    for(size_t i = 0; i < fixedCameras.size(); i++) {
+      localIndexes[fixedCameras[i]] = freeCameras.size() + i;
+      fixed.push_back(homographies[fixedCameras[i]]);
     }
 
+    /* Create residuals array. */
+    ArrayList<Residual> residuals;
+    for(size_t i = 0; i < edges.size(); i++) {
+      size_t index0 = localIndexes[edges[i].index0];
+      size_t index1 = localIndexes[edges[i].index1];
+      if(index0 == NONE || index1 == NONE || (index0 >= freeCameras.size() && index1 >= freeCameras.size()))
+        continue;
+
+      for(size_t j = 0; j < edges[i].residuals.size(); j++) {
+        const Residual& r = edges[i].residuals[j];
+        residuals.push_back(Residual(index0, index1, r.x0, r.y0, r.x1, r.y1));
+      }
+    }
 
-    void nextIteration(const VectorXf& p, MatrixXf& j, VectorXf& r) const {
-      /* Get homographies array. */
-      const Homography* homographies = reinterpret_cast<const Homography*>(p.data());
+    /* Prepare initial params. */
+    VectorXf params(freeCameras.size() * 4);
+    for(size_t i = 0; i < freeCameras.size(); i++)
+      for(unsigned int k = 0; k < 4; k++)
+        params[i * 4 + k] = homographies[freeCameras[i]].getParam(k);
 
-      /* This one was dangerous. */
-      assert(p.size() * sizeof(float) == this->paramN * sizeof(Homography) / 4);
+    /* Launch LevMar. */
+    SparseLevMar<BundleAdjustmentLevMarModel> levMar;
+    BundleAdjustmentLevMarModel levMarModel(residuals, freeCameras.size(), fixed, loss, threadNumber);
+    levMar.fit(levMarModel, params);
 
-      /* Fill jacobian with zeros. */
-      j.fill(0);
-
-      for(unsigned int i = 0; i < r.size(); i++) {
-        Vector2f u0;
-        u0[0] = this->residuals[i].x0;
-        u0[1] = this->residuals[i].y0;
-        Vector3f u1;
-        u1[0] = this->residuals[i].x1;
-        u1[1] = this->residuals[i].y1;
-        u1[2] = 1;
-        
-        size_t paramIndex0 = this->residuals[i].index0;
-        size_t paramIndex1 = this->residuals[i].index1;
-        const Homography h0 = homographies[paramIndex0];
-        const Homography h1 = homographies[paramIndex1];
-        Matrix3f h0m  = h0.getMatrix();
-        Matrix3f h1m1 = h1.getInverseMatrix();
-        
-        Vector<float, 3> xyz = h0m * h1m1 * u1;
-        
-        Vector<float, 2> xy;
-        xy[0] = xyz[0] / xyz[2];
-        xy[1] = xyz[1] / xyz[2];
-
-        Vector<float, 2> ab = u0 - xy;
-        r[i] = ab.norm();
-
-        /* Then we fill jacobian.
-         *
-         * The basic idea here is simple:
-         * Each residual has 8 non-zero derivatives - 4 per each homography involved in its calculation.
-         * The formula for residual is as follows: 
-         *   r = sqrt(a^2 + b^2), where a and b are functions of model parameters,
-         * therefore
-         *   r' = (a*a' + b*b') / sqrt(a^2 + b^2). Here derivative is taken by one of the parameters.
-         * For (a, b) vector we have:
-         *   (a, b) = u0 - (x / z, y / z), 
-         *   (x, y, z) = H0 * H1^-1 * u1,
-         * therefore we can calculate (a, b)' using chain rule:
-         *   d(a, b)/dO = d(a, b)/d(x, y, z) * d(x, y, z)/dO,
-         * where
-         *   d(a, b)/d(x, y, z) = 
-         *     | -1/z    0   x/z^2 |
-         *     |   0   -1/z  y/z^2 |
-         * So the only problem left is to calculate (x, y, z)' (denoted above as d(x, y, z)/dO).
-         * It is pretty simple too, since (x, y, z) = H0 * H1^-1 * u1.
-         */
-        Matrix<float, 2, 3> dab_dxyz;
-        dab_dxyz[0][0] = -1 / xyz[2];
-        dab_dxyz[1][0] = 0;
-        dab_dxyz[0][1] = 0;
-        dab_dxyz[1][1] = -1 / xyz[2];
-        dab_dxyz[0][2] = xyz[0] / sqr(xyz[2]);
-        dab_dxyz[1][2] = xyz[1] / sqr(xyz[2]);
-
-        for(unsigned int k = 0; k < 4; k++)
-          j[i][4 * paramIndex0 + k] = getDerivative(h0, h1, h0m, h1m1, ab, dab_dxyz, r[i], u1, k);
-
-        for(unsigned int k = 0; k < 4; k++)
-          j[i][4 * paramIndex1 + k] = getDerivative(h0, h1, h0m, h1m1, ab, dab_dxyz, r[i], u1, k + 4);
+    /* Write homographies back. */
+    for(size_t i = 0; i < freeCameras.size(); i++)
+      homographies[freeCameras[i]] = Homography(params[i * 4], params[i * 4 + 1], params[i * 4 + 2], params[i * 4 + 3]);
+  }
+
+
+  /**
+   * Finds all the cameras with bundle adjustment, adding them one by one, as described in 
+   * "Automatic Panoramic Image Stitching using Invariant Features" by Brown and Lowe. 
+   *
+   * We start with the best connected image, which stays fixed at identity, as the whole panorama
+   * may be rotated freely. Each next image is the one with the largest number of matches to the 
+   * already added ones. It is initialized from the pairwise transformation of its best match, or
+   * from the camera of that neighbour when matches were not verified and there is no transformation,
+   * and refined together with its neighbours. Global adjustment is done only once, at the end.
+   *
+   * @param edges                      Matches between images.
+   * @param homographies               (out) Cameras.
+   * @param loss                       Loss function.
+   * @param threadNumber               Number of threads to use.
+   */
+  static void adjustIncrementally(const std::vector<MatchEdge>& edges, std::vector<Homography>& homographies, const RobustLoss& loss, unsigned int threadNumber) {
+    const size_t n = homographies.size();
+    if(n == 0)
+      return;
+
+    std::vector<size_t> matchNumbers(n, 0);
+    for(size_t i = 0; i < edges.size(); i++) {
+      matchNumbers[edges[i].index0] += edges[i].residuals.size();
+      matchNumbers[edges[i].index1] += edges[i].residuals.size();
+    }
+
+    for(size_t i = 0; i < n; i++)
+      homographies[i] = Homography();
+    std::vector<bool> added(n, false);
+    size_t first = std::max_element(matchNumbers.begin(), matchNumbers.end()) - matchNumbers.begin();
+    added[first] = true;
+
+    for(size_t step = 1; step < n; step++) {
+      /* Find the image with the largest number of matches to the already added ones. */
+      std::vector<size_t> addedMatchNumbers(n, 0);
+      for(size_t i = 0; i < edges.size(); i++)
+        if(added[edges[i].index0] != added[edges[i].index1])
+          addedMatchNumbers[added[edges[i].index0] ? edges[i].index1 : edges[i].index0] += edges[i].residuals.size();
+      size_t next = std::max_element(addedMatchNumbers.begin(), addedMatchNumbers.end()) - addedMatchNumbers.begin();
+      if(addedMatchNumbers[next] == 0)
+        break;
+
+      /* Initialize it from the pairwise transformation of its best match, T ~ H0 * H1^-1. */
+      const MatchEdge* best = NULL;
+      for(size_t i = 0; i < edges.size(); i++)
+        if((edges[i].index0 == next && added[edges[i].index1]) || (edges[i].index1 == next && added[edges[i].index0]))
+          if(best == NULL || edges[i].residuals.size() > best->residuals.size())
+            best = &edges[i];
+      size_t neighbour = (best->index0 == next) ? best->index1 : best->index0;
+      Matrix3f h;
+      if(best->index0 == next)
+        h = best->transform * homographies[neighbour].getMatrix();
+      else
+        h = best->transform.inverse() * homographies[neighbour].getMatrix();
+      if(!best->hasTransform || !Homography::fromMatrix(h, homographies[next]))
+        homographies[next] = homographies[neighbour];
+      added[next] = true;
+
+      /* Refine the new image together with its neighbours. Images matched to them constrain the 
+       * solution, but are not changed. */
+      std::vector<bool> isFree(n, false);
+      isFree[next] = true;
+      for(size_t i = 0; i < edges.size(); i++) {
+        if(edges[i].index0 == next && added[edges[i].index1] && edges[i].index1 != first)
+          isFree[edges[i].index1] = true;
+        if(edges[i].index1 == next && added[edges[i].index0] && edges[i].index0 != first)
+          isFree[edges[i].index0] = true;
+      }
+      std::vector<bool> isFixed(n, false);
+      for(size_t i = 0; i < edges.size(); i++) {
+        if(isFree[edges[i].index0] && added[edges[i].index1] && !isFree[edges[i].index1])
+          isFixed[edges[i].index1] = true;
+        if(isFree[edges[i].index1] && added[edges[i].index0] && !isFree[edges[i].index0])
+          isFixed[edges[i].index0] = true;
       }
+
+      std::vector<size_t> freeCameras, fixedCameras;
+      for(size_t i = 0; i < n; i++) {
+        if(isFree[i])
+          freeCameras.push_back(i);
+        else if(isFixed[i])
+          fixedCameras.push_back(i);
+      }
+      adjust(edges, freeCameras, fixedCameras, homographies, loss, threadNumber);
     }
+
+    /* Final global adjustment. Images that are not connected to the first one start from identity. */
+    std::vector<size_t> freeCameras, fixedCameras(1, first);
+    for(size_t i = 0; i < n; i++)
+      if(i != first)
+        freeCameras.push_back(i);
+    adjust(edges, freeCameras, fixedCameras, homographies, loss, threadNumber);
+  }
+
+
+  /**
+   * Part of a panorama that is adjusted separately. 
+   */
+  struct Cluster {
+    std::vector<size_t> images;            /**< Images of the cluster, core images go first. */
+    size_t coreSize;                       /**< Number of images that belong to this cluster only. Other images are shared with neighbouring clusters. */
+    std::vector<MatchEdge> edges;          /**< Matches between images of the cluster, indexed by positions in images array. */
+    std::vector<Homography> homographies;  /**< Cameras in the coordinate frame of the cluster. */
   };
 
 
+  /** Function object for parallel_for that adjusts clusters. */
+  class ClusterTask {
+  private:
+    std::vector<Cluster>* clusters;
+    const RobustLoss* loss;
 
-  void Optimizer::optimize(Panorama& p) {
-    /* Create id -> index map. */
-    Map<int, size_t> indexes;
-    for(size_t i = 0; i < p.size(); i++)
-      indexes[p.getImage(i).getId()] = i;
+  public:
+    ClusterTask(std::vector<Cluster>* clusters, const RobustLoss* loss): clusters(clusters), loss(loss) {}
 
-    /* Create residuals array. */
-    ArrayList<Residual> residuals;
-    for(size_t i = 0; i < p.getImageMatches().size(); i++) {
-      ImageMatch im = p.getImageMatch(i);
-      size_t index0 = indexes[im.getPanoImage(0).getId()];
-      size_t index1 = indexes[im.getPanoImage(1).getId()];
-      for(size_t j = 0; j < im.getMatches().size(); j++) {
-        Match m = im.getMatch(j);
-        residuals.push_back(Residual(index0, index1, m.getKey(0).getX(), m.getKey(0).getY(), m.getKey(1).getX(), m.getKey(1).getY()));
+    void operator() (size_t index) const {
+      Cluster& c = (*this->clusters)[index];
+      adjustIncrementally(c.edges, c.homographies, *this->loss, 1);
+    }
+  };
+
+
+  /** Orders image indexes by decreasing number of matches. */
+  class MatchNumberGreater {
+  private:
+    const std::vector<size_t>* matchNumbers;
+
+  public:
+    MatchNumberGreater(const std::vector<size_t>* matchNumbers): matchNumbers(matchNumbers) {}
+
+    bool operator() (size_t a, size_t b) const {
+      return (*this->matchNumbers)[a] > (*this->matchNumbers)[b];
+    }
+  };
+
+
+  /**
+   * Finds all the cameras of a large panorama by splitting it into clusters of bounded size.
+   *
+   * Clusters are grown with breadth-first search in the match graph. Each cluster is extended
+   * with the neighbours of its images, so that neighbouring clusters overlap. Clusters are 
+   * adjusted independently and in parallel, then rotated into a common frame, one after another,
+   * using the shared images. Finally, images that have matches in other clusters are refined 
+   * with the rest of the cameras fixed.
+   *
+   * Matches are indexed by image, so that each cluster only looks at the matches of its own
+   * images. Apart from bundle adjustment itself, the cost is linear in the total number of
+   * matches of the images of all the clusters, shared images counted once per cluster, plus
+   * a logarithmic factor for ordering images and clusters.
+   *
+   * @param edges                      Matches between images.
+   * @param homographies               (out) Cameras.
+   * @param maxClusterSize             Maximal number of core images in a cluster.
+   * @param loss                       Loss function.
+   * @param threadNumber               Number of threads to use.
+   */
+  static void adjustPartitioned(const std::vector<MatchEdge>& edges, std::vector<Homography>& homographies, size_t maxClusterSize, const RobustLoss& loss, unsigned int threadNumber) {
+    const size_t n = homographies.size();
+    const size_t NONE = static_cast<size_t>(-1);
+
+    /* Build adjacency lists and lists of matches of each image. */
+    std::vector<std::vector<size_t> > neighbours(n), incidentEdges(n);
+    std::vector<size_t> matchNumbers(n, 0);
+    for(size_t i = 0; i < edges.size(); i++) {
+      neighbours[edges[i].index0].push_back(edges[i].index1);
+      neighbours[edges[i].index1].push_back(edges[i].index0);
+      incidentEdges[edges[i].index0].push_back(i);
+      if(edges[i].index1 != edges[i].index0)
+        incidentEdges[edges[i].index1].push_back(i);
+      matchNumbers[edges[i].index0] += edges[i].residuals.size();
+      matchNumbers[edges[i].index1] += edges[i].residuals.size();
+    }
+
+    /* Grow clusters, starting from the best connected images. */
+    std::vector<size_t> seeds(n);
+    for(size_t i = 0; i < n; i++)
+      seeds[i] = i;
+    std::stable_sort(seeds.begin(), seeds.end(), MatchNumberGreater(&matchNumbers));
+    std::vector<size_t> clusterOf(n, NONE);
+    std::vector<Cluster> clusters;
+    for(size_t s = 0; s < n; s++) {
+      size_t seed = seeds[s];
+      if(clusterOf[seed] != NONE)
+        continue;
+
+      clusters.push_back(Cluster());
+      Cluster& c = clusters.back();
+      clusterOf[seed] = clusters.size() - 1;
+      c.images.push_back(seed);
+      for(size_t head = 0; head < c.images.size() && c.images.size() < maxClusterSize; head++) {
+        const std::vector<size_t>& adjacent = neighbours[c.images[head]];
+        for(size_t k = 0; k < adjacent.size() && c.images.size() < maxClusterSize; k++) {
+          if(clusterOf[adjacent[k]] == NONE) {
+            clusterOf[adjacent[k]] = clusters.size() - 1;
+            c.images.push_back(adjacent[k]);
+          }
+        }
       }
+      c.coreSize = c.images.size();
     }
 
-    /* Prepare initial params. */
-    VectorXf params(p.size() * 4);
-    for(size_t i = 0, t = 0; i < p.size(); i++) {
-      /* Axis angle. */
-      params[t++] = 0;
-      params[t++] = 0;
-      params[t++] = 0;
+    /* Add overlaps and collect matches of each cluster. Each match is taken from the list of its
+     * first image, so that it is added once, and matches keep their order. */
+    std::vector<size_t> localIndexes(n, NONE);
+    std::vector<std::vector<size_t> > clustersOf(n);
+    for(size_t ci = 0; ci < clusters.size(); ci++) {
+      Cluster& c = clusters[ci];
+      for(size_t i = 0; i < c.coreSize; i++)
+        localIndexes[c.images[i]] = i;
+      for(size_t i = 0; i < c.coreSize; i++) {
+        const std::vector<size_t>& adjacent = neighbours[c.images[i]];
+        for(size_t k = 0; k < adjacent.size(); k++) {
+          if(localIndexes[adjacent[k]] == NONE) {
+            localIndexes[adjacent[k]] = c.images.size();
+            c.images.push_back(adjacent[k]);
+          }
+        }
+      }
+
+      std::vector<size_t> clusterEdges;
+      for(size_t i = 0; i < c.images.size(); i++) {
+        const std::vector<size_t>& incident = incidentEdges[c.images[i]];
+        for(size_t k = 0; k < incident.size(); k++)
+          if(edges[incident[k]].index0 == c.images[i] && localIndexes[edges[incident[k]].index1] != NONE)
+            clusterEdges.push_back(incident[k]);
+      }
+      std::sort(clusterEdges.begin(), clusterEdges.end());
+      for(size_t i = 0; i < clusterEdges.size(); i++) {
+        const MatchEdge& e = edges[clusterEdges[i]];
+        c.edges.push_back(e);
+        c.edges.back().index0 = localIndexes[e.index0];
+        c.edges.back().index1 = localIndexes[e.index1];
+      }
+      c.homographies.resize(c.images.size());
 
-      /* Scale. */
-      params[t++] = 1;
+      for(size_t i = 0; i < c.images.size(); i++) {
+        clustersOf[c.images[i]].push_back(ci);
+        localIndexes[c.images[i]] = NONE;
+      }
     }
 
-    /* Launch LevMar. */
-    LevMar<BundleAdjustmentLevMarModel> levMar;
-    BundleAdjustmentLevMarModel levMarModel(params.size(), residuals);
-    levMar.fit(levMarModel, params);
+    /* Adjust clusters in parallel. */
+    ClusterTask task(&clusters, &loss);
+    parallel_for(0, clusters.size(), threadNumber, task);
+
+    /* Bring clusters into a common frame. Camera of an image in the global frame is H = Hc * G, 
+     * where Hc is its camera in the frame of the cluster and G is a rotation from global frame into 
+     * the frame of the cluster. For each shared image with known global camera, Hc^-1 * H is an
+     * estimate of G, and the average of these estimates is projected onto rotations. */
+    typedef std::pair<std::pair<size_t, size_t>, size_t> ClusterPriority; /* ((shared, coreSize), -index). */
+    std::priority_queue<ClusterPriority> order;
+    std::vector<size_t> sharedNumbers(clusters.size(), 0);
+    for(size_t ci = 0; ci < clusters.size(); ci++)
+      order.push(ClusterPriority(std::make_pair(0, clusters[ci].coreSize), clusters.size() - ci));
+    std::vector<bool> aligned(clusters.size(), false);
+    std::vector<bool> known(n, false);
+    while(!order.empty()) {
+      /* Pick the cluster with the most shared images with known cameras. The first one is the 
+       * largest. Counts only grow, so queue entries with outdated counts are skipped. */
+      ClusterPriority top = order.top();
+      order.pop();
+      size_t next = clusters.size() - top.second, nextShared = top.first.first;
+      if(aligned[next] || nextShared != sharedNumbers[next])
+        continue;
+
+      Cluster& c = clusters[next];
+      Matrix3f g = Matrix3f::identity();
+      if(nextShared > 0) {
+        Matrix3f sum(0.0f);
+        for(size_t i = 0; i < c.images.size(); i++)
+          if(known[c.images[i]])
+            sum += c.homographies[i].getInverseMatrix() * homographies[c.images[i]].getMatrix();
+        Homography rotation;
+        if(Homography::fromMatrix(sum, rotation))
+          g = Homography(rotation.getParam(0), rotation.getParam(1), rotation.getParam(2), 1.0f).getMatrix();
+      }
 
-    /* Write homographies back. */
-    for(size_t i = 0; i < params.size() / 4; i++)
-      p.getImage(i).setHomography(Homography(params[i * 4], params[i * 4 + 1], params[i * 4 + 2], params[i * 4 + 3]));
+      aligned[next] = true;
+      for(size_t i = 0; i < c.coreSize; i++) {
+        Homography& h = homographies[c.images[i]];
+        if(!Homography::fromMatrix(c.homographies[i].getMatrix() * g, h))
+          h = c.homographies[i];
+        known[c.images[i]] = true;
+
+        const std::vector<size_t>& sharing = clustersOf[c.images[i]];
+        for(size_t k = 0; k < sharing.size(); k++) {
+          size_t ci = sharing[k];
+          if(aligned[ci])
+            continue;
+          sharedNumbers[ci]++;
+          order.push(ClusterPriority(std::make_pair(sharedNumbers[ci], clusters[ci].coreSize), clusters.size() - ci));
+        }
+      }
+    }
+
+    /* Refine cluster boundaries. */
+    std::vector<bool> isFree(n, false);
+    for(size_t i = 0; i < edges.size(); i++)
+      if(clusterOf[edges[i].index0] != clusterOf[edges[i].index1])
+        isFree[edges[i].index0] = isFree[edges[i].index1] = true;
+    std::vector<bool> isFixed(n, false);
+    for(size_t i = 0; i < edges.size(); i++) {
+      if(isFree[edges[i].index0] && !isFree[edges[i].index1])
+        isFixed[edges[i].index1] = true;
+      if(isFree[edges[i].index1] && !isFree[edges[i].index0])
+        isFixed[edges[i].index0] = true;
+    }
+
+    std::vector<size_t> freeCameras, fixedCameras;
+    for(size_t i = 0; i < n; i++) {
+      if(isFree[i])
+        freeCameras.push_back(i);
+      else if(isFixed[i])
+        fixedCameras.push_back(i);
+    }
+    adjust(edges, freeCameras, fixedCameras, homographies, loss, threadNumber);
   }
-}
 
 
+  void Optimizer::optimize(Panorama& p) {
+    if(p.size() == 0)
+      return;
+
+    RobustLoss loss(this->lossFunction, this->lossScale);
 
+    /* Create id -> index map. */
+    Map<int, size_t> indexes;
+    for(size_t i = 0; i < p.size(); i++)
+      indexes[p.getImage(i).getId()] = i;
 
+    /* Create match graph. */
+    std::vector<MatchEdge> edges;
+    for(size_t i = 0; i < p.getImageMatches().size(); i++) {
+      const ImageMatch& im = p.getImageMatch(i);
+      edges.push_back(MatchEdge(indexes[im.getPanoImage(0).getId()], indexes[im.getPanoImage(1).getId()], im));
+    }
 
+    std::vector<Homography> homographies(p.size());
+    if(this->maxClusterSize != 0 && p.size() > this->maxClusterSize)
+      adjustPartitioned(edges, homographies, this->maxClusterSize, loss, this->threadNumber);
+    else
+      adjustIncrementally(edges, homographies, loss, this->threadNumber);
 
+    /* Write homographies back. */
+    for(size_t i = 0; i < p.size(); i++)
+      p.getImage(i).setHomography(homographies[i]);
+  }
+}
@@ -10,9 +10,69 @@ namespace prec {
    * 
    */
   class Optimizer {
+  public:
+    /** Loss function applied to reprojection errors in bundle adjustment. */
+    enum LossFunction {
+      SQUARED_LOSS,  /**< Plain least squares. */
+      HUBER_LOSS,    /**< Squared for errors below loss scale, linear above it. */
+      CAUCHY_LOSS    /**< Logarithmic, strongly suppresses errors much greater than loss scale. */
+    };
+
   private:
+    unsigned int threadNumber;
+    LossFunction lossFunction;
+    float lossScale;
+    std::size_t maxClusterSize;
 
   public:
+    Optimizer(): threadNumber(0), lossFunction(SQUARED_LOSS), lossScale(0.01f), maxClusterSize(64) {}
+
+    /**
+     * @param threadNumber             Number of threads to use in bundle adjustment, zero means the number of processors.
+     *                                 Results don't depend on the number of threads.
+     */
+    void setThreadNumber(unsigned int threadNumber) {
+      this->threadNumber = threadNumber;
+    }
+
+    unsigned int getThreadNumber() const {
+      return this->threadNumber;
+    }
+
+    /**
+     * Robust loss functions reduce the influence of wrong matches that survived RANSAC. They are
+     * minimized with iteratively reweighted least squares.
+     *
+     * @param lossFunction             Loss function.
+     * @param lossScale                Reprojection error, in keypoint coordinates, above which errors are treated as outliers.
+     */
+    void setLossFunction(LossFunction lossFunction, float lossScale) {
+      this->lossFunction = lossFunction;
+      this->lossScale = lossScale;
+    }
+
+    LossFunction getLossFunction() const {
+      return this->lossFunction;
+    }
+
+    float getLossScale() const {
+      return this->lossScale;
+    }
+
+    /**
+     * Panoramas with more images than the given number are split into overlapping clusters of at 
+     * most this number of images, which are adjusted independently and then aligned.
+     *
+     * @param maxClusterSize           Maximal number of images in a cluster, zero means that panoramas are never split.
+     */
+    void setMaxClusterSize(std::size_t maxClusterSize) {
+      this->maxClusterSize = maxClusterSize;
+    }
+
+    std::size_t getMaxClusterSize() const {
+      return this->maxClusterSize;
+    }
+
     void optimize(Panorama& p);
 
   };
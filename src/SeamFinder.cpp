@@ -0,0 +1,172 @@
+#include "config.h"
+#include <cassert>
+#include <cmath>
+#include <algorithm>
+#include <arx/Thread.h>
+#include "SeamFinder.h"
+
+using namespace arx;
+using namespace std;
+
+namespace prec {
+  /** Cost of a seam passing through a pixel outside the overlap on a line that has an overlap,
+   * so that seams stay inside it when possible. Costs are accumulated in double, so that these do
+   * not swamp the differences inside the overlap. */
+  static const double OUTSIDE_OVERLAP_COST = 1.0e6;
+
+  /**
+   * PairTask finds the seam between a pair of overlapping images. The seam runs across the line
+   * connecting the centers of the images: if they are displaced horizontally, the seam goes from
+   * top to bottom with one pixel per row, and pixels on each side of it go to the image on that
+   * side.
+   */
+  class SeamFinder::PairTask {
+  private:
+    const vector<SeamImage>& images;
+    vector<SeamPair>& pairs;
+
+  public:
+    PairTask(const vector<SeamImage>& images, vector<SeamPair>& pairs): images(images), pairs(pairs) {}
+
+    void operator() (size_t k) {
+      SeamPair& p = this->pairs[k];
+      const SeamImage& a = this->images[p.a];
+      const SeamImage& b = this->images[p.b];
+      int w = p.x1 - p.x0, h = p.y1 - p.y0;
+
+      float dx = (b.x + 0.5f * b.weight.getWidth()) - (a.x + 0.5f * a.weight.getWidth());
+      float dy = (b.y + 0.5f * b.weight.getHeight()) - (a.y + 0.5f * a.weight.getHeight());
+      bool vertical = abs(dx) >= abs(dy);
+      bool aFirst = vertical ? (dx > 0) : (dy > 0);
+      int lines = vertical ? h : w, length = vertical ? w : h;
+
+      /* Accumulated costs of the cheapest seams ending at each position of each line. Lines
+       * without any overlap cost nothing, so the seam may take any position on them. */
+      vector<double> cost(lines * length);
+      for(int l = 0; l < lines; l++) {
+        double* c = &cost[l * length];
+        bool overlaps = false;
+        for(int i = 0; i < length; i++) {
+          int x = p.x0 + (vertical ? i : l), y = p.y0 + (vertical ? l : i);
+          float wa = a.weight.getPixel(x - a.x, y - a.y), wb = b.weight.getPixel(x - b.x, y - b.y);
+          if(wa > 0 && wb > 0) {
+            double d = a.intensity.getPixel(x - a.x, y - a.y) - b.intensity.getPixel(x - b.x, y - b.y);
+            c[i] = d * d;
+            overlaps = true;
+          } else
+            c[i] = -1.0;
+        }
+
+        for(int i = 0; i < length; i++) {
+          if(c[i] < 0)
+            c[i] = overlaps ? OUTSIDE_OVERLAP_COST : 0.0;
+          if(l > 0) {
+            const double* prev = c - length;
+            double best = prev[i];
+            if(i > 0)
+              best = min(best, prev[i - 1]);
+            if(i + 1 < length)
+              best = min(best, prev[i + 1]);
+            c[i] += best;
+          }
+        }
+      }
+
+      /* Trace the seam back from its cheapest end, and split each line at it. */
+      const double* last = &cost[(lines - 1) * length];
+      int s = (int) (min_element(last, last + length) - last);
+      p.aWins.resize(w * h);
+      for(int l = lines - 1; l >= 0; l--) {
+        if(l < lines - 1) {
+          const double* c = &cost[l * length];
+          int from = max(s - 1, 0), to = min(s + 1, length - 1);
+          s = (int) (min_element(c + from, c + to + 1) - c);
+        }
+        for(int i = 0; i < length; i++) {
+          int x = vertical ? i : l, y = vertical ? l : i;
+          p.aWins[y * w + x] = (i < s) == aFirst;
+        }
+      }
+    }
+  };
+
+
+  void SeamFinder::addImage(const Image1f& intensity, const Image1f& weight, int x, int y) {
+    assert(intensity.getWidth() == weight.getWidth() && intensity.getHeight() == weight.getHeight());
+    assert(x >= 0 && y >= 0 && x + weight.getWidth() <= this->width && y + weight.getHeight() <= this->height);
+
+    SeamImage image;
+    image.intensity = intensity;
+    image.weight = weight;
+    image.x = x;
+    image.y = y;
+    this->images.push_back(image);
+  }
+
+  void SeamFinder::find(vector<int>& labels) const {
+    vector<SeamPair> pairs;
+    for(size_t i = 0; i < this->images.size(); i++) {
+      for(size_t j = i + 1; j < this->images.size(); j++) {
+        const SeamImage& a = this->images[i];
+        const SeamImage& b = this->images[j];
+        SeamPair p;
+        p.a = (int) i;
+        p.b = (int) j;
+        p.x0 = max(a.x, b.x);
+        p.y0 = max(a.y, b.y);
+        p.x1 = min(a.x + a.weight.getWidth(), b.x + b.weight.getWidth());
+        p.y1 = min(a.y + a.weight.getHeight(), b.y + b.weight.getHeight());
+        if(p.x0 < p.x1 && p.y0 < p.y1)
+          pairs.push_back(p);
+      }
+    }
+
+    PairTask task(this->images, pairs);
+    parallel_for(0, pairs.size(), this->threadNumber, task);
+
+    /* Count the pairwise decisions each image wins at each pixel of its rectangle, going over
+     * each pair's intersection once. */
+    vector<vector<int> > wins(this->images.size());
+    for(size_t i = 0; i < this->images.size(); i++)
+      wins[i].assign(this->images[i].weight.getWidth() * this->images[i].weight.getHeight(), 0);
+    for(size_t k = 0; k < pairs.size(); k++) {
+      const SeamPair& p = pairs[k];
+      const SeamImage& a = this->images[p.a];
+      const SeamImage& b = this->images[p.b];
+      for(int y = p.y0; y < p.y1; y++) {
+        for(int x = p.x0; x < p.x1; x++) {
+          if(a.weight.getPixel(x - a.x, y - a.y) <= 0 || b.weight.getPixel(x - b.x, y - b.y) <= 0)
+            continue;
+          if(p.aWins[(y - p.y0) * (p.x1 - p.x0) + (x - p.x0)])
+            wins[p.a][(y - a.y) * a.weight.getWidth() + (x - a.x)]++;
+          else
+            wins[p.b][(y - b.y) * b.weight.getWidth() + (x - b.x)]++;
+        }
+      }
+    }
+
+    /* Each pixel goes to the covering image that wins the most pairwise decisions. Ties, which
+     * are possible with three or more images, are resolved by weight. */
+    labels.assign(this->width * this->height, -1);
+    vector<int> bestWins(this->width * this->height, 0);
+    vector<float> bestWeights(this->width * this->height, 0.0f);
+    for(size_t i = 0; i < this->images.size(); i++) {
+      const SeamImage& image = this->images[i];
+      for(int y = 0; y < image.weight.getHeight(); y++) {
+        for(int x = 0; x < image.weight.getWidth(); x++) {
+          float weight = image.weight.getPixel(x, y);
+          if(weight <= 0)
+            continue;
+          int n = wins[i][y * image.weight.getWidth() + x];
+          int pixel = (image.y + y) * this->width + (image.x + x);
+          if(labels[pixel] < 0 || n > bestWins[pixel] || (n == bestWins[pixel] && weight > bestWeights[pixel])) {
+            labels[pixel] = (int) i;
+            bestWins[pixel] = n;
+            bestWeights[pixel] = weight;
+          }
+        }
+      }
+    }
+  }
+
+} // namespace prec
@@ -0,0 +1,69 @@
+#ifndef __SEAMFINDER_H__
+#define __SEAMFINDER_H__
+
+#include "config.h"
+#include <vector>
+#include "Image.h"
+
+namespace prec {
+  /**
+   * SeamFinder assigns each pixel of a panorama to one of the images that cover it, so that
+   * transitions between images go through places where the images agree. Seams are found with
+   * dynamic programming for each pair of overlapping images, only inside their overlap. For each
+   * row (or column) of the overlap a seam crosses, the seam position with the minimal sum of
+   * squared intensity differences along the seam is found. Pixels covered by more than two images
+   * go to the image that wins the most pairwise decisions.
+   *
+   * Seams are meant to be found at a low resolution and then upsampled. Pairs are processed in
+   * parallel.
+   */
+  class SeamFinder {
+  private:
+    struct SeamImage {
+      Image1f intensity;  /**< Intensities of the image placed in the label map. */
+      Image1f weight;     /**< Coverage weights, zero where the image is not defined. */
+      int x, y;           /**< Position of the upper-left corner in the label map. */
+    };
+
+    struct SeamPair {
+      int a, b;                     /**< Indices of the images. */
+      int x0, y0, x1, y1;           /**< Intersection of image rectangles, [x0, x1) x [y0, y1). */
+      std::vector<bool> aWins;      /**< For each pixel of the intersection, whether it goes to the first image. */
+    };
+
+    int width, height;
+    unsigned int threadNumber;
+    std::vector<SeamImage> images;
+
+    class PairTask;
+
+  public:
+    /**
+     * Constructor.
+     *
+     * @param width, height            Size of the label map.
+     * @param threadNumber             Number of threads that process image pairs, zero means the number of processors.
+     */
+    SeamFinder(int width, int height, unsigned int threadNumber): width(width), height(height), threadNumber(threadNumber) {}
+
+    /**
+     * Adds an image. Images are labeled in the order they are added.
+     *
+     * @param intensity                Intensities of the image.
+     * @param weight                   Coverage weights of the same size, zero where the image is not defined.
+     *                                 Pixels covered by several images initially go to the image with the greatest weight.
+     * @param x, y                     Position of the upper-left corner of the image in the label map.
+     */
+    void addImage(const Image1f& intensity, const Image1f& weight, int x, int y);
+
+    /**
+     * Finds the seams.
+     *
+     * @param labels                   (out) Label map, width * height indices of images, or -1 for pixels not covered by any image.
+     */
+    void find(std::vector<int>& labels) const;
+  };
+
+} // namespace prec
+
+#endif // __SEAMFINDER_H__
@@ -0,0 +1,204 @@
+#include "config.h"
+#include <fstream>
+#include <stdexcept>
+#include <arx/Thread.h>
+#include "StitchPlan.h"
+#include "Warper.h"
+
+using namespace arx;
+using namespace std;
+
+namespace prec {
+  /** Magic number of stitch plan files, "PRSP". */
+  static const int STITCH_PLAN_MAGIC = 0x50535250;
+
+  /** Version of stitch plan file format. */
+  static const int STITCH_PLAN_VERSION = 1;
+
+  /**
+   * RenderTask renders tiles of a stitch plan in parallel. Thread k renders tiles k, k + n, k + 2n,
+   * ..., where n is the number of threads.
+   */
+  class StitchPlan::RenderTask {
+  private:
+    const StitchPlan::StitchPlanData& plan;
+    const ArrayList<Image3f>& frame;
+    Image4f& result;
+    unsigned int threadNumber;
+
+  public:
+    RenderTask(const StitchPlan::StitchPlanData& plan, const ArrayList<Image3f>& frame, Image4f& result, unsigned int threadNumber):
+      plan(plan), frame(frame), result(result), threadNumber(threadNumber) {}
+
+    void operator() (size_t thread) {
+      Image4f tile(this->plan.tileWidth, this->plan.tileHeight);
+      for(size_t i = thread; i < this->plan.tiles.size(); i += this->threadNumber) {
+        const StitchPlan::Tile& t = this->plan.tiles[i];
+        tile.fill(Color4f(0, 0, 0, 0));
+
+        size_t offset = t.offset;
+        for(size_t r = t.runBegin; r < t.runEnd; r++) {
+          const StitchPlan::Run& run = this->plan.runs[r];
+          Warper<Image3f>::accumulateRun(this->frame[run.image], &this->plan.sx[offset], &this->plan.sy[offset], &this->plan.weights[offset], run.n, tile.getRow(run.y) + run.x);
+          offset += run.n;
+        }
+
+        normalizeAccumulated(tile);
+        this->result.draw(tile, t.x, t.y);
+      }
+    }
+  };
+
+  void StitchPlan::render(const ArrayList<Image3f>& frame, Image4f& result, unsigned int threadNumber) const {
+    if(frame.size() != data->imageSizes.size())
+      throw runtime_error("Could not render stitch plan: wrong number of images");
+    for(size_t i = 0; i < frame.size(); i++)
+      if(frame[i].getWidth() != data->imageSizes[i].first || frame[i].getHeight() != data->imageSizes[i].second)
+        throw runtime_error("Could not render stitch plan: image size differs from the one the plan was baked for");
+
+    if(result.isNull() || result.getWidth() != data->width || result.getHeight() != data->height)
+      result = Image4f(data->width, data->height);
+
+    if(threadNumber == 0)
+      threadNumber = hardware_concurrency();
+    RenderTask task(*data, frame, result, threadNumber);
+    parallel_for(0, threadNumber, threadNumber, task);
+  }
+
+
+// -------------------------------------------------------------------------- //
+// Saving & loading
+// -------------------------------------------------------------------------- //
+  template<class T>
+  static void writeArray(ofstream& f, const T* values, size_t n) {
+    f.write((const char *) values, n * sizeof(T));
+  }
+
+  template<class T>
+  static void writeArray(ofstream& f, const vector<T>& values) {
+    if(!values.empty())
+      writeArray(f, &values[0], values.size());
+  }
+
+  template<class T>
+  static void readArray(ifstream& f, T* values, size_t n, const string& errorMsg) {
+    if(f.read((char *) values, n * sizeof(T)).gcount() != (streamsize) (n * sizeof(T)))
+      throw runtime_error(errorMsg + "unexpected end of file");
+  }
+
+  template<class T>
+  static void readArray(ifstream& f, vector<T>& values, const string& errorMsg) {
+    if(!values.empty())
+      readArray(f, &values[0], values.size(), errorMsg);
+  }
+
+  void StitchPlan::saveToFile(const std::string& fileName) const {
+    ofstream f(fileName.c_str(), ios_base::out | ios_base::binary);
+    if(!f.is_open())
+      throw runtime_error("Could not open stitch plan file \"" + fileName + "\"");
+
+    int header[8] = {STITCH_PLAN_MAGIC, STITCH_PLAN_VERSION, data->width, data->height, data->tileWidth, data->tileHeight, (int) data->imageSizes.size(), (int) data->tiles.size()};
+    writeArray(f, header, 8);
+    for(size_t i = 0; i < data->imageSizes.size(); i++) {
+      int size[2] = {data->imageSizes[i].first, data->imageSizes[i].second};
+      writeArray(f, size, 2);
+    }
+
+    /* Run and coordinate offsets of tiles are restored from the numbers of runs. */
+    for(size_t i = 0; i < data->tiles.size(); i++) {
+      int tile[3] = {data->tiles[i].x, data->tiles[i].y, (int) (data->tiles[i].runEnd - data->tiles[i].runBegin)};
+      writeArray(f, tile, 3);
+    }
+    for(size_t i = 0; i < data->runs.size(); i++) {
+      int run[4] = {data->runs[i].image, data->runs[i].x, data->runs[i].y, data->runs[i].n};
+      writeArray(f, run, 4);
+    }
+    writeArray(f, data->sx);
+    writeArray(f, data->sy);
+    writeArray(f, data->weights);
+
+    if(f.fail())
+      throw runtime_error("Error while writing stitch plan file \"" + fileName + "\"");
+  }
+
+  StitchPlan StitchPlan::loadFromFile(const std::string& fileName) {
+    ifstream f(fileName.c_str(), ios_base::in | ios_base::binary);
+    if(!f.is_open())
+      throw runtime_error("Could not open stitch plan file \"" + fileName + "\"");
+
+    string errorMsg = "Error while reading stitch plan file \"" + fileName + "\": ";
+
+    int header[8];
+    readArray(f, header, 8, errorMsg);
+    if(header[0] != STITCH_PLAN_MAGIC)
+      throw runtime_error(errorMsg + "not a stitch plan file");
+    if(header[1] != STITCH_PLAN_VERSION)
+      throw runtime_error(errorMsg + "unsupported version");
+    if(header[2] <= 0 || header[3] <= 0 || header[4] <= 0 || header[5] <= 0 || header[6] < 0 || header[7] < 0)
+      throw runtime_error(errorMsg + "invalid header");
+
+    StitchPlan result(header[2], header[3], header[4], header[5]);
+    StitchPlanData& data = *result.data;
+
+    data.imageSizes.resize(header[6]);
+    for(size_t i = 0; i < data.imageSizes.size(); i++) {
+      int size[2];
+      readArray(f, size, 2, errorMsg);
+      data.imageSizes[i] = make_pair(size[0], size[1]);
+    }
+
+    size_t runNumber = 0;
+    data.tiles.resize(header[7]);
+    for(size_t i = 0; i < data.tiles.size(); i++) {
+      int tile[3];
+      readArray(f, tile, 3, errorMsg);
+      if(tile[0] < 0 || tile[1] < 0 || tile[0] >= data.width || tile[1] >= data.height || tile[2] < 0)
+        throw runtime_error(errorMsg + "invalid tile");
+      data.tiles[i].x = tile[0];
+      data.tiles[i].y = tile[1];
+      data.tiles[i].runBegin = runNumber;
+      runNumber += tile[2];
+      data.tiles[i].runEnd = runNumber;
+    }
+
+    /* Runs are validated, so that a corrupted file can't make render access memory out of bounds. */
+    size_t pixelNumber = 0;
+    data.runs.resize(runNumber);
+    for(size_t i = 0; i < data.runs.size(); i++) {
+      int run[4];
+      readArray(f, run, 4, errorMsg);
+      Run& r = data.runs[i];
+      r.image = run[0];
+      r.x = run[1];
+      r.y = run[2];
+      r.n = run[3];
+      if(r.image < 0 || r.image >= header[6] || r.x < 0 || r.y < 0 || r.n < 0 || r.y >= data.tileHeight || r.x + r.n > data.tileWidth)
+        throw runtime_error(errorMsg + "invalid run");
+      pixelNumber += r.n;
+    }
+    for(size_t i = 0, offset = 0; i < data.tiles.size(); i++) {
+      data.tiles[i].offset = offset;
+      for(size_t r = data.tiles[i].runBegin; r < data.tiles[i].runEnd; r++)
+        offset += data.runs[r].n;
+    }
+
+    data.sx.resize(pixelNumber);
+    data.sy.resize(pixelNumber);
+    data.weights.resize(pixelNumber);
+    readArray(f, data.sx, errorMsg);
+    readArray(f, data.sy, errorMsg);
+    readArray(f, data.weights, errorMsg);
+
+    /* Bilinear interpolation reads pixels to the right and below the source coordinates. */
+    for(size_t i = 0, offset = 0; i < data.runs.size(); offset += data.runs[i].n, i++) {
+      float maxX = (float) (data.imageSizes[data.runs[i].image].first - 1);
+      float maxY = (float) (data.imageSizes[data.runs[i].image].second - 1);
+      for(size_t k = offset; k < offset + data.runs[i].n; k++)
+        if(data.weights[k] != 0.0f && !(data.sx[k] >= 0 && data.sx[k] < maxX && data.sy[k] >= 0 && data.sy[k] < maxY))
+          throw runtime_error(errorMsg + "source coordinates are out of image bounds");
+    }
+
+    return result;
+  }
+
+} // namespace prec
@@ -0,0 +1,98 @@
+#ifndef __STITCHPLAN_H__
+#define __STITCHPLAN_H__
+
+#include "config.h"
+#include <string>
+#include <vector>
+#include <utility>
+#include "arx/smart_ptr.h"
+#include "arx/Collections.h"
+#include "Image.h"
+
+namespace prec {
+  class Stitcher;
+
+  /**
+   * StitchPlan is a precomputed stitch of a panorama. For each output tile it stores the runs of
+   * pixels covered by each image, together with source coordinates and blend weights of these
+   * pixels. Frames shot with the same camera rig can then be rendered with a pure gather pass,
+   * without calculating any projections.
+   *
+   * Plans are created with Stitcher::bake, and can be saved to and loaded from files.
+   */
+  class StitchPlan {
+  private:
+    /** Run of consecutive pixels of a tile row that are covered by a single image. */
+    struct Run {
+      int image; /**< Index of the image in the panorama. */
+      int x, y;  /**< Position of the first pixel relative to the tile. */
+      int n;     /**< Number of pixels. */
+    };
+
+    struct Tile {
+      int x, y;                         /**< Position of the upper-left corner of the tile in the output. */
+      std::size_t runBegin, runEnd;     /**< Runs of the tile. */
+      std::size_t offset;               /**< Offset of the first pixel of the first run in coordinate arrays. */
+    };
+
+    struct StitchPlanData {
+      int width, height;                /**< Output size. */
+      int tileWidth, tileHeight;        /**< Tile size. */
+      std::vector<std::pair<int, int> > imageSizes; /**< Sizes of the images of the panorama. */
+      std::vector<Tile> tiles;
+      std::vector<Run> runs;
+      std::vector<float> sx, sy, weights; /**< Source coordinates and weights of pixels of all runs. */
+    };
+
+    class RenderTask;
+
+    arx::shared_ptr<StitchPlanData> data;
+
+    StitchPlan(int width, int height, int tileWidth, int tileHeight): data(new StitchPlanData()) {
+      data->width = width;
+      data->height = height;
+      data->tileWidth = tileWidth;
+      data->tileHeight = tileHeight;
+    }
+
+    friend class Stitcher;
+
+  public:
+    StitchPlan() {}
+
+    bool isNull() const { return data.get() == NULL; }
+
+    /** @return                        Output width. */
+    int getWidth() const { return data->width; }
+
+    /** @return                        Output height. */
+    int getHeight() const { return data->height; }
+
+    /** @return                        Number of images a frame consists of. */
+    std::size_t getImageNumber() const { return data->imageSizes.size(); }
+
+    /**
+     * Renders a frame.
+     *
+     * @param frame                    Images of the frame, in the order of the images of the panorama the plan was baked from.
+     *                                 Their sizes must be the same.
+     * @param result                   (out) Stitched image. It is reused if its size is right, so rendering a sequence
+     *                                 of frames doesn't allocate.
+     * @param threadNumber             Number of threads to use, zero means the number of processors.
+     */
+    void render(const arx::ArrayList<Image3f>& frame, Image4f& result, unsigned int threadNumber = 0) const;
+
+    /**
+     * Saves this plan to a file.
+     */
+    void saveToFile(const std::string& fileName) const;
+
+    /**
+     * Loads a plan from a file.
+     */
+    static StitchPlan loadFromFile(const std::string& fileName);
+  };
+
+} // namespace prec
+
+#endif // __STITCHPLAN_H__
@@ -1,67 +1,839 @@
 #include "config.h"
+#include <cmath>
+#include <cfloat>
+#include <climits>
 #include <utility>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <arx/Thread.h>
 #include "Stitcher.h"
+#include "Warper.h"
+#include "MultiBandBlender.h"
+#include "SeamFinder.h"
+#include "GainCompensator.h"
 
 using namespace arx;
 using namespace std;
 
 namespace prec {
-  class AlphaFallBack: public GenericImageBase<float, AlphaFallBack, false> {
+  /**
+   * StitchSource is an image of a panorama placed in the output.
+   */
+  struct StitchSource {
+    PanoImage image;
+    Image3f pixels;     /**< Pixels to draw, the original image or its downscaled copy. */
+    size_t index;       /**< Index of the image in the panorama. */
+    Matrix3f transform; /**< Transformation from pixels to rays in the coordinate system of the reference camera. */
+    int x0, y0, x1, y1; /**< Bounding box of the image in output, [x0, x1) x [y0, y1). */
+    float gain;         /**< Exposure compensation gain. */
+    int mipLevel;       /**< Mip level of pixels the image is drawn from, the same for all tiles. */
+  };
+
+
+  /**
+   * OutputProjection maps rays in the coordinate system of the reference camera to output pixels.
+   * Planar output is the reference image plane, and warpers map it with a homography. Cylindrical
+   * and equirectangular outputs are mapped with trigonometric tables, which must be built for the
+   * output area that is rendered.
+   */
+  class OutputProjection {
   private:
-    int width;
-    int height;
-    float w;
-    float h;
+    Stitcher::Projection projection;
+    float scale;            /**< Output pixels per unit of the reference plane, or per radian. */
+    float originX, originY; /**< Output position of the center of the reference image. */
+    ProjectionTables tables;
+
+  public:
+    OutputProjection(): projection(Stitcher::PLANAR_PROJECTION), scale(1.0f), originX(0.0f), originY(0.0f) {}
 
-    static float f(float pos, float max) {
-      return 1 - abs(2 * pos / max - 1);
+    OutputProjection(Stitcher::Projection projection, float scale): projection(projection), scale(scale), originX(0.0f), originY(0.0f) {}
+
+    Stitcher::Projection getProjection() const {
+      return this->projection;
     }
 
-  public:
-    typedef float color_type;
+    float getScale() const {
+      return this->scale;
+    }
+
+    /**
+     * Projects a ray onto the output.
+     *
+     * @param ray                      Ray in the coordinate system of the reference camera.
+     * @param x, y                     (out) Output position. Longitudes are in [-pi, pi].
+     * @return                         false if the ray can't be projected.
+     */
+    bool project(const Vector3f& ray, float& x, float& y) const {
+      if(this->projection == Stitcher::PLANAR_PROJECTION) {
+        if(ray[2] < EPS)
+          return false;
+        x = this->originX + this->scale * ray[0] / ray[2];
+        y = this->originY + this->scale * ray[1] / ray[2];
+        return true;
+      }
 
-    AlphaFallBack(int width, int height): width(width), height(height), w((float) (width - 1)), h((float) (height - 1)) {}
+      float r = sqrt(ray[0] * ray[0] + ray[2] * ray[2]);
+      if(r < EPS)
+        return false;
+      x = this->originX + this->scale * atan2(ray[0], ray[2]);
+      if(this->projection == Stitcher::CYLINDRICAL_PROJECTION)
+        y = this->originY + this->scale * ray[1] / r;
+      else
+        y = this->originY + this->scale * atan2(ray[1], r);
+      return true;
+    }
+
+    /**
+     * @return                         Output width of the full circle of longitudes.
+     */
+    float getFullTurn() const {
+      return 2 * PI * this->scale;
+    }
+
+    /**
+     * @return                         Output row of the given pole of the equirectangular projection, -1 for the upper one, 1 for the lower one.
+     */
+    float getPoleY(int pole) const {
+      return this->originY + this->scale * pole * PI / 2;
+    }
+
+    void moveOrigin(float dx, float dy) {
+      this->originX += dx;
+      this->originY += dy;
+    }
+
+    /**
+     * @return                         Copy of this projection for output scaled by the given factor, without tables.
+     */
+    OutputProjection scaled(float factor) const {
+      OutputProjection result(this->projection, this->scale * factor);
+      result.originX = this->originX * factor;
+      result.originY = this->originY * factor;
+      return result;
+    }
 
-    int getWidth() const { return width; }
+    /**
+     * Builds tables for the output rectangle [x0, x1) x [y0, y1).
+     */
+    void buildTables(int x0, int y0, int x1, int y1) {
+      if(this->projection == Stitcher::PLANAR_PROJECTION)
+        return;
 
-    int getHeight() const { return height; }
+      this->tables.x0 = x0;
+      this->tables.y0 = y0;
+      this->tables.colSin.resize(x1 - x0);
+      this->tables.colCos.resize(x1 - x0);
+      for(int x = x0; x < x1; x++) {
+        float longitude = (x - this->originX) / this->scale;
+        this->tables.colSin[x - x0] = sin(longitude);
+        this->tables.colCos[x - x0] = cos(longitude);
+      }
 
-    color_type getPixelInterpolated(float x, float y) const {
-      return f(x, w) * f(y, h);
+      this->tables.rowSin.resize(y1 - y0);
+      this->tables.rowCos.resize(y1 - y0);
+      for(int y = y0; y < y1; y++) {
+        float v = (y - this->originY) / this->scale;
+        if(this->projection == Stitcher::CYLINDRICAL_PROJECTION) {
+          this->tables.rowSin[y - y0] = v;
+          this->tables.rowCos[y - y0] = 1.0f;
+        } else {
+          this->tables.rowSin[y - y0] = sin(v);
+          this->tables.rowCos[y - y0] = cos(v);
+        }
+      }
     }
 
-    color_type getPixel(int x, int y) const {
-      return f((float) x, w) * f((float) y, h);
+    /**
+     * Creates a warper that draws an image onto a part of the output.
+     *
+     * @param image                    Image to draw.
+     * @param m                        Transformation from image pixels to rays.
+     * @param x, y                     Output position of the upper-left corner of the destination.
+     */
+    template<class SourceImage>
+    Warper<SourceImage> createWarper(const SourceImage& image, const Matrix3f& m, int x, int y) const {
+      if(this->projection == Stitcher::PLANAR_PROJECTION)
+        return Warper<SourceImage>(image, Matrix3f::translation(this->originX - x, this->originY - y) * Matrix3f::scale(this->scale) * m);
+      else
+        return Warper<SourceImage>(image, m, this->tables, x, y);
     }
   };
 
-  Image4f Stitcher::stitch(Panorama p) {
-    Image4f result(4000, 4000);
-    result.fill(Color4f(0, 0, 0, 0));
 
-    Matrix3f toCenter = Matrix3f::translation(2000, 2000);
+  /**
+   * Calculates the bounding box of an image in the output. In planar output, the image of a
+   * rectangle is a quadrilateral, so its corners are enough. In other projections edges are
+   * curved, so points along them are sampled. Images that wrap around the back of the panorama
+   * span the full circle of longitudes, and images that contain a pole of the sphere also span
+   * the latitudes up to the pole.
+   *
+   * @return                           false if the image can't be projected onto the output.
+   */
+  static bool bound(const OutputProjection& output, const Matrix3f& m, float w, float h, float& x0, float& y0, float& x1, float& y1) {
+    const int samples = (output.getProjection() == Stitcher::PLANAR_PROJECTION) ? 1 : 16;
+
+    x0 = y0 = FLT_MAX;
+    x1 = y1 = -FLT_MAX;
+    float firstX = 0.0f, prevX = 0.0f;
+    bool wraps = false;
+    for(int k = 0; k < 4 * samples; k++) {
+      float t = (float) (k % samples) / samples;
+      Vector3f point;
+      switch(k / samples) {
+        case 0: point = Vector3f(t * w, 0, 1); break;
+        case 1: point = Vector3f(w, t * h, 1); break;
+        case 2: point = Vector3f((1 - t) * w, h, 1); break;
+        default: point = Vector3f(0, (1 - t) * h, 1); break;
+      }
+
+      float x, y;
+      if(!output.project(m * point, x, y))
+        return false;
+
+      /* Longitudes of neighbouring samples differ by almost a full turn where the edge crosses the back. */
+      if(k == 0)
+        firstX = x;
+      else if(abs(x - prevX) > 0.5f * output.getFullTurn())
+        wraps = true;
+      prevX = x;
+      x0 = min(x0, x);
+      y0 = min(y0, y);
+      x1 = max(x1, x);
+      y1 = max(y1, y);
+    }
+    if(output.getProjection() == Stitcher::PLANAR_PROJECTION)
+      return true;
+    if(abs(firstX - prevX) > 0.5f * output.getFullTurn())
+      wraps = true;
+
+    Matrix3f inverse = m.inverse();
+    for(int pole = -1; pole <= 1; pole += 2) {
+      Vector3f p = inverse * Vector3f(0, (float) pole, 0);
+      if(p[2] < EPS || p[0] < 0 || p[0] > w * p[2] || p[1] < 0 || p[1] > h * p[2])
+        continue;
+
+      /* Cylinder extends to infinity at the poles. */
+      if(output.getProjection() == Stitcher::CYLINDRICAL_PROJECTION)
+        return false;
+
+      y0 = min(y0, output.getPoleY(pole));
+      y1 = max(y1, output.getPoleY(pole));
+      wraps = true;
+    }
 
+    if(wraps) {
+      float backX, backY;
+      output.project(Vector3f(0, 0, -1), backX, backY);
+      x0 = backX - output.getFullTurn();
+      x1 = backX;
+    }
+    return true;
+  }
+
+
+  /**
+   * Places the images of the given panorama in the output and calculates its bounds. Images that
+   * can't be projected onto the output are skipped, i.e. images that have corners behind the
+   * reference image plane, or, in cylindrical output, images that contain a pole.
+   *
+   * @param p                          Panorama.
+   * @param projection                 Output projection.
+   * @param outputScale                Size of a unit of keypoint coordinates in output pixels, zero means the resolution of source images.
+   * @param sources                    (out) Images placed in the output.
+   * @param output                     (out) Output projection.
+   * @param width                      (out) Output width.
+   * @param height                     (out) Output height.
+   */
+  static void layout(Panorama p, Stitcher::Projection projection, float outputScale, vector<StitchSource>& sources, OutputProjection& output, int& width, int& height) {
+    if(outputScale <= 0.0f) {
+      outputScale = 0.0f;
+      for(size_t i = 0; i < p.size(); i++)
+        outputScale += 1.0f / p.getImage(i).getKeyPointScaleFactor();
+      outputScale /= max((size_t) 1, p.size());
+    }
+    output = OutputProjection(projection, outputScale);
+
+    sources.clear();
+    float minX = FLT_MAX, minY = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX;
     for(size_t i = 0; i < p.size(); i++) {
       PanoImage image = p.getImage(i);
-      result.drawBlended(createImageAlphaComposition<float>(image.getOriginal(), AlphaFallBack(image.getOriginal().getWidth(), image.getOriginal().getHeight())),
-        toCenter * 
-        Matrix3f::scale(1000) *
-        image.getHomography().getInverseMatrix() * 
+      float w = (float) image.getOriginal().getWidth();
+      float h = (float) image.getOriginal().getHeight();
+      Matrix3f m =
+        image.getHomography().getInverseMatrix() *
         Matrix3f::scale(image.getKeyPointScaleFactor()) *
-        Matrix3f::translation(image.getOriginal().getWidth() / -2.0f, image.getOriginal().getHeight() / -2.0f),
-        BlendFunc::PLUS<true, true, false>());
+        Matrix3f::translation(w / -2.0f, h / -2.0f);
 
-      /*result.draw(image.getOriginal(),
-        toCenter * 
-        Matrix3f::scale(1000) *
-        image.getHomography().getInverseMatrix() * 
-        Matrix3f::scale(image.getKeyPointScaleFactor()) *
-        Matrix3f::translation(image.getOriginal().getWidth() / -2.0f, image.getOriginal().getHeight() / -2.0f));*/
+      float x0, y0, x1, y1;
+      if(!bound(output, m, w, h, x0, y0, x1, y1))
+        continue;
+
+      StitchSource source;
+      source.image = image;
+      source.pixels = image.getOriginal();
+      source.index = i;
+      source.transform = m;
+      source.gain = 1.0f;
+      source.mipLevel = 0;
+      source.x0 = (int) floor(x0);
+      source.y0 = (int) floor(y0);
+      source.x1 = (int) ceil(x1) + 1;
+      source.y1 = (int) ceil(y1) + 1;
+      sources.push_back(source);
+
+      minX = min(minX, x0);
+      minY = min(minY, y0);
+      maxX = max(maxX, x1);
+      maxY = max(maxY, y1);
+    }
+
+    if(sources.empty())
+      throw runtime_error("Could not stitch panorama: no image can be projected onto the output");
+    if(maxX - minX >= INT_MAX / 4 || maxY - minY >= INT_MAX / 4)
+      throw runtime_error("Could not stitch panorama: output is too large");
+
+    /* Move the upper-left corner of the bounding box to the origin. */
+    int offsetX = (int) floor(minX), offsetY = (int) floor(minY);
+    output.moveOrigin((float) -offsetX, (float) -offsetY);
+    width = 1;
+    height = 1;
+    for(size_t i = 0; i < sources.size(); i++) {
+      StitchSource& source = sources[i];
+      source.x0 -= offsetX;
+      source.y0 -= offsetY;
+      source.x1 -= offsetX;
+      source.y1 -= offsetY;
+      width = max(width, source.x1);
+      height = max(height, source.y1);
+    }
+  }
+
+
+  /**
+   * Sets gains of the images placed in the output with GainCompensator.
+   */
+  static void compensateGains(Panorama p, unsigned int threadNumber, vector<StitchSource>& sources) {
+    GainCompensator compensator;
+    compensator.setThreadNumber(threadNumber);
+    vector<float> gains = compensator.compensate(p);
+    for(size_t i = 0; i < sources.size(); i++)
+      sources[i].gain = gains[sources[i].index];
+  }
+
+
+  /**
+   * Chooses the mip level each image is drawn from. The level is found over the whole bounding box
+   * of the image, so that all the tiles draw it at the same sharpness and the result doesn't depend
+   * on the tiling.
+   *
+   * @param output                     Output projection, with tables that cover the bounding boxes of the images.
+   * @param sources                    (in/out) Images placed in the output.
+   */
+  static void selectMipLevels(const OutputProjection& output, vector<StitchSource>& sources) {
+    for(size_t i = 0; i < sources.size(); i++) {
+      StitchSource& source = sources[i];
+      Warper<Image3f> warper = output.createWarper(source.pixels, source.transform, 0, 0);
+      source.mipLevel = warper.findMipLevel(source.x0, source.y0, source.x1, source.y1);
+    }
+  }
+
+
+  /** Number of pixels in the label map seams are found in. */
+  static const int SEAM_MAP_PIXELS = 250000;
+
+  /**
+   * SeamMap assigns pixels of the output to images at a low resolution.
+   */
+  struct SeamMap {
+    float scale;        /**< Size of an output pixel in label map pixels. */
+    int width, height;  /**< Size of the label map. */
+    vector<int> labels; /**< Indices of sources, or -1. */
+
+    /**
+     * @return                         Label of the given output pixel, nearest label for pixels outside the output.
+     */
+    int getLabel(int x, int y) const {
+      int lx = min(max((int) (x * this->scale), 0), this->width - 1);
+      int ly = min(max((int) (y * this->scale), 0), this->height - 1);
+      return this->labels[ly * this->width + lx];
     }
+  };
+
+
+  /**
+   * Finds seams between the images placed in the output. Images are warped from their downscaled
+   * versions into a label map of about SEAM_MAP_PIXELS pixels, so this costs little compared to
+   * the full resolution warp.
+   *
+   * @param sources                    Images placed in the output.
+   * @param output                     Output projection.
+   * @param width, height              Output size.
+   * @param threadNumber               Number of threads that process image pairs.
+   * @param seams                      (out) Seam map.
+   */
+  static void findSeams(const vector<StitchSource>& sources, const OutputProjection& output, int width, int height, unsigned int threadNumber, SeamMap& seams) {
+    seams.scale = min(1.0f, sqrt((float) SEAM_MAP_PIXELS / ((float) width * (float) height)));
+    seams.width = max(1, (int) ceil(width * seams.scale));
+    seams.height = max(1, (int) ceil(height * seams.scale));
+
+    OutputProjection seamOutput = output.scaled(seams.scale);
+    seamOutput.buildTables(0, 0, seams.width, seams.height);
+
+    SeamFinder finder(seams.width, seams.height, threadNumber);
+    for(size_t i = 0; i < sources.size(); i++) {
+      const StitchSource& source = sources[i];
+      const Image1f& image = source.image.getDownScaled();
+      const Image3f& pixels = source.pixels;
+      Matrix3f m =
+        source.transform *
+        Matrix3f::scale((float) pixels.getWidth() / image.getWidth(), (float) pixels.getHeight() / image.getHeight());
 
-    result.drawBlended(createImageConstComposition(result.getWidth(), result.getHeight(), Color4f(0, 0, 0, 0)), 0, 0, BlendFunc::PLUS<false, true, true>());
+      int x0 = min((int) floor(source.x0 * seams.scale), seams.width - 1);
+      int y0 = min((int) floor(source.y0 * seams.scale), seams.height - 1);
+      int x1 = max(x0 + 1, min((int) ceil(source.x1 * seams.scale) + 1, seams.width));
+      int y1 = max(y0 + 1, min((int) ceil(source.y1 * seams.scale) + 1, seams.height));
+      Image1f intensity(x1 - x0, y1 - y0), weight(x1 - x0, y1 - y0);
+      vector<float> buffer(2 * (x1 - x0));
+      float* sx = &buffer[0];
+      float* sy = sx + (x1 - x0);
+
+      Warper<Image1f> warper = seamOutput.createWarper(image, m, x0, y0);
+      for(int y = 0; y < y1 - y0; y++) {
+        float* w = weight.getRow(y);
+        float* c = intensity.getRow(y);
+        warper.mapRun(0, y, x1 - x0, sx, sy, w);
+        for(int x = 0; x < x1 - x0; x++)
+          c[x] = (w[x] > 0) ? image.getPixelInterpolated(sx[x], sy[x]) * source.gain : 0.0f;
+      }
+      finder.addImage(intensity, weight, x0, y0);
+    }
+
+    finder.find(seams.labels);
+  }
+
+
+  /**
+   * @return                           Largest multiple of align that doesn't exceed x, align must be a power of 2.
+   */
+  static int alignDown(int x, int align) {
+    return x & ~(align - 1);
+  }
+
+
+  /** Approximate number of bytes multi-band blending of a tile needs per pixel of its region: masks,
+   * warped and converted images, and the pyramids of the blender. */
+  static const size_t MULTI_BAND_BYTES_PER_PIXEL = 100;
+
+
+  /**
+   * TileRenderer renders tiles of the output with the given blend mode.
+   */
+  class TileRenderer {
+  private:
+    const vector<StitchSource>& sources;
+    const OutputProjection& output;
+    const SeamMap* seams;
+    Stitcher::BlendMode blendMode;
+    int bandNumber;
+    unsigned int bandThreadNumber;
+
+    /**
+     * Checks whether a source intersects the given rectangle [x, x + w) x [y, y + h).
+     */
+    static bool intersects(const StitchSource& source, int x, int y, int w, int h) {
+      return source.x1 > x && source.x0 < x + w && source.y1 > y && source.y0 < y + h;
+    }
+
+    /**
+     * Colors of overlapping images are averaged with weights that fall off towards image borders.
+     */
+    void renderFeathered(int x, int y, Image4f& tile) const {
+      tile.fill(Color4f(0, 0, 0, 0));
+
+      for(size_t i = 0; i < this->sources.size(); i++) {
+        const StitchSource& source = this->sources[i];
+        if(!intersects(source, x, y, tile.getWidth(), tile.getHeight()))
+          continue;
+
+        Warper<Image3f> warper = this->output.createWarper(source.pixels, source.transform, x, y);
+        warper.setGain(source.gain);
+        warper.setMipLevel(source.mipLevel);
+        warper.accumulate(tile, source.x0 - x, source.y0 - y, source.x1 - x, source.y1 - y);
+      }
+
+      normalizeAccumulated(tile);
+    }
+
+    /**
+     * Each pixel is assigned to the image the seam map assigns it to, or if there is no seam map or
+     * that image doesn't cover the pixel, to the image with the greatest feather weight. Images are
+     * blended with MultiBandBlender using these assignments as masks. The tile is blended together with a
+     * margin, in a region aligned to the coarsest level of the pyramid, so that all the tiles build their
+     * pyramids on the same grid and the result doesn't depend on the tiling. Only one warped image is
+     * kept in memory at a time.
+     */
+    void renderMultiBand(int x, int y, Image4f& tile) const {
+      int margin = MultiBandBlender::getMargin(this->bandNumber);
+      int align = 1 << this->bandNumber;
+      int rx = alignDown(x - margin, align), ry = alignDown(y - margin, align);
+      int rw = alignDown(x + tile.getWidth() + margin + align - 1, align) - rx;
+      int rh = alignDown(y + tile.getHeight() + margin + align - 1, align) - ry;
+      int ox = x - rx, oy = y - ry;
+
+      /* First pass calculates the masks, which need the weights of all images. */
+      vector<size_t> overlapping;
+      vector<int> owner(rw * rh, -1);
+      vector<float> ownerPriority(rw * rh, 0.0f);
+      vector<float> buffer(3 * rw);
+      float* sx = &buffer[0];
+      float* sy = sx + rw;
+      float* weights = sy + rw;
+      for(size_t i = 0; i < this->sources.size(); i++) {
+        const StitchSource& source = this->sources[i];
+        if(!intersects(source, rx, ry, rw, rh))
+          continue;
+
+        /* Weights come from the same mip level as colors, so that masks match image borders. */
+        Warper<Image3f> warper = this->output.createWarper(source.pixels, source.transform, rx, ry);
+        warper.setMipLevel(source.mipLevel);
+        for(int ty = max(source.y0 - ry, 0); ty < min(source.y1 - ry, rh); ty++) {
+          warper.mapRun(0, ty, rw, sx, sy, weights);
+          for(int tx = 0; tx < rw; tx++) {
+            /* Feather weights don't exceed 1, so the label from the seam map takes precedence. */
+            float priority = weights[tx];
+            if(priority > 0 && this->seams != NULL && this->seams->getLabel(rx + tx, ry + ty) == (int) i)
+              priority += 2.0f;
+            if(priority > ownerPriority[ty * rw + tx]) {
+              ownerPriority[ty * rw + tx] = priority;
+              owner[ty * rw + tx] = (int) overlapping.size();
+            }
+          }
+        }
+        overlapping.push_back(i);
+      }
+
+      tile.fill(Color4f(0, 0, 0, 0));
+      if(overlapping.empty())
+        return;
+
+      MultiBandBlender blender(rw, rh, this->bandNumber, this->bandThreadNumber);
+      Image4f warped(rw, rh);
+      Image3f color(rw, rh);
+      Image1f coverage(rw, rh), mask(rw, rh);
+      for(size_t k = 0; k < overlapping.size(); k++) {
+        const StitchSource& source = this->sources[overlapping[k]];
+        warped.fill(Color4f(0, 0, 0, 0));
+        Warper<Image3f> warper = this->output.createWarper(source.pixels, source.transform, rx, ry);
+        warper.setGain(source.gain);
+        warper.setMipLevel(source.mipLevel);
+        warper.accumulate(warped, source.x0 - rx, source.y0 - ry, source.x1 - rx, source.y1 - ry);
+
+        for(int ty = 0; ty < rh; ty++) {
+          const Color4f* w = warped.getRow(ty);
+          Color3f* c = color.getRow(ty);
+          float* a = coverage.getRow(ty);
+          float* m = mask.getRow(ty);
+          for(int tx = 0; tx < rw; tx++) {
+            if(w[tx].a > EPS) {
+              float invA = 1.0f / w[tx].a;
+              c[tx] = Color3f(w[tx].r * invA, w[tx].g * invA, w[tx].b * invA);
+              a[tx] = 1.0f;
+            } else {
+              c[tx] = Color3f(0, 0, 0);
+              a[tx] = 0.0f;
+            }
+            m[tx] = (owner[ty * rw + tx] == (int) k) ? 1.0f : 0.0f;
+          }
+        }
+        blender.feed(color, coverage, mask);
+      }
+
+      Image3f blended;
+      blender.blend(blended);
+      for(int ty = 0; ty < tile.getHeight(); ty++) {
+        const Color3f* b = blended.getRow(ty + oy) + ox;
+        const int* o = &owner[(ty + oy) * rw + ox];
+        Color4f* t = tile.getRow(ty);
+        for(int tx = 0; tx < tile.getWidth(); tx++)
+          if(o[tx] >= 0)
+            t[tx] = Color4f(min(1.0f, max(0.0f, b[tx].r)), min(1.0f, max(0.0f, b[tx].g)), min(1.0f, max(0.0f, b[tx].b)), 1.0f);
+      }
+    }
+
+  public:
+    /**
+     * Constructor.
+     *
+     * @param sources                  Images placed in the output.
+     * @param output                   Output projection, with tables covering the tiles and their margins.
+     * @param seams                    Seam map for multi-band blending, or NULL.
+     * @param blendMode                Blend mode.
+     * @param bandNumber               Number of bands for multi-band blending.
+     * @param bandThreadNumber         Number of threads that process bands of a tile.
+     */
+    TileRenderer(const vector<StitchSource>& sources, const OutputProjection& output, const SeamMap* seams, Stitcher::BlendMode blendMode, int bandNumber, unsigned int bandThreadNumber):
+      sources(sources), output(output), seams(seams), blendMode(blendMode), bandNumber(bandNumber), bandThreadNumber(bandThreadNumber) {}
+
+    /**
+     * Renders a tile of the output.
+     *
+     * @param x, y                     Position of the upper-left corner of the tile in the output.
+     * @param tile                     (out) Tile to render into. Pixels that are not covered by any image become transparent.
+     */
+    void render(int x, int y, Image4f& tile) const {
+      if(this->blendMode == Stitcher::MULTI_BAND_BLEND)
+        renderMultiBand(x, y, tile);
+      else
+        renderFeathered(x, y, tile);
+    }
+  };
+
+
+  /**
+   * TileTask renders tiles of the output in parallel and draws them onto an output image. Thread k
+   * renders tiles k, k + n, k + 2n, ..., where n is the number of threads, so that expensive tiles
+   * in overlap regions are spread evenly among threads. Each thread has its own tile buffer, and
+   * tiles don't intersect, so no synchronization is needed.
+   */
+  template<class OutputImage>
+  class TileTask {
+  private:
+    const TileRenderer& renderer;
+    const vector<pair<int, int> >& tiles;
+    int tileWidth, tileHeight;
+    OutputImage& output;
+    int outputY;
+    unsigned int threadNumber;
+
+  public:
+    /**
+     * Constructor.
+     *
+     * @param renderer                 Tile renderer.
+     * @param tiles                    Positions of the upper-left corners of tiles to render.
+     * @param tileWidth, tileHeight    Size of a tile.
+     * @param output                   Image to draw rendered tiles onto.
+     * @param outputY                  Vertical position of the output image in the panorama.
+     * @param threadNumber             Number of threads.
+     */
+    TileTask(const TileRenderer& renderer, const vector<pair<int, int> >& tiles, int tileWidth, int tileHeight, OutputImage& output, int outputY, unsigned int threadNumber):
+      renderer(renderer), tiles(tiles), tileWidth(tileWidth), tileHeight(tileHeight), output(output), outputY(outputY), threadNumber(threadNumber) {}
+
+    void operator() (size_t thread) {
+      Image4f tile(this->tileWidth, this->tileHeight);
+      for(size_t i = thread; i < this->tiles.size(); i += this->threadNumber) {
+        this->renderer.render(this->tiles[i].first, this->tiles[i].second, tile);
+        this->output.draw(tile, this->tiles[i].first, this->tiles[i].second - this->outputY);
+      }
+    }
+  };
+
+
+  /**
+   * Threads that are left over when there are fewer tiles than threads process bands of tiles.
+   */
+  static unsigned int bandThreads(unsigned int threads, size_t tileNumber) {
+    return max(1u, threads / (unsigned int) max((size_t) 1, tileNumber));
+  }
+
+  Image4f Stitcher::stitch(Panorama p) {
+    vector<StitchSource> sources;
+    OutputProjection output;
+    int width, height;
+    layout(p, this->projection, this->outputScale, sources, output, width, height);
+    /* Tiles may stick out of the output, and multi-band blending renders them with margins. */
+    int padding = this->tileSize + ((this->blendMode == MULTI_BAND_BLEND) ? 2 * MultiBandBlender::getMargin(this->bandNumber) : 0);
+    output.buildTables(-padding, -padding, width + padding, height + padding);
+    selectMipLevels(output, sources);
+
+    vector<pair<int, int> > tiles;
+    for(int y = 0; y < height; y += this->tileSize)
+      for(int x = 0; x < width; x += this->tileSize)
+        tiles.push_back(make_pair(x, y));
+
+    unsigned int threads = (this->threadNumber == 0) ? hardware_concurrency() : this->threadNumber;
+    if(this->gainCompensation)
+      compensateGains(p, threads, sources);
+
+    SeamMap seams;
+    bool useSeams = this->blendMode == MULTI_BAND_BLEND && this->seamFinding;
+    if(useSeams)
+      findSeams(sources, output, width, height, threads, seams);
+
+    TileRenderer renderer(sources, output, useSeams ? &seams : NULL, this->blendMode, this->bandNumber, bandThreads(threads, tiles.size()));
+    Image4f result(width, height);
+    TileTask<Image4f> task(renderer, tiles, this->tileSize, this->tileSize, result, 0, threads);
+    parallel_for(0, threads, threads, task);
+
+    return result;
+  }
+
+  void Stitcher::stitch(Panorama p, const std::string& fileName) {
+    vector<StitchSource> sources;
+    OutputProjection output;
+    int width, height;
+    layout(p, this->projection, this->outputScale, sources, output, width, height);
+    /* Tiles may stick out of the output, and multi-band blending renders them with margins. */
+    int padding = this->tileSize + ((this->blendMode == MULTI_BAND_BLEND) ? 2 * MultiBandBlender::getMargin(this->bandNumber) : 0);
+    output.buildTables(-padding, -padding, width + padding, height + padding);
+    selectMipLevels(output, sources);
+
+    /* Finished tiles are kept in a strip of 8-bit pixels until the whole row of tiles is done. The
+     * strip and the tiles that are being rendered at once must fit into memory budget. Feathered
+     * tiles are float images of the strip height, so the strip is made lower if needed. Multi-band 
+     * blending of a tile works on its whole region with margins, so a lower strip would only add 
+     * redundant work. Instead, the strip height is aligned to the coarsest level of the pyramid, and
+     * fewer tiles are rendered at once. */
+    unsigned int threads = (this->threadNumber == 0) ? hardware_concurrency() : this->threadNumber;
+    unsigned int tileThreads = threads;
+    int stripHeight;
+    if(this->blendMode == MULTI_BAND_BLEND) {
+      int margin = MultiBandBlender::getMargin(this->bandNumber);
+      int align = 1 << this->bandNumber;
+      size_t stripRows = this->memoryBudget / 2 / (width * sizeof(Color3b));
+      stripHeight = max(align, alignDown((int) min((size_t) this->tileSize, stripRows), align));
+
+      /* Region origin is aligned down and its end is aligned up, which adds less than 2 * align. */
+      size_t regionSize = (size_t) (this->tileSize + 2 * margin + 2 * align) * (stripHeight + 2 * margin + 2 * align) * MULTI_BAND_BYTES_PER_PIXEL;
+      size_t stripSize = width * sizeof(Color3b) * stripHeight;
+      size_t available = (this->memoryBudget > stripSize) ? this->memoryBudget - stripSize : 0;
+      tileThreads = (unsigned int) max((size_t) 1, min((size_t) threads, available / regionSize));
+    } else {
+      size_t rowSize = width * sizeof(Color3b) + threads * this->tileSize * sizeof(Color4f);
+      stripHeight = (int) max((size_t) 1, min((size_t) this->tileSize, this->memoryBudget / rowSize));
+    }
+
+    if(this->gainCompensation)
+      compensateGains(p, threads, sources);
+
+    SeamMap seams;
+    bool useSeams = this->blendMode == MULTI_BAND_BLEND && this->seamFinding;
+    if(useSeams)
+      findSeams(sources, output, width, height, threads, seams);
+
+    Image3b strip(width, stripHeight);
+    BmpWriter writer(fileName, width, height);
+
+    /* Bmp files are stored bottom-up, so render strips starting from the last one. */
+    vector<pair<int, int> > tiles;
+    for(int y = (height - 1) / stripHeight * stripHeight; y >= 0; y -= stripHeight) {
+      tiles.clear();
+      for(int x = 0; x < width; x += this->tileSize)
+        tiles.push_back(make_pair(x, y));
+
+      TileRenderer renderer(sources, output, useSeams ? &seams : NULL, this->blendMode, this->bandNumber, bandThreads(threads, min(tiles.size(), (size_t) tileThreads)));
+      TileTask<Image3b> task(renderer, tiles, this->tileSize, stripHeight, strip, y, tileThreads);
+      parallel_for(0, tileThreads, tileThreads, task);
+      writer.writeRows(strip, min(stripHeight, height - y));
+    }
+  }
+
+  Image4f Stitcher::preview(Panorama p, int maxWidth, int maxHeight) {
+    assert(maxWidth > 0 && maxHeight > 0);
+
+    vector<StitchSource> sources;
+    OutputProjection output;
+    int width, height;
+    layout(p, this->projection, this->outputScale, sources, output, width, height);
+
+    /* Lay out again at the scale that fits the requested size. Rounding of bounds may add two
+     * pixels to each dimension. */
+    float factor = min((float) max(1, maxWidth - 2) / width, (float) max(1, maxHeight - 2) / height);
+    if(factor < 1.0f)
+      layout(p, this->projection, output.getScale() * factor, sources, output, width, height);
+    output.buildTables(-this->tileSize, -this->tileSize, width + this->tileSize, height + this->tileSize);
+
+    /* Draw each image from a temporary copy resized straight to its bounding box in the preview. 
+     * Resizing samples only the pixels of the copy, so the cost doesn't depend on the resolution of 
+     * source images, and nothing is cached in them. */
+    for(size_t i = 0; i < sources.size(); i++) {
+      StitchSource& source = sources[i];
+      const Image3f& original = source.image.getOriginal();
+      float extent = max((float) (source.x1 - source.x0) / original.getWidth(), (float) (source.y1 - source.y0) / original.getHeight());
+      if(extent >= 1.0f)
+        continue;
+      source.pixels = Image3f(original.resize(extent, extent));
+      source.transform = source.transform * Matrix3f::scale((float) original.getWidth() / source.pixels.getWidth(), (float) original.getHeight() / source.pixels.getHeight());
+    }
+    selectMipLevels(output, sources);
+
+    vector<pair<int, int> > tiles;
+    for(int y = 0; y < height; y += this->tileSize)
+      for(int x = 0; x < width; x += this->tileSize)
+        tiles.push_back(make_pair(x, y));
+
+    unsigned int threads = (this->threadNumber == 0) ? hardware_concurrency() : this->threadNumber;
+    TileRenderer renderer(sources, output, NULL, FEATHER_BLEND, 0, 1);
+    Image4f result(width, height);
+    TileTask<Image4f> task(renderer, tiles, this->tileSize, this->tileSize, result, 0, threads);
+    parallel_for(0, threads, threads, task);
 
     return result;
   }
 
+  StitchPlan Stitcher::bake(Panorama p) {
+    vector<StitchSource> sources;
+    OutputProjection output;
+    int width, height;
+    layout(p, this->projection, this->outputScale, sources, output, width, height);
+    output.buildTables(0, 0, width, height);
+
+    StitchPlan plan(width, height, this->tileSize, this->tileSize);
+    StitchPlan::StitchPlanData& data = *plan.data;
+    for(size_t i = 0; i < p.size(); i++)
+      data.imageSizes.push_back(make_pair(p.getImage(i).getOriginal().getWidth(), p.getImage(i).getOriginal().getHeight()));
+
+    vector<float> buffer(3 * this->tileSize);
+    float* sx = &buffer[0];
+    float* sy = sx + this->tileSize;
+    float* weights = sy + this->tileSize;
+    for(int y = 0; y < height; y += this->tileSize) {
+      for(int x = 0; x < width; x += this->tileSize) {
+        StitchPlan::Tile tile;
+        tile.x = x;
+        tile.y = y;
+        tile.runBegin = data.runs.size();
+        tile.offset = data.sx.size();
+
+        for(size_t i = 0; i < sources.size(); i++) {
+          const StitchSource& source = sources[i];
+          int x0 = max(source.x0 - x, 0), x1 = min(source.x1 - x, min(this->tileSize, width - x));
+          int y0 = max(source.y0 - y, 0), y1 = min(source.y1 - y, min(this->tileSize, height - y));
+          if(x0 >= x1 || y0 >= y1)
+            continue;
+
+          /* Pixels with zero weight are not stored, so rows are split into runs of covered pixels. */
+          Warper<Image3f> warper = output.createWarper(source.pixels, source.transform, x, y);
+          for(int ty = y0; ty < y1; ty++) {
+            warper.mapRun(x0, ty, x1 - x0, sx, sy, weights);
+            for(int k = 0; k < x1 - x0; ) {
+              if(weights[k] == 0.0f) {
+                k++;
+                continue;
+              }
+
+              StitchPlan::Run run;
+              run.image = (int) source.index;
+              run.x = x0 + k;
+              run.y = ty;
+              for(; k < x1 - x0 && weights[k] != 0.0f; k++) {
+                data.sx.push_back(sx[k]);
+                data.sy.push_back(sy[k]);
+                data.weights.push_back(weights[k]);
+              }
+              run.n = x0 + k - run.x;
+              data.runs.push_back(run);
+            }
+          }
+        }
+
+        tile.runEnd = data.runs.size();
+        data.tiles.push_back(tile);
+      }
+    }
+
+    return plan;
+  }
+
 } // namespace prec
@@ -2,22 +2,196 @@
 #define __STITCHER_H__
 
 #include "config.h"
+#include <cassert>
+#include <string>
 #include "arx/smart_ptr.h"
 #include "arx/Collections.h"
 #include "Image.h"
 #include "Panorama.h"
+#include "StitchPlan.h"
 
 namespace prec {
 
+  /**
+   * Stitcher composites the images of a panorama in the plane of the reference image, or on a
+   * cylinder or a sphere around the reference camera. Output bounds are calculated from the
+   * homographies of the images, and output is rendered tile by tile, so that only the images that
+   * overlap a tile are drawn into it. Tiles are rendered in parallel.
+   */
   class Stitcher {
+  public:
+    enum BlendMode {
+      FEATHER_BLEND,   /**< Average of images weighted by distance to image borders. */
+      MULTI_BAND_BLEND /**< Multi-band blending, see MultiBandBlender. */
+    };
+
+    enum Projection {
+      PLANAR_PROJECTION,         /**< Plane of the reference image. Only suitable for narrow panoramas. */
+      CYLINDRICAL_PROJECTION,    /**< Cylinder with vertical axis, columns are longitudes. */
+      EQUIRECTANGULAR_PROJECTION /**< Sphere, columns are longitudes and rows are latitudes. */
+    };
+
   private:
+    Projection projection;
+    float outputScale;
+    int tileSize;
+    std::size_t memoryBudget;
+    unsigned int threadNumber;
+    BlendMode blendMode;
+    int bandNumber;
+    bool seamFinding;
+    bool gainCompensation;
 
   public:
-    Stitcher() {};
+    Stitcher(): projection(PLANAR_PROJECTION), outputScale(0.0f), tileSize(256), memoryBudget(256 * 1024 * 1024), threadNumber(0), blendMode(FEATHER_BLEND), bandNumber(5), seamFinding(true), gainCompensation(true) {};
+
+    /**
+     * @param projection               Output projection. Cylindrical and equirectangular outputs are rendered with
+     *                                 per-column and per-row trigonometric tables. Images that contain a pole
+     *                                 can't be projected onto a cylinder and are skipped.
+     */
+    void setProjection(Projection projection) {
+      this->projection = projection;
+    }
+
+    Projection getProjection() const {
+      return this->projection;
+    }
+
+    /**
+     * @param outputScale              Size of a unit of keypoint coordinates in output pixels. Zero means that
+     *                                 the resolution of the source images is preserved. In cylindrical and
+     *                                 equirectangular outputs a radian of longitude has the size of a unit of the
+     *                                 reference image plane, so the scale at the center of the reference image is the same.
+     */
+    void setOutputScale(float outputScale) {
+      this->outputScale = outputScale;
+    }
+
+    float getOutputScale() const {
+      return this->outputScale;
+    }
+
+    /**
+     * @param tileSize                 Width and height of output tiles in pixels.
+     */
+    void setTileSize(int tileSize) {
+      assert(tileSize > 0);
+      this->tileSize = tileSize;
+    }
+
+    int getTileSize() const {
+      return this->tileSize;
+    }
+
+    /**
+     * @param memoryBudget             Memory in bytes that may be used for output buffers when stitching into
+     *                                 a file. If a row of tiles doesn't fit into it, feathered tiles are made lower,
+     *                                 and multi-band tiles are rendered by fewer threads at once.
+     */
+    void setMemoryBudget(std::size_t memoryBudget) {
+      this->memoryBudget = memoryBudget;
+    }
+
+    std::size_t getMemoryBudget() const {
+      return this->memoryBudget;
+    }
+
+    /**
+     * @param threadNumber             Number of threads that render tiles, zero means the number of processors.
+     *                                 Each thread has its own tile buffer.
+     */
+    void setThreadNumber(unsigned int threadNumber) {
+      this->threadNumber = threadNumber;
+    }
 
+    unsigned int getThreadNumber() const {
+      return this->threadNumber;
+    }
+
+    /**
+     * @param blendMode                Blend mode. Stitch plans are always feathered.
+     * @param bandNumber               Number of bands for multi-band blending. Tiles are blended with a margin
+     *                                 of MultiBandBlender::getMargin(bandNumber) pixels on each side.
+     */
+    void setBlendMode(BlendMode blendMode, int bandNumber = 5) {
+      assert(bandNumber >= 0 && bandNumber < 16);
+      this->blendMode = blendMode;
+      this->bandNumber = bandNumber;
+    }
+
+    BlendMode getBlendMode() const {
+      return this->blendMode;
+    }
+
+    int getBandNumber() const {
+      return this->bandNumber;
+    }
+
+    /**
+     * @param seamFinding              Whether to find seams through overlaps where images agree, see SeamFinder.
+     *                                 Seams are used as blend masks by multi-band blending. Otherwise each pixel
+     *                                 goes to the image whose center is the nearest.
+     */
+    void setSeamFinding(bool seamFinding) {
+      this->seamFinding = seamFinding;
+    }
+
+    bool getSeamFinding() const {
+      return this->seamFinding;
+    }
+
+    /**
+     * @param gainCompensation         Whether to equalize exposures of the images, see GainCompensator. Gains are
+     *                                 calculated from image matches and downscaled images, and applied while warping.
+     *                                 Stitch plans are not compensated, since exposures change between frames.
+     */
+    void setGainCompensation(bool gainCompensation) {
+      this->gainCompensation = gainCompensation;
+    }
+
+    bool getGainCompensation() const {
+      return this->gainCompensation;
+    }
+
+    /**
+     * Stitches the given panorama into memory.
+     *
+     * @param p                        Panorama to stitch.
+     * @return                         Stitched image, pixels that are not covered by any image are transparent.
+     */
     Image4f stitch(Panorama p);
+
+    /**
+     * Stitches the given panorama into a 24-bit bmp file. Rows of tiles are written to the file as
+     * soon as they are rendered, so the panorama doesn't have to fit in memory.
+     *
+     * @param p                        Panorama to stitch.
+     * @param fileName                 Name of the file to write.
+     */
+    void stitch(Panorama p, const std::string& fileName);
+
+    /**
+     * Quickly stitches a small preview of the given panorama. Images are drawn from temporary copies
+     * downscaled to the preview size with feather blending, without gain compensation and seam
+     * finding, so the cost depends on the preview size only.
+     *
+     * @param p                        Panorama to stitch.
+     * @param maxWidth, maxHeight      Maximal size of the preview. Output is not upscaled beyond the output scale.
+     * @return                         Stitched preview, pixels that are not covered by any image are transparent.
+     */
+    Image4f preview(Panorama p, int maxWidth, int maxHeight);
+
+    /**
+     * Precomputes the stitch of the given panorama, so that frames shot with the same camera rig
+     * can be rendered without calculating projections.
+     *
+     * @param p                        Panorama to bake a plan for. Only image sizes and homographies are used.
+     * @return                         Stitch plan.
+     */
+    StitchPlan bake(Panorama p);
   };
 
 } // namespace prec
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,453 @@
+#ifndef __WARPER_H__
+#define __WARPER_H__
+
+#include "config.h"
+#include <cassert>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <arx/LinearAlgebra.h>
+#include "Image.h"
+
+#ifdef USE_SSE
+#  include <xmmintrin.h>
+#endif
+
+namespace prec {
+  namespace detail {
+    /**
+     * Access to the channels of source pixels for Warper. Alpha channel of four-channel images is
+     * treated as coverage, i.e. it multiplies the weight of a pixel.
+     */
+    template<class Color> struct warp_pixel;
+
+    template<> struct warp_pixel<Color3f> {
+      enum { has_alpha = false };
+
+#ifdef USE_SSE
+      /**
+       * Loads two horizontally adjacent pixels. Memory past the second pixel is not touched, so
+       * the last pixel of an image can be loaded safely.
+       */
+      static void load(const Color3f* p, __m128& a, __m128& b) {
+        const float* f = p->asArray;
+        __m128 t = _mm_loadu_ps(f + 2);                    /* r0 b1 g1 r1 */
+        a = _mm_loadu_ps(f);                               /* b0 g0 r0 b1 */
+        b = _mm_shuffle_ps(t, t, _MM_SHUFFLE(3, 3, 2, 1)); /* b1 g1 r1 r1 */
+      }
+#endif
+    };
+
+    template<> struct warp_pixel<Color4f> {
+      enum { has_alpha = true };
+
+#ifdef USE_SSE
+      static void load(const Color4f* p, __m128& a, __m128& b) {
+        a = _mm_loadu_ps(p[0].asArray);
+        b = _mm_loadu_ps(p[1].asArray);
+      }
+#endif
+    };
+
+  } // namespace detail
+
+
+  /**
+   * Trigonometric tables for Warper output in a cylindrical or spherical projection. Output pixel
+   * (x, y) corresponds to the ray (colSin[x] * rowCos[y], rowSin[y], colCos[x] * rowCos[y]) in the
+   * coordinate system of the reference camera, so columns are longitudes, and rows are heights on
+   * a cylinder (rowCos = 1) or latitudes on a sphere.
+   */
+  struct ProjectionTables {
+    int x0, y0;                          /**< Output position of the first entries. */
+    std::vector<float> colSin, colCos;   /**< Sines and cosines of longitudes of columns x0, x0 + 1, ... */
+    std::vector<float> rowSin, rowCos;   /**< Row terms of rows y0, y0 + 1, ... */
+  };
+
+
+// -------------------------------------------------------------------------- //
+// Warper
+// -------------------------------------------------------------------------- //
+  /**
+   * Warper draws an image transformed with a projective transformation onto an accumulation image.
+   * Colors of the source image are added premultiplied by weight, and weights are added to the
+   * alpha channel, so that overlapping images can be averaged afterwards. Weight falls off linearly
+   * towards the borders of the source image.
+   *
+   * Unlike GenericImage::drawBlended, the destination is processed row by row, and homogeneous
+   * source coordinates are stepped incrementally along a row, so a pixel costs three additions and
+   * a division, and affine transformations don't need the division at all. With USE_SSE,
+   * coordinates and weights of four pixels are calculated at once, and bilinear interpolation
+   * processes all channels of a pixel at once.
+   *
+   * Destination may also be a cylindrical or spherical projection described by ProjectionTables,
+   * then the source image is mapped from the rays of destination pixels.
+   *
+   * When the source image is minified, a mip level of it can be sampled instead (see
+   * findMipLevel and setMipLevel), which avoids aliasing and keeps the samples of neighbouring destination
+   * pixels close in memory.
+   *
+   * @param SourceImage                Source image type, Image3f or Image4f.
+   */
+  template<class SourceImage>
+  class Warper {
+  private:
+    typedef typename SourceImage::color_type source_color_type;
+    typedef detail::warp_pixel<source_color_type> pixel_traits;
+
+    const SourceImage* source;
+    arx::Matrix3f inverse;
+    bool affine;
+    const ProjectionTables* tables;
+    int tableX, tableY;
+    float gain;
+
+#ifdef USE_SSE
+    /**
+     * Stores coordinates and feather weights of four pixels. Pixels that are outside the source
+     * image or not in the given mask get zero weight.
+     */
+    void storeFeathered(__m128 px, __m128 py, __m128 mask, float* sx, float* sy, float* weights) const {
+      const float maxX = (float) (this->source->getWidth() - 1), maxY = (float) (this->source->getHeight() - 1);
+      const __m128 one = _mm_set1_ps(1.0f), zero = _mm_setzero_ps();
+
+      /* Feather weight is (1 - |2 * px / maxX - 1|) * (1 - |2 * py / maxY - 1|) inside the image. */
+      __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(px, zero), _mm_cmplt_ps(px, _mm_set1_ps(maxX))), _mm_and_ps(_mm_cmpge_ps(py, zero), _mm_cmplt_ps(py, _mm_set1_ps(maxY))));
+      inside = _mm_and_ps(inside, mask);
+      __m128 tx = _mm_sub_ps(_mm_mul_ps(px, _mm_set1_ps(2.0f / maxX)), one);
+      __m128 ty = _mm_sub_ps(_mm_mul_ps(py, _mm_set1_ps(2.0f / maxY)), one);
+      __m128 fx = _mm_sub_ps(one, _mm_max_ps(tx, _mm_sub_ps(zero, tx)));
+      __m128 fy = _mm_sub_ps(one, _mm_max_ps(ty, _mm_sub_ps(zero, ty)));
+      _mm_storeu_ps(weights, _mm_and_ps(_mm_mul_ps(fx, fy), inside));
+      _mm_storeu_ps(sx, _mm_and_ps(px, inside));
+      _mm_storeu_ps(sy, _mm_and_ps(py, inside));
+    }
+#endif
+
+    /**
+     * Stores coordinates and feather weight of a pixel.
+     */
+    void storeFeathered(float px, float py, bool valid, float* sx, float* sy, float* weights) const {
+      const float maxX = (float) (this->source->getWidth() - 1), maxY = (float) (this->source->getHeight() - 1);
+      if(valid && px >= 0 && px < maxX && py >= 0 && py < maxY) {
+        *sx = px;
+        *sy = py;
+        *weights = (1 - abs(px * 2.0f / maxX - 1)) * (1 - abs(py * 2.0f / maxY - 1));
+      } else {
+        *sx = *sy = *weights = 0.0f;
+      }
+    }
+
+    /**
+     * Version of mapRun for cylindrical and spherical output. Rays of pixels are linear
+     * combinations of table entries, so a pixel costs a few multiply-adds and a division.
+     */
+    void mapProjectedRun(int x, int y, int n, float* sx, float* sy, float* weights) const {
+      const arx::Matrix3f& m = this->inverse;
+      const ProjectionTables& t = *this->tables;
+      int col = x + this->tableX - t.x0, row = y + this->tableY - t.y0;
+      assert(col >= 0 && col + n <= (int) t.colSin.size() && row >= 0 && row < (int) t.rowSin.size());
+
+      /* Source point is rowCos * (m0 * colSin + m2 * colCos) + rowSin * m1, where mk are columns
+       * of the inverse. Rays behind the source camera are rejected. */
+      const float rowCos = t.rowCos[row], rowSin = t.rowSin[row];
+      const float ax = m[0][0] * rowCos, bx = m[0][2] * rowCos, cx = m[0][1] * rowSin;
+      const float ay = m[1][0] * rowCos, by = m[1][2] * rowCos, cy = m[1][1] * rowSin;
+      const float aw = m[2][0] * rowCos, bw = m[2][2] * rowCos, cw = m[2][1] * rowSin;
+      const float* colSin = &t.colSin[col];
+      const float* colCos = &t.colCos[col];
+
+      int i = 0;
+#ifdef USE_SSE
+      const __m128 vax = _mm_set1_ps(ax), vbx = _mm_set1_ps(bx), vcx = _mm_set1_ps(cx);
+      const __m128 vay = _mm_set1_ps(ay), vby = _mm_set1_ps(by), vcy = _mm_set1_ps(cy);
+      const __m128 vaw = _mm_set1_ps(aw), vbw = _mm_set1_ps(bw), vcw = _mm_set1_ps(cw);
+      const __m128 eps = _mm_set1_ps(EPS), one = _mm_set1_ps(1.0f);
+      for(; i + 4 <= n; i += 4) {
+        __m128 s = _mm_loadu_ps(colSin + i), c = _mm_loadu_ps(colCos + i);
+        __m128 hx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vax, s), _mm_mul_ps(vbx, c)), vcx);
+        __m128 hy = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vay, s), _mm_mul_ps(vby, c)), vcy);
+        __m128 hw = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vaw, s), _mm_mul_ps(vbw, c)), vcw);
+        __m128 front = _mm_cmpgt_ps(hw, eps);
+        __m128 invW = _mm_div_ps(one, _mm_max_ps(hw, eps));
+        storeFeathered(_mm_mul_ps(hx, invW), _mm_mul_ps(hy, invW), front, sx + i, sy + i, weights + i);
+      }
+#endif
+      for(; i < n; i++) {
+        float hx = ax * colSin[i] + bx * colCos[i] + cx;
+        float hy = ay * colSin[i] + by * colCos[i] + cy;
+        float hw = aw * colSin[i] + bw * colCos[i] + cw;
+        bool front = hw > EPS;
+        float invW = front ? 1.0f / hw : 0.0f;
+        storeFeathered(hx * invW, hy * invW, front, sx + i, sy + i, weights + i);
+      }
+    }
+
+  public:
+    /**
+     * Calculates feather weights and coordinates of source pixels for a run of destination pixels.
+     * Pixels that are mapped outside the source image get zero weight.
+     *
+     * @param x, y                     Position of the first pixel of the run in the destination image.
+     * @param n                        Number of pixels in the run.
+     * @param sx, sy                   (out) Arrays of n source coordinates.
+     * @param weights                  (out) Array of n weights.
+     */
+    void mapRun(int x, int y, int n, float* sx, float* sy, float* weights) const {
+      if(this->tables != NULL) {
+        mapProjectedRun(x, y, n, sx, sy, weights);
+        return;
+      }
+
+      const arx::Matrix3f& m = this->inverse;
+
+      /* Homogeneous source coordinates of the first pixel, and their steps along x. */
+      float hx = m[0][0] * x + m[0][1] * y + m[0][2];
+      float hy = m[1][0] * x + m[1][1] * y + m[1][2];
+      float hw = m[2][0] * x + m[2][1] * y + m[2][2];
+      const float dx = m[0][0], dy = m[1][0], dw = m[2][0];
+
+      int i = 0;
+#ifdef USE_SSE
+      const __m128 index = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+      const __m128 one = _mm_set1_ps(1.0f), all = _mm_cmpeq_ps(one, one);
+      __m128 vx = _mm_add_ps(_mm_set1_ps(hx), _mm_mul_ps(index, _mm_set1_ps(dx)));
+      __m128 vy = _mm_add_ps(_mm_set1_ps(hy), _mm_mul_ps(index, _mm_set1_ps(dy)));
+      __m128 vw = _mm_add_ps(_mm_set1_ps(hw), _mm_mul_ps(index, _mm_set1_ps(dw)));
+      const __m128 stepX = _mm_set1_ps(4 * dx), stepY = _mm_set1_ps(4 * dy), stepW = _mm_set1_ps(4 * dw);
+      for(; i + 4 <= n; i += 4) {
+        __m128 px = vx, py = vy;
+        if(!this->affine) {
+          __m128 invW = _mm_div_ps(one, vw);
+          px = _mm_mul_ps(px, invW);
+          py = _mm_mul_ps(py, invW);
+        }
+
+        storeFeathered(px, py, all, sx + i, sy + i, weights + i);
+
+        vx = _mm_add_ps(vx, stepX);
+        vy = _mm_add_ps(vy, stepY);
+        vw = _mm_add_ps(vw, stepW);
+      }
+      hx += i * dx;
+      hy += i * dy;
+      hw += i * dw;
+#endif
+      for(; i < n; i++) {
+        float invW = this->affine ? 1.0f : 1.0f / hw;
+        storeFeathered(hx * invW, hy * invW, true, sx + i, sy + i, weights + i);
+        hx += dx;
+        hy += dy;
+        hw += dw;
+      }
+    }
+
+    /**
+     * Samples the given image with bilinear interpolation and adds the results premultiplied by
+     * weights to the given row of the destination image. Coordinates and weights may be stored
+     * and reused with other images of the same size.
+     *
+     * @param source                   Image to sample.
+     * @param sx, sy                   Arrays of n source coordinates.
+     * @param weights                  Array of n weights, pixels with zero weight are skipped.
+     * @param n                        Number of pixels.
+     * @param dst                      Destination row.
+     * @param gain                     Factor to multiply colors by.
+     */
+    static void accumulateRun(const SourceImage& source, const float* sx, const float* sy, const float* weights, int n, Color4f* dst, float gain = 1.0f) {
+      const char* data = reinterpret_cast<const char*>(source.getRow(0));
+      const int wStep = source.getWStep();
+
+#ifdef USE_SSE
+      const __m128 one = _mm_set1_ps(1.0f);
+      const __m128 gains = _mm_set_ps(1.0f, gain, gain, gain);
+#endif
+      for(int i = 0; i < n; i++) {
+        if(weights[i] == 0.0f)
+          continue;
+
+        int ix = (int) sx[i], iy = (int) sy[i];
+        float fx = sx[i] - ix, fy = sy[i] - iy;
+        const source_color_type* p0 = reinterpret_cast<const source_color_type*>(data + iy * wStep) + ix;
+        const source_color_type* p1 = reinterpret_cast<const source_color_type*>(data + (iy + 1) * wStep) + ix;
+
+#ifdef USE_SSE
+        __m128 a0, b0, a1, b1;
+        pixel_traits::load(p0, a0, b0);
+        pixel_traits::load(p1, a1, b1);
+        __m128 vfx = _mm_set1_ps(fx);
+        __m128 top = _mm_add_ps(a0, _mm_mul_ps(vfx, _mm_sub_ps(b0, a0)));
+        __m128 bottom = _mm_add_ps(a1, _mm_mul_ps(vfx, _mm_sub_ps(b1, a1)));
+        __m128 c = _mm_add_ps(top, _mm_mul_ps(_mm_set1_ps(fy), _mm_sub_ps(bottom, top)));
+
+        __m128 w = _mm_set1_ps(weights[i]);
+        if(pixel_traits::has_alpha)
+          w = _mm_mul_ps(w, _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 3, 3)));
+        /* Color channels are kept in lanes 0-2, lane 3 becomes 1 and accumulates the weight. */
+        c = _mm_shuffle_ps(c, _mm_unpackhi_ps(c, one), _MM_SHUFFLE(1, 0, 1, 0));
+        _mm_storeu_ps(dst[i].asArray, _mm_add_ps(_mm_loadu_ps(dst[i].asArray), _mm_mul_ps(_mm_mul_ps(c, gains), w)));
+#else
+        float w = weights[i];
+        float c[4];
+        for(int k = 0; k < channels<source_color_type>::value; k++) {
+          float top = p0[0].asArray[k] + fx * (p0[1].asArray[k] - p0[0].asArray[k]);
+          float bottom = p1[0].asArray[k] + fx * (p1[1].asArray[k] - p1[0].asArray[k]);
+          c[k] = top + fy * (bottom - top);
+        }
+        if(pixel_traits::has_alpha)
+          w *= c[3];
+        float gw = gain * w;
+        dst[i].b += c[0] * gw;
+        dst[i].g += c[1] * gw;
+        dst[i].r += c[2] * gw;
+        dst[i].a += w;
+#endif
+      }
+    }
+
+    /**
+     * Constructor.
+     *
+     * @param source                   Image to draw. It is referenced, not copied, and must outlive the warper.
+     * @param m                        Transformation from source pixel coordinates to destination pixel coordinates.
+     */
+    Warper(const SourceImage& source, const arx::Matrix3f& m): source(&source), inverse(m.inverse()), tables(NULL), tableX(0), tableY(0), gain(1.0f) {
+      if(abs(this->inverse[2][2]) > EPS)
+        this->inverse /= this->inverse[2][2];
+
+      /* Last row of an affine transformation is (0, 0, 1), then homogeneous coordinate is always 1. */
+      this->affine = abs(this->inverse[2][0]) < 1.0e-7 && abs(this->inverse[2][1]) < 1.0e-7 && abs(this->inverse[2][2] - 1) < 1.0e-7;
+    }
+
+    /**
+     * Constructor for cylindrical and spherical destinations.
+     *
+     * @param source                   Image to draw. It is referenced, not copied, and must outlive the warper.
+     * @param m                        Transformation from source pixel coordinates to rays in the coordinate system of the
+     *                                 reference camera. Its sign matters: rays are in front of the source camera if
+     *                                 their image under the inverse has positive homogeneous coordinate.
+     * @param tables                   Tables of the destination projection. They are referenced, not copied, and must cover
+     *                                 all the destination pixels that are drawn.
+     * @param x, y                     Output position of the upper-left corner of the destination image.
+     */
+    Warper(const SourceImage& source, const arx::Matrix3f& m, const ProjectionTables& tables, int x, int y):
+      source(&source), inverse(m.inverse()), affine(false), tables(&tables), tableX(x), tableY(y), gain(1.0f) {}
+
+    /**
+     * @param gain                     Factor to multiply colors of the source image by, for exposure compensation.
+     */
+    void setGain(float gain) {
+      this->gain = gain;
+    }
+
+    /**
+     * Finds the mip level of the source image that matches the minification over the given
+     * rectangle of the destination. Footprint of a destination pixel in the source is estimated
+     * from the Jacobian of the mapping, calculated with finite differences at a 3x3 grid of points
+     * of the rectangle, and the smallest footprint among the points mapped inside the source image
+     * is used, so that the result is never blurrier than the sharpest part of the rectangle. The
+     * chosen level is the coarsest one whose pixels are not larger than that footprint.
+     *
+     * The level should be found once for the whole image placed in the destination, so that all
+     * the parts it is drawn in get the same sharpness.
+     *
+     * @param x0, y0, x1, y1           Rectangle of the destination, [x0, x1) x [y0, y1).
+     * @return                         Mip level for setMipLevel.
+     */
+    int findMipLevel(int x0, int y0, int x1, int y1) const {
+      using namespace std;
+
+      if(x1 - x0 < 2 || y1 - y0 < 2)
+        return 0;
+
+      float footprint = -1.0f;
+      for(int j = 0; j < 3; j++) {
+        for(int i = 0; i < 3; i++) {
+          int x = x0 + (x1 - x0 - 2) * i / 2, y = y0 + (y1 - y0 - 2) * j / 2;
+          float sx[3], sy[3], weights[3];
+          mapRun(x, y, 2, sx, sy, weights);
+          mapRun(x, y + 1, 1, sx + 2, sy + 2, weights + 2);
+          if(weights[0] == 0.0f || weights[1] == 0.0f || weights[2] == 0.0f)
+            continue;
+
+          /* Columns of the Jacobian are source steps along destination x and y. */
+          float dx = sqrt((sx[1] - sx[0]) * (sx[1] - sx[0]) + (sy[1] - sy[0]) * (sy[1] - sy[0]));
+          float dy = sqrt((sx[2] - sx[0]) * (sx[2] - sx[0]) + (sy[2] - sy[0]) * (sy[2] - sy[0]));
+          if(footprint < 0 || max(dx, dy) < footprint)
+            footprint = max(dx, dy);
+        }
+      }
+
+      int level = 0, levelNumber = this->source->getMipLevelNumber();
+      for(; footprint >= 2.0f && level + 1 < levelNumber; footprint *= 0.5f)
+        level++;
+      return level;
+    }
+
+    /**
+     * Switches to the given mip level of the source image. Coordinates and weights returned by
+     * mapRun refer to that level afterwards, so masks calculated from them match the drawn colors.
+     * It may be called once, on a warper created for the image itself.
+     *
+     * @param level                    Mip level, less than getMipLevelNumber() of the source image.
+     */
+    void setMipLevel(int level) {
+      if(level == 0)
+        return;
+
+      this->source = &this->source->getMipLevel(level);
+      this->inverse = arx::Matrix3f::scale(1.0f / (1 << level)) * this->inverse;
+    }
+
+    /**
+     * Draws the source image onto the given rectangle of the destination image.
+     *
+     * @param dst                      Destination image.
+     * @param x0, y0, x1, y1           Rectangle to draw onto, [x0, x1) x [y0, y1). It is clipped to the destination image.
+     */
+    void accumulate(Image4f& dst, int x0, int y0, int x1, int y1) const {
+      using namespace std;
+
+      x0 = max(x0, 0);
+      y0 = max(y0, 0);
+      x1 = min(x1, dst.getWidth());
+      y1 = min(y1, dst.getHeight());
+      if(x0 >= x1 || y0 >= y1)
+        return;
+
+      int n = x1 - x0;
+      std::vector<float> buffer(3 * n);
+      float* sx = &buffer[0];
+      float* sy = sx + n;
+      float* weights = sy + n;
+      for(int y = y0; y < y1; y++) {
+        mapRun(x0, y, n, sx, sy, weights);
+        accumulateRun(*this->source, sx, sy, weights, n, dst.getRow(y) + x0, this->gain);
+      }
+    }
+  };
+
+
+  /**
+   * Divides colors accumulated by Warper by total weights. Pixels that no image was drawn onto
+   * become transparent, others become opaque.
+   *
+   * @param image                      Accumulation image.
+   */
+  inline void normalizeAccumulated(Image4f& image) {
+    for(int y = 0; y < image.getHeight(); y++) {
+      Color4f* row = image.getRow(y);
+      for(int x = 0; x < image.getWidth(); x++) {
+        Color4f& c = row[x];
+        if(c.a > EPS) {
+          float invA = 1.0f / c.a;
+          c = Color4f(std::min(1.0f, c.r * invA), std::min(1.0f, c.g * invA), std::min(1.0f, c.b * invA), 1.0f);
+        } else
+          c = Color4f(0, 0, 0, 0);
+      }
+    }
+  }
+
+} // namespace prec
+
+#endif // __WARPER_H__
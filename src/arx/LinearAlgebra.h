@@ -6,6 +6,7 @@
 #include <iostream>
 #include <algorithm>
 #include <limits>
+#include <vector>
 #include "smart_ptr.h"
 #include "static_assert.h"
 #include "Preprocessor.h"
@@ -1297,6 +1298,145 @@ namespace arx {
       Traits<B>::is_static && Traits<A>::static_cols < ARX_LINEAR_SOLVER_PERMUTATION_VERTOR_USAGE_THRESH>::solve(a, b);
   }
 
+  // Cholesky decomposition
+  /**
+   * CholeskyDecomposition factors symmetric positive definite matrices as \f$L L^T\f$, where 
+   * \f$L\f$ is lower triangular. 
+   *
+   * Factor is stored separately from the source matrix, and a value can be added to the diagonal
+   * of the source matrix on the fly. This way the same matrix can be factored several times with 
+   * different diagonal shifts without being re-formed, which is what damped least squares solvers 
+   * need. Factor storage is reused between calls.
+   *
+   * Factorization is blocked: after a block column of the factor is computed, trailing matrix is
+   * updated tile by tile, and all the inner loops run over contiguous rows of the factor.
+   */
+  template<class T>
+  class CholeskyDecomposition {
+  private:
+    enum { block_size = ARX_CHOLESKY_BLOCK_SIZE };
+
+    std::size_t n;
+    std::vector<T> l; /**< Factor, row-major, only lower triangle is used. */
+
+    T* row(std::size_t r) { return &this->l[r * this->n]; }
+    const T* row(std::size_t r) const { return &this->l[r * this->n]; }
+
+    static T dot(const T* a, const T* b, std::size_t first, std::size_t last) {
+      T s = static_cast<T>(0);
+      for(std::size_t k = first; k < last; k++)
+        s += a[k] * b[k];
+      return s;
+    }
+
+  public:
+    CholeskyDecomposition(): n(0) {}
+
+    /**
+     * Factors \f$A + sI\f$. Only lower triangle of A is used.
+     *
+     * @param a                        Symmetric matrix to factor.
+     * @param diagonalShift            Value to add to the diagonal of a.
+     * @return                         true if the matrix is positive definite, false otherwise.
+     */
+    template<class Derived>
+    bool decompose(const MatrixBase<T, Derived>& a, T diagonalShift = static_cast<T>(0)) {
+      assert(a.rows() == a.cols());
+      this->n = a.rows();
+      this->l.resize(this->n * this->n);
+      for(std::size_t i = 0; i < this->n; i++) {
+        T* li = row(i);
+        for(std::size_t j = 0; j < i; j++)
+          li[j] = a(i, j);
+        li[i] = a(i, i) + diagonalShift;
+      }
+
+      for(std::size_t kb = 0; kb < this->n; kb += block_size) {
+        const std::size_t ke = std::min<std::size_t>(kb + block_size, this->n);
+
+        /* Factor diagonal block. Updates from the previous block columns were already applied. */
+        for(std::size_t j = kb; j < ke; j++) {
+          T* lj = row(j);
+          T d = lj[j] - dot(lj, lj, kb, j);
+          if(!(d > static_cast<T>(0)))
+            return false;
+          lj[j] = sqrt(d);
+          for(std::size_t i = j + 1; i < ke; i++) {
+            T* li = row(i);
+            li[j] = (li[j] - dot(li, lj, kb, j)) / lj[j];
+          }
+        }
+
+        /* Compute the rest of block column. */
+        for(std::size_t i = ke; i < this->n; i++) {
+          T* li = row(i);
+          for(std::size_t j = kb; j < ke; j++) {
+            const T* lj = row(j);
+            li[j] = (li[j] - dot(li, lj, kb, j)) / lj[j];
+          }
+        }
+
+        /* Update trailing matrix, tile by tile. */
+        for(std::size_t ib = ke; ib < this->n; ib += block_size) {
+          const std::size_t ie = std::min<std::size_t>(ib + block_size, this->n);
+          for(std::size_t jb = ke; jb <= ib; jb += block_size) {
+            for(std::size_t i = ib; i < ie; i++) {
+              T* li = row(i);
+              const std::size_t je = std::min<std::size_t>(jb + block_size, i + 1);
+              for(std::size_t j = jb; j < je; j++)
+                li[j] -= dot(li, row(j), kb, ke);
+            }
+          }
+        }
+      }
+      return true;
+    }
+
+    /**
+     * Solves \f$(A + sI) x = b\f$ using the last computed factorization.
+     *
+     * @param b                        (in/out) Right-hand side of the system, solution on return.
+     */
+    template<class Derived>
+    void solve(MatrixBase<T, Derived>& b) const {
+      assert(b.size() == this->n);
+
+      /* L y = b. */
+      for(std::size_t i = 0; i < this->n; i++) {
+        const T* li = row(i);
+        T val = b[i];
+        for(std::size_t k = 0; k < i; k++)
+          val -= li[k] * b[k];
+        b[i] = val / li[i];
+      }
+
+      /* L^T x = y. Column access to L^T is row access to L. */
+      for(std::size_t i = this->n; i-- > 0; ) {
+        const T* li = row(i);
+        b[i] /= li[i];
+        for(std::size_t k = 0; k < i; k++)
+          b[k] -= li[k] * b[i];
+      }
+    }
+  };
+
+  /**
+   * Solves symmetric positive definite linear system \f$(A + sI) x = b\f$ using Cholesky decomposition.
+   *
+   * @param a                          Matrix of the system, only lower triangle is used.
+   * @param b                          (in/out) Right-hand side of the system, solution on return.
+   * @param diagonalShift              Value to add to the diagonal of a.
+   * @return                           true if the matrix is positive definite, false otherwise. 
+   */
+  template<class T, class A, class B>
+  bool solveCholesky(const MatrixBase<T, A>& a, MatrixBase<T, B>& b, T diagonalShift = static_cast<T>(0)) {
+    CholeskyDecomposition<T> cholesky;
+    if(!cholesky.decompose(a, diagonalShift))
+      return false;
+    cholesky.solve(b);
+    return true;
+  }
+
   // Useful Typedefs
   typedef Vector<float, 4>     Vector4f;
   typedef Vector<float, 3>     Vector3f;
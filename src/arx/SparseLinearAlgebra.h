@@ -0,0 +1,309 @@
+#ifndef __ARX_SPARSELINEARALGEBRA_H__
+#define __ARX_SPARSELINEARALGEBRA_H__
+
+#include "config.h"
+#include <cassert>
+#include <cmath>
+#include <vector>
+#include <utility>
+#include "LinearAlgebra.h"
+#include "static_assert.h"
+
+namespace arx {
+// -------------------------------------------------------------------------- //
+// BlockSparseMatrix
+// -------------------------------------------------------------------------- //
+  /**
+   * BlockSparseMatrix represents a symmetric matrix that consists of square blocks of size B,
+   * only a few of which are non-zero. Only diagonal blocks and non-zero blocks above the diagonal
+   * are stored.
+   *
+   * Structure of the matrix must be defined before use by adding all the non-zero off-diagonal
+   * blocks with addBlock. Diagonal blocks are always present, and their indexes are equal to the
+   * indexes of their block rows.
+   *
+   * @param T                          Element type.
+   * @param B                          Block size, at most 9. Blocks are stored and processed as small
+   *                                   statically sized matrices, which is inefficient for larger sizes.
+   */
+  template<class T, std::size_t B>
+  class BlockSparseMatrix {
+    STATIC_ASSERT(B >= 1 && B <= 9);
+
+  public:
+    typedef T value_type;
+    typedef Matrix<T, B, B> block_type;
+    enum { block_size = B };
+
+  private:
+    std::size_t n;
+    std::vector<block_type> blocks;
+    std::vector<std::pair<std::size_t, std::size_t> > positions;
+
+  public:
+    BlockSparseMatrix(): n(0) {}
+
+    /**
+     * Constructor. Creates a block-diagonal matrix filled with zeros.
+     *
+     * @param n                        Number of block rows.
+     */
+    explicit BlockSparseMatrix(std::size_t n): n(n), blocks(n, block_type(static_cast<T>(0))) {
+      this->positions.reserve(n);
+      for(std::size_t i = 0; i < n; i++)
+        this->positions.push_back(std::make_pair(i, i));
+    }
+
+    /**
+     * Adds a zero off-diagonal block to the structure of the matrix.
+     *
+     * @param r                        Block row.
+     * @param c                        Block column, must be greater than r.
+     * @return                         Index of the added block.
+     */
+    std::size_t addBlock(std::size_t r, std::size_t c) {
+      assert(r < c && c < this->n);
+      this->blocks.push_back(block_type(static_cast<T>(0)));
+      this->positions.push_back(std::make_pair(r, c));
+      return this->blocks.size() - 1;
+    }
+
+    /** @return                        Number of block rows. */
+    std::size_t getBlockRows() const { return this->n; }
+
+    /** @return                        Number of rows. */
+    std::size_t rows() const { return this->n * B; }
+
+    /** @return                        Number of stored blocks. */
+    std::size_t getBlockNumber() const { return this->blocks.size(); }
+
+    block_type& getBlock(std::size_t index) { return this->blocks[index]; }
+    const block_type& getBlock(std::size_t index) const { return this->blocks[index]; }
+
+    std::size_t getBlockRow(std::size_t index) const { return this->positions[index].first; }
+    std::size_t getBlockCol(std::size_t index) const { return this->positions[index].second; }
+
+    void fill(const value_type& value) {
+      for(std::size_t i = 0; i < this->blocks.size(); i++)
+        this->blocks[i].fill(value);
+    }
+
+    /**
+     * Adds the given value to all the diagonal elements of the matrix.
+     */
+    void addToDiagonal(const value_type& value) {
+      for(std::size_t i = 0; i < this->n; i++)
+        for(std::size_t k = 0; k < B; k++)
+          this->blocks[i][k][k] += value;
+    }
+
+    /**
+     * Copies this matrix into a dense one.
+     *
+     * @param m                        (out) Matrix of rows() x rows() elements.
+     */
+    template<class Derived>
+    void toDense(MatrixBase<T, Derived>& m) const {
+      assert(m.rows() == this->rows() && m.cols() == this->rows());
+      m.fill(static_cast<T>(0));
+      for(std::size_t i = 0; i < this->blocks.size(); i++) {
+        const block_type& b = this->blocks[i];
+        const std::size_t r = this->positions[i].first * B;
+        const std::size_t c = this->positions[i].second * B;
+        for(std::size_t k = 0; k < B; k++) {
+          for(std::size_t l = 0; l < B; l++) {
+            m(r + k, c + l) = b[k][l];
+            m(c + l, r + k) = b[k][l];
+          }
+        }
+      }
+    }
+
+    /**
+     * Calculates y = A * x.
+     *
+     * @param x                        Array of rows() elements.
+     * @param y                        (out) Array of rows() elements.
+     */
+    void multiply(const value_type* x, value_type* y) const {
+      for(std::size_t i = 0; i < this->rows(); i++)
+        y[i] = static_cast<T>(0);
+
+      for(std::size_t i = 0; i < this->blocks.size(); i++) {
+        const block_type& b = this->blocks[i];
+        const std::size_t r = this->positions[i].first * B;
+        const std::size_t c = this->positions[i].second * B;
+        for(std::size_t k = 0; k < B; k++)
+          for(std::size_t l = 0; l < B; l++)
+            y[r + k] += b[k][l] * x[c + l];
+
+        /* Lower triangle is not stored, so we also use transposed off-diagonal blocks. */
+        if(r != c)
+          for(std::size_t k = 0; k < B; k++)
+            for(std::size_t l = 0; l < B; l++)
+              y[c + l] += b[k][l] * x[r + k];
+      }
+    }
+  };
+
+
+// -------------------------------------------------------------------------- //
+// BlockSparseConjugateGradient
+// -------------------------------------------------------------------------- //
+  /**
+   * BlockSparseConjugateGradient solves symmetric positive definite linear systems with
+   * BlockSparseMatrix matrices using preconditioned conjugate gradient method. Block-Jacobi
+   * preconditioner is used, i.e. the inverses of diagonal blocks of the matrix. It accounts for
+   * coupling between the parameters of a single block, which plain Jacobi preconditioner ignores.
+   * All scratch vectors are kept between calls, so repeated solves of systems of the same size 
+   * don't allocate.
+   */
+  template<class T, std::size_t B>
+  class BlockSparseConjugateGradient {
+  private:
+    typedef typename BlockSparseMatrix<T, B>::block_type block_type;
+
+    std::vector<T> r, z, p, q;
+    std::vector<block_type> preconditioner;
+
+    /**
+     * Inverts a symmetric positive definite block using Cholesky decomposition.
+     *
+     * @param a                        Block to invert.
+     * @param result                   (out) Inverse of the block.
+     * @return                         false if the block is not positive definite, true otherwise.
+     */
+    static bool invertBlock(const block_type& a, block_type& result) {
+      T l[B][B];
+      for(std::size_t i = 0; i < B; i++) {
+        for(std::size_t j = 0; j <= i; j++) {
+          T sum = a[i][j];
+          for(std::size_t k = 0; k < j; k++)
+            sum -= l[i][k] * l[j][k];
+          if(i == j) {
+            if(!(sum > static_cast<T>(0)))
+              return false;
+            l[i][i] = sqrt(sum);
+          } else
+            l[i][j] = sum / l[j][j];
+        }
+      }
+
+      /* Solve L * L^T * x = e_c for each column c. */
+      for(std::size_t c = 0; c < B; c++) {
+        T y[B];
+        for(std::size_t i = 0; i < B; i++) {
+          T sum = (i == c) ? static_cast<T>(1) : static_cast<T>(0);
+          for(std::size_t k = 0; k < i; k++)
+            sum -= l[i][k] * y[k];
+          y[i] = sum / l[i][i];
+        }
+        for(std::size_t i = B; i-- > 0; ) {
+          T sum = y[i];
+          for(std::size_t k = i + 1; k < B; k++)
+            sum -= l[k][i] * result[k][c];
+          result[i][c] = sum / l[i][i];
+        }
+      }
+      return true;
+    }
+
+    /**
+     * Calculates z = M^-1 * r, where M is the preconditioner.
+     */
+    void precondition(const T* r, T* z) const {
+      for(std::size_t i = 0; i < this->preconditioner.size(); i++) {
+        const block_type& m = this->preconditioner[i];
+        const T* ri = r + i * B;
+        T* zi = z + i * B;
+        for(std::size_t k = 0; k < B; k++) {
+          T sum = 0;
+          for(std::size_t l = 0; l < B; l++)
+            sum += m[k][l] * ri[l];
+          zi[k] = sum;
+        }
+      }
+    }
+
+  public:
+    /**
+     * Solves a * x = b.
+     *
+     * @param a                        Matrix of the system.
+     * @param b                        (in/out) Array of a.rows() elements, right-hand side of the system. Solution is written here.
+     * @param maxIterations            Maximal number of iterations.
+     * @param tolerance                Iterations stop when norm of the residual drops below norm of right-hand side times tolerance.
+     * @return                         Number of iterations done.
+     */
+    unsigned int solve(const BlockSparseMatrix<T, B>& a, T* b, unsigned int maxIterations, T tolerance) {
+      const std::size_t size = a.rows();
+      this->r.resize(size);
+      this->z.resize(size);
+      this->p.resize(size);
+      this->q.resize(size);
+      this->preconditioner.resize(a.getBlockRows());
+
+      /* Block-Jacobi preconditioner. Blocks that are not positive definite fall back to Jacobi. */
+      for(std::size_t i = 0; i < a.getBlockRows(); i++) {
+        const block_type& block = a.getBlock(i);
+        block_type& m = this->preconditioner[i];
+        if(!invertBlock(block, m)) {
+          m.fill(static_cast<T>(0));
+          for(std::size_t k = 0; k < B; k++)
+            m[k][k] = (block[k][k] > static_cast<T>(0)) ? static_cast<T>(1) / block[k][k] : static_cast<T>(1);
+        }
+      }
+
+      /* Start with zero approximation, so initial residual equals the right-hand side. The
+       * solution is accumulated in b after the residual is copied out of it. */
+      for(std::size_t i = 0; i < size; i++)
+        this->r[i] = b[i];
+      precondition(&this->r[0], &this->z[0]);
+
+      T rz = 0, bNormSqr = 0;
+      for(std::size_t i = 0; i < size; i++) {
+        this->p[i] = this->z[i];
+        rz += this->r[i] * this->z[i];
+        bNormSqr += b[i] * b[i];
+        b[i] = static_cast<T>(0);
+      }
+
+      const T thresholdSqr = bNormSqr * tolerance * tolerance;
+      unsigned int iteration = 0;
+      for(; iteration < maxIterations; iteration++) {
+        T rNormSqr = 0;
+        for(std::size_t i = 0; i < size; i++)
+          rNormSqr += this->r[i] * this->r[i];
+        if(rNormSqr <= thresholdSqr)
+          break;
+
+        a.multiply(&this->p[0], &this->q[0]);
+        T pq = 0;
+        for(std::size_t i = 0; i < size; i++)
+          pq += this->p[i] * this->q[i];
+        if(!(pq > static_cast<T>(0)))
+          break;
+
+        T alpha = rz / pq;
+        for(std::size_t i = 0; i < size; i++) {
+          b[i] += alpha * this->p[i];
+          this->r[i] -= alpha * this->q[i];
+        }
+
+        precondition(&this->r[0], &this->z[0]);
+        T newRz = 0;
+        for(std::size_t i = 0; i < size; i++)
+          newRz += this->r[i] * this->z[i];
+
+        T beta = newRz / rz;
+        rz = newRz;
+        for(std::size_t i = 0; i < size; i++)
+          this->p[i] = this->z[i] + beta * this->p[i];
+      }
+      return iteration;
+    }
+  };
+
+} // namespace arx
+
+#endif // __ARX_SPARSELINEARALGEBRA_H__
@@ -2,20 +2,55 @@
 #define __ARX_THREAD_H__
 
 #include "config.h"
+#include <cstddef>
+#include <algorithm>
+#include <vector>
 #include "Utility.h"
 
+namespace arx {
+  namespace detail {
+    /** Type-erased function object executed by a thread. */
+    class thread_function_base {
+    public:
+      virtual ~thread_function_base() {}
+      virtual void run() = 0;
+    };
+
+    template<class Function>
+    class thread_function: public thread_function_base {
+    private:
+      Function f;
+
+    public:
+      thread_function(const Function& f): f(f) {}
+      virtual void run() { f(); }
+    };
+
+  } // namespace detail
+} // namespace arx
+
 #ifdef ARX_USE_BOOST
 #  include <boost/thread.hpp>
 namespace arx {
   using boost::mutex;
+  using boost::thread;
+
+  inline unsigned int hardware_concurrency() {
+    return boost::thread::hardware_concurrency();
+  }
 }
 
 #else // ARX_USE_BOOST
 
+#ifndef ARX_WIN32
+#  include <unistd.h> /* Defines _POSIX_THREADS. */
+#endif
+
 #ifdef ARX_WIN32
 
 #  define NOMINMAX
 #  include <Windows.h>
+#  include <process.h>
 namespace arx {
   class mutex: noncopyable {
   private:
@@ -28,6 +63,52 @@ namespace arx {
     void lock() { EnterCriticalSection(&m); }
     void unlock() { LeaveCriticalSection(&m); }
   };
+
+  /**
+   * Thread of execution. Unlike boost::thread, it is joined on destruction.
+   */
+  class thread: noncopyable {
+  private:
+    HANDLE handle;
+    detail::thread_function_base* f;
+
+    static unsigned __stdcall entry(void* f) {
+      static_cast<detail::thread_function_base*>(f)->run();
+      return 0;
+    }
+
+  public:
+    template<class Function>
+    explicit thread(Function f): f(new detail::thread_function<Function>(f)) {
+      this->handle = reinterpret_cast<HANDLE>(_beginthreadex(NULL, 0, &entry, this->f, 0, NULL));
+      if(this->handle == NULL) /* Fall back to synchronous execution. */
+        this->f->run();
+    }
+
+    ~thread() { 
+      join(); 
+    }
+
+    bool joinable() const { 
+      return this->handle != NULL; 
+    }
+
+    void join() {
+      if(this->handle != NULL) {
+        WaitForSingleObject(this->handle, INFINITE);
+        CloseHandle(this->handle);
+        this->handle = NULL;
+      }
+      delete this->f;
+      this->f = NULL;
+    }
+  };
+
+  inline unsigned int hardware_concurrency() {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+  }
 }
 
 #elif defined(_POSIX_THREADS)
@@ -39,12 +120,57 @@ namespace arx {
     pthread_mutex_t m;
 
   public:
-    pthread_mutex() { pthread_mutex_init(&m, 0); }
-    ~pthread_mutex() { pthread_mutex_destroy(&m); }
+    mutex() { pthread_mutex_init(&m, 0); }
+    ~mutex() { pthread_mutex_destroy(&m); }
 
     void lock() { pthread_mutex_lock(&m); }
     void unlock() { pthread_mutex_unlock(&m); }
   };
+
+  /**
+   * Thread of execution. Unlike boost::thread, it is joined on destruction.
+   */
+  class thread: noncopyable {
+  private:
+    pthread_t handle;
+    bool started;
+    detail::thread_function_base* f;
+
+    static void* entry(void* f) {
+      static_cast<detail::thread_function_base*>(f)->run();
+      return 0;
+    }
+
+  public:
+    template<class Function>
+    explicit thread(Function f): f(new detail::thread_function<Function>(f)) {
+      this->started = pthread_create(&this->handle, 0, &entry, this->f) == 0;
+      if(!this->started) /* Fall back to synchronous execution. */
+        this->f->run();
+    }
+
+    ~thread() { 
+      join(); 
+    }
+
+    bool joinable() const { 
+      return this->started; 
+    }
+
+    void join() {
+      if(this->started) {
+        pthread_join(this->handle, 0);
+        this->started = false;
+      }
+      delete this->f;
+      this->f = 0;
+    }
+  };
+
+  inline unsigned int hardware_concurrency() {
+    long result = sysconf(_SC_NPROCESSORS_ONLN);
+    return result > 0 ? static_cast<unsigned int>(result) : 1;
+  }
 }
 
 #elif defined(ARX_DISABLE_THREADS)
@@ -52,6 +178,27 @@ namespace arx {
 namespace arx {
   class null_mutex;
   typedef null_mutex mutex;
+
+  /**
+   * Thread stub - executes the given function right away.
+   */
+  class thread: noncopyable {
+  public:
+    template<class Function>
+    explicit thread(Function f) { 
+      f(); 
+    }
+
+    bool joinable() const { 
+      return false; 
+    }
+
+    void join() {}
+  };
+
+  inline unsigned int hardware_concurrency() {
+    return 1;
+  }
 }
 
 #else
@@ -75,6 +222,92 @@ namespace arx {
     static void unlock() {}
   };
 
+
+  /**
+   * Scoped lock - locks the given mutex in constructor and unlocks it in destructor, so that the
+   * mutex is released when the scope is left with an exception.
+   *
+   * @param Mutex                      Mutex type.
+   */
+  template<class Mutex>
+  class lock_guard: noncopyable {
+  private:
+    Mutex& m;
+
+  public:
+    explicit lock_guard(Mutex& m): m(m) {
+      this->m.lock();
+    }
+
+    ~lock_guard() {
+      this->m.unlock();
+    }
+  };
+
+
+  namespace detail {
+    template<class Function>
+    class parallel_for_range {
+    private:
+      Function* f;
+      std::size_t begin, end;
+
+    public:
+      parallel_for_range(Function* f, std::size_t begin, std::size_t end): f(f), begin(begin), end(end) {}
+
+      void operator() () const {
+        for(std::size_t i = this->begin; i < this->end; i++)
+          (*this->f)(i);
+      }
+    };
+
+  } // namespace detail
+
+  /**
+   * Calls f(i) for each i in [begin, end). The range is split into threadNumber contiguous parts
+   * of equal size, each of which is processed in a separate thread. The last part is processed in
+   * the calling thread. The function returns after all the calls are done.
+   *
+   * Threads are created on each call, so each of them must get enough work to pay for that. No
+   * part is made shorter than grainSize indexes, and if the range holds less than two grains, it
+   * is processed in the calling thread without querying hardware_concurrency().
+   *
+   * @param begin                      First index.
+   * @param end                        Index past the last one.
+   * @param threadNumber               Number of threads to use, zero means hardware_concurrency().
+   * @param f                          Function object to call. It is shared between all the threads.
+   * @param grainSize                  Smallest number of indexes worth a separate thread.
+   */
+  template<class Function>
+  void parallel_for(std::size_t begin, std::size_t end, unsigned int threadNumber, Function& f, std::size_t grainSize = 1) {
+    if(end <= begin)
+      return;
+    std::size_t maxThreadNumber = (end - begin) / std::max<std::size_t>(grainSize, 1);
+    if(maxThreadNumber <= 1 || threadNumber == 1) {
+      detail::parallel_for_range<Function>(&f, begin, end)();
+      return;
+    }
+    if(threadNumber == 0)
+      threadNumber = hardware_concurrency();
+    if(threadNumber > maxThreadNumber)
+      threadNumber = static_cast<unsigned int>(maxThreadNumber);
+    if(threadNumber <= 1) {
+      detail::parallel_for_range<Function>(&f, begin, end)();
+      return;
+    }
+
+    std::vector<thread*> threads;
+    threads.reserve(threadNumber - 1);
+    std::size_t size = end - begin;
+    for(unsigned int i = 0; i + 1 < threadNumber; i++)
+      threads.push_back(new thread(detail::parallel_for_range<Function>(&f, begin + size * i / threadNumber, begin + size * (i + 1) / threadNumber)));
+    detail::parallel_for_range<Function>(&f, begin + size * (threadNumber - 1) / threadNumber, end)();
+    for(std::size_t i = 0; i < threads.size(); i++) {
+      threads[i]->join();
+      delete threads[i];
+    }
+  }
+
 }
 
 #endif // __ARX_THREAD_H__
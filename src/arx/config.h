@@ -12,6 +12,10 @@
  * indirectly, by means of a permutation vector */
 #define ARX_LINEAR_SOLVER_PERMUTATION_VERTOR_USAGE_THRESH 5
 
+/** Size of square tiles CholeskyDecomposition processes matrices in. Three tiles of this size 
+ * should fit into L1 cache. */
+#define ARX_CHOLESKY_BLOCK_SIZE 32
+
 /** Multithreading on? */
 // #define ARX_DISABLE_THREADS
 
@@ -17,9 +17,15 @@ namespace arx {
 #else
 
 #ifdef ARX_LINUX
-#  define ARX_INTERLOCKED_INCREMENT(x) (++(*x))
-#  define ARX_INTERLOCKED_DECREMENT(x) (--(*x))
-#  pragma warning "Linux non-boost implementation of shared_ptr template is currently not thread-safe. Please define ARX_USE_BOOST in config.h to use the implementation from boost."
+#  if defined(ARX_DISABLE_THREADS)
+#    define ARX_INTERLOCKED_INCREMENT(x) (++(*x))
+#    define ARX_INTERLOCKED_DECREMENT(x) (--(*x))
+#  elif defined(__GNUC__)
+#    define ARX_INTERLOCKED_INCREMENT(x) __sync_add_and_fetch((x), 1)
+#    define ARX_INTERLOCKED_DECREMENT(x) __sync_sub_and_fetch((x), 1)
+#  else
+#    error "No atomic operations for shared_ptr reference counts on your compiler. Please define ARX_USE_BOOST or ARX_DISABLE_THREADS in config.h."
+#  endif
 #endif
 
 #ifdef ARX_WIN32
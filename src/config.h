@@ -22,6 +22,10 @@
 /** Use aligned allocation even if compiling without ippi? */
 #define USE_ALIGNED_IMAGE_ALLOCATION
 
+/** Use SSE intrinsics in performance-critical loops? If not defined, plain C++ 
+ * implementations will be used instead. */
+#define USE_SSE
+
 /** Debug output on/off. */
 // #define DEBUG
 
@@ -114,6 +118,43 @@
 #define VEC_LENGTH (INDEX_SIZE * INDEX_SIZE * ORI_SIZE)
 
 
+// -------------------------------------------------------------------------- //
+// Matching Config
+// -------------------------------------------------------------------------- //
+/** Focal length assumed by rotation-only match model, in keypoint coordinates. Keypoint 
+ * coordinates are scaled by 1 / sqrt(width * height), so the default value roughly 
+ * corresponds to a standard lens on a 4:3 sensor. */
+#define ROTATION_MODEL_FOCAL 1.3f
+
+/** Initial guess for the fraction of tentative matches between two images that are correct. 
+ * RANSAC uses it to bound the number of iterations, and SPRT as initial probability that a match 
+ * is consistent with a good model. */
+#define MATCH_INLIER_FRACTION 0.5f
+
+/** Required probability that RANSAC draws at least one sample of correct matches. */
+#define MATCH_TARGET_PROBABILITY 0.95f
+
+/** Largest distance between a keypoint and the transformed matching keypoint for the match to be 
+ * consistent with a model, in keypoint coordinates. */
+#define MATCH_MAX_ERROR 0.01f
+
+/** Probability that a wrong match is consistent with a model by chance. Keypoint coordinates span 
+ * an area of about 1, so this is the area of the disk of radius MATCH_MAX_ERROR. */
+#define MATCH_RANDOM_SUPPORT_PROBABILITY (PI * MATCH_MAX_ERROR * MATCH_MAX_ERROR)
+
+
+// -------------------------------------------------------------------------- //
+// Bundle Adjustment Config
+// -------------------------------------------------------------------------- //
+/** Smallest number of residuals worth a separate thread in bundle adjustment. Threads are 
+ * created on each Levenberg-Marquardt evaluation, so smaller problems are solved serially. */
+#define BUNDLE_ADJUSTMENT_GRAIN_RESIDUALS 4096
+
+/** Smallest number of cameras worth a separate thread when camera matrices are prepared for
+ * a Levenberg-Marquardt evaluation. */
+#define BUNDLE_ADJUSTMENT_GRAIN_CAMERAS 256
+
+
 // ------------------------------------------------------------------------- //
 // WARNING: YOU ARE NOT SUPPOSED TO CHANGE ANYTHING BELOW THIS LINE! CHANGES //
 // MAY LEAD TO COMPILE OR RUNTIME ERRORS!                                    //
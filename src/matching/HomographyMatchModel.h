@@ -0,0 +1,183 @@
+#ifndef __HOMOGRAPHYMATCHMODEL_H__
+#define __HOMOGRAPHYMATCHMODEL_H__
+
+#include "config.h"
+#include <cmath>
+#include <arx/LinearAlgebra.h>
+#include <arx/smart_ptr.h>
+#include "RANSAC.h"
+#include "Match.h"
+#include "MatchBuffer.h"
+
+namespace prec {
+  /**
+   * HomographyMatchModel implements a GenericRANSACModel concept for a full projective
+   * transformation between two images.
+   *
+   * Homography is found with normalized DLT (see <i> In Defense of the Eight-Point Algorithm </i>
+   * by Hartley): keypoints of both images are centered and scaled, so that the linear system is
+   * well-conditioned. Last element of homography is fixed to 1, so for a minimal sample of 4
+   * matches this is an 8x8 linear system, and for larger sets normal equations of the same size
+   * are solved. All the matrices are statically sized, so fitting doesn't allocate.
+   */
+  class HomographyMatchModel: public GenericRANSACModel<Match> {
+  private:
+    class HomographyMatchModelData {
+    public:
+      arx::Matrix3f trans;
+    };
+
+    arx::shared_ptr<HomographyMatchModelData> data;
+
+    /**
+     * Calculates similarity transformation that moves the centroid of keypoints of the given image
+     * to the origin and makes their average distance from it equal to sqrt(2).
+     *
+     * @param m                        Matches.
+     * @param keyIndex                 Index of the image.
+     * @param result                   (out) Normalizing transformation.
+     * @return                         false if all the keypoints coincide, true otherwise.
+     */
+    static bool normalization(const arx::ArrayList<Match>& m, int keyIndex, arx::Matrix3f& result) {
+      float cx = 0.0f, cy = 0.0f;
+      for(unsigned int i = 0; i < m.size(); i++) {
+        cx += m[i].getKey(keyIndex).getX();
+        cy += m[i].getKey(keyIndex).getY();
+      }
+      cx /= m.size();
+      cy /= m.size();
+
+      float dist = 0.0f;
+      for(unsigned int i = 0; i < m.size(); i++)
+        dist += sqrt(arx::sqr(m[i].getKey(keyIndex).getX() - cx) + arx::sqr(m[i].getKey(keyIndex).getY() - cy));
+      dist /= m.size();
+      if(dist < EPS)
+        return false;
+
+      float s = sqrt(2.0f) / dist;
+      result = arx::Matrix3f::identity();
+      result[0][0] = s;
+      result[0][2] = -s * cx;
+      result[1][1] = s;
+      result[1][2] = -s * cy;
+      return true;
+    }
+
+    /**
+     * @return                         true if any three of the first four keypoints of the given image are nearly collinear.
+     */
+    static bool hasCollinearTriple(const arx::ArrayList<Match>& m, int keyIndex) {
+      for(unsigned int i = 0; i < 4; i++) {
+        /* Triple of points that doesn't include i'th point. */
+        SIFT a = m[(i + 1) % 4].getKey(keyIndex);
+        SIFT b = m[(i + 2) % 4].getKey(keyIndex);
+        SIFT c = m[(i + 3) % 4].getKey(keyIndex);
+        float area = (b.getX() - a.getX()) * (c.getY() - a.getY()) - (b.getY() - a.getY()) * (c.getX() - a.getX());
+        if(abs(area) < EPS)
+          return true;
+      }
+      return false;
+    }
+
+  public:
+    enum { has_batch_fit_error = true };
+    enum { has_least_squares_fit = true };
+
+    typedef MatchBuffer point_buffer_type;
+
+    HomographyMatchModel(): data(new HomographyMatchModelData()) {};
+
+    bool fit(const arx::ArrayList<Match>& m) {
+      using namespace arx;
+
+      /* We need at least 4 matches. */
+      if(m.size() < 4)
+        return false;
+
+      /* Minimal samples with three collinear points give degenerate homographies. */
+      if(m.size() == 4 && (hasCollinearTriple(m, 0) || hasCollinearTriple(m, 1)))
+        return false;
+
+      /* Normalize. */
+      Matrix3f t0, t1;
+      if(!normalization(m, 0, t0) || !normalization(m, 1, t1))
+        return false;
+
+      /* Each match gives two rows of the linear system. For a minimal sample we solve the
+       * system itself, for larger sets - normal equations. */
+      Matrix<float, 8, 8> a(0.0f);
+      Vector<float, 8> b(0.0f);
+      for(unsigned int i = 0; i < m.size(); i++) {
+        float x0 = t0[0][0] * m[i].getKey(0).getX() + t0[0][2];
+        float y0 = t0[1][1] * m[i].getKey(0).getY() + t0[1][2];
+        float x1 = t1[0][0] * m[i].getKey(1).getX() + t1[0][2];
+        float y1 = t1[1][1] * m[i].getKey(1).getY() + t1[1][2];
+
+        float rows[2][9] = {
+          {x1,   y1,   1.0f, 0.0f, 0.0f, 0.0f, -x1 * x0, -y1 * x0, x0},
+          {0.0f, 0.0f, 0.0f, x1,   y1,   1.0f, -x1 * y0, -y1 * y0, y0}
+        };
+
+        for(unsigned int k = 0; k < 2; k++) {
+          if(m.size() == 4) {
+            for(unsigned int c = 0; c < 8; c++)
+              a[2 * i + k][c] = rows[k][c];
+            b[2 * i + k] = rows[k][8];
+          } else {
+            for(unsigned int r = 0; r < 8; r++) {
+              for(unsigned int c = 0; c < 8; c++)
+                a[r][c] += rows[k][r] * rows[k][c];
+              b[r] += rows[k][r] * rows[k][8];
+            }
+          }
+        }
+      }
+      solveLinearSystem(a, b);
+
+      /* Denormalize. */
+      Matrix3f h;
+      for(unsigned int i = 0; i < 8; i++)
+        h[i / 3][i % 3] = b[i];
+      h[2][2] = 1.0f;
+      Matrix3f trans = t0.inverse() * h * t1;
+
+      /* Degenerate or mirroring homographies can't be produced by a camera, reject them. Comparisons
+       * are written so that NaNs from a singular system are rejected too. */
+      if(!(abs(trans[2][2]) > EPS))
+        return false;
+      trans /= trans[2][2];
+      float det = trans[0][0] * (trans[1][1] * trans[2][2] - trans[1][2] * trans[2][1]) -
+                  trans[0][1] * (trans[1][0] * trans[2][2] - trans[1][2] * trans[2][0]) +
+                  trans[0][2] * (trans[1][0] * trans[2][1] - trans[1][1] * trans[2][0]);
+      if(!(det > EPS))
+        return false;
+
+      data->trans = trans;
+      return true;
+    }
+
+    float calculateFitError(const Match& m) const {
+      using namespace arx;
+
+      /* Calculate point's expected position in the first image. */
+      Vector3f expectedV = data->trans * Vector3f(m.getKey(1).getXY());
+      if(abs(expectedV[2]) < EPS)
+        return std::numeric_limits<float>::max();
+
+      /* Now calculate the squared distance between expected and real point positions. */
+      return sqr(expectedV[0] / expectedV[2] - m.getKey(0).getX()) + sqr(expectedV[1] / expectedV[2] - m.getKey(0).getY());
+    }
+
+    void calculateFitErrors(const MatchBuffer& points, std::size_t begin, std::size_t end, float* errors) const {
+      calculateProjectiveFitErrors(data->trans, points, begin, end, errors);
+    }
+
+    /**
+     * @return                         Transformation from keypoint coordinates of the second image to keypoint coordinates of the first one.
+     */
+    const arx::Matrix3f& getTransform() const { return data->trans; }
+  };
+
+} // namespace prec
+
+#endif // __HOMOGRAPHYMATCHMODEL_H__
@@ -4,9 +4,9 @@
 #include "config.h"
 #include "arx/smart_ptr.h"
 #include "arx/Collections.h"
+#include "arx/LinearAlgebra.h"
 #include "PanoImage.h"
 #include "Match.h"
-#include "ImageMatchModel.h"
 
 namespace prec {
 // -------------------------------------------------------------------------- //
@@ -17,11 +17,13 @@ namespace prec {
     struct PanoImageMatchData {
       arx::ArrayList<Match> matches;
 
-      ImageMatchModel matchModel;
+      arx::Matrix3f transform; /**< Transformation from keypoint coordinates of the second image to keypoint coordinates of the first one. */
+
+      bool transformFound;     /**< Whether transform was found by verification, identity otherwise. */
 
       arx::array<PanoImage, 2> images;
 
-      PanoImageMatchData(PanoImage image0, PanoImage image1) {
+      PanoImageMatchData(PanoImage image0, PanoImage image1): transform(arx::Matrix3f::identity()), transformFound(false) {
         if(image0.getId() > image1.getId()) {
           images[0] = image0;
           images[1] = image1;
@@ -44,8 +46,9 @@ namespace prec {
     arx::ArrayList<Match>& getMatches() { return data->matches; }
     const Match& getMatch(size_t index) const { return data->matches[index]; }
 
-    void setMatchModel(const ImageMatchModel& matchModel) { data->matchModel = matchModel; }
-    const ImageMatchModel& getMatchModel() const { return data->matchModel; }
+    void setTransform(const arx::Matrix3f& transform) { data->transform = transform; data->transformFound = true; }
+    const arx::Matrix3f& getTransform() const { return data->transform; }
+    bool hasTransform() const { return data->transformFound; }
 
     const PanoImage& getPanoImage(int index) const { return data->images[index]; }
 
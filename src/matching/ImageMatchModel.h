@@ -6,6 +6,7 @@
 #include <arx/smart_ptr.h>
 #include "RANSAC.h"
 #include "Match.h"
+#include "MatchBuffer.h"
 
 namespace prec {
   /** 
@@ -20,7 +21,65 @@ namespace prec {
 
     arx::shared_ptr<ImageMatchModelData> data;
 
+    /**
+     * Finds the similarity transformation that minimizes the sum of squared distances between 
+     * keypoints in the first image and transformed keypoints in the second image. This problem
+     * has a closed form solution: with both point sets centered, the transformation is 
+     * [a -b; b a], where a and b are simple sums over all points.
+     */
+    bool fitLeastSquares(const arx::ArrayList<Match>& m) {
+      using namespace arx;
+
+      /* Centroids. */
+      float cx0 = 0.0f, cy0 = 0.0f, cx1 = 0.0f, cy1 = 0.0f;
+      for(unsigned int i = 0; i < m.size(); i++) {
+        cx0 += m[i].getKey(0).getX();
+        cy0 += m[i].getKey(0).getY();
+        cx1 += m[i].getKey(1).getX();
+        cy1 += m[i].getKey(1).getY();
+      }
+      float invN = 1.0f / m.size();
+      cx0 *= invN;
+      cy0 *= invN;
+      cx1 *= invN;
+      cy1 *= invN;
+
+      /* Sums over centered points. */
+      float dot = 0.0f, cross = 0.0f, normSqr = 0.0f;
+      for(unsigned int i = 0; i < m.size(); i++) {
+        float x0 = m[i].getKey(0).getX() - cx0, y0 = m[i].getKey(0).getY() - cy0;
+        float x1 = m[i].getKey(1).getX() - cx1, y1 = m[i].getKey(1).getY() - cy1;
+        dot += x1 * x0 + y1 * y0;
+        cross += x1 * y0 - y1 * x0;
+        normSqr += x1 * x1 + y1 * y1;
+      }
+
+      /* All the points in the second image coincide, no solution. */
+      if(normSqr < EPS)
+        return false;
+
+      float a = dot / normSqr;
+      float b = cross / normSqr;
+
+      /* Fill transformation matrix. */
+      data->trans[0][0] = a;
+      data->trans[0][1] = -b;
+      data->trans[0][2] = cx0 - (a * cx1 - b * cy1);
+      data->trans[1][0] = b;
+      data->trans[1][1] = a;
+      data->trans[1][2] = cy0 - (b * cx1 + a * cy1);
+      data->trans[2][0] = 0.0;
+      data->trans[2][1] = 0.0;
+      data->trans[2][2] = 1.0;
+      return true;
+    }
+
   public:
+    enum { has_batch_fit_error = true };
+    enum { has_least_squares_fit = true };
+
+    typedef MatchBuffer point_buffer_type;
+
     ImageMatchModel(): data(new ImageMatchModelData()) {};
 
     bool fit(const arx::ArrayList<Match>& m) {
@@ -30,7 +89,8 @@ namespace prec {
       if(m.size() < 2)
         return false;
 
-      // TODO: least squares fit if matches.size() > 2
+      if(m.size() > 2)
+        return fitLeastSquares(m);
 
       /* Target transformation will transform d1 into d0. */
       Vector2f d0 = m[1].getKey(0).getXY() - m[0].getKey(0).getXY();
@@ -118,7 +178,16 @@ namespace prec {
       return (Vector3f(m.getKey(0).getXY()) - expectedV).normSqr();
     }
 
+    void calculateFitErrors(const MatchBuffer& points, std::size_t begin, std::size_t end, float* errors) const {
+      calculateAffineFitErrors(data->trans, points, begin, end, errors);
+    }
+
     const arx::Matrix3f& getAffineTransform() const { return data->trans; }
+
+    /**
+     * @return                         Transformation from keypoint coordinates of the second image to keypoint coordinates of the first one.
+     */
+    const arx::Matrix3f& getTransform() const { return data->trans; }
   };
 
 } // namespace prec
@@ -0,0 +1,148 @@
+#ifndef __MATCHBUFFER_H__
+#define __MATCHBUFFER_H__
+
+#include "config.h"
+#include <cassert>
+#include <vector>
+#include <arx/LinearAlgebra.h>
+#include "Match.h"
+
+#ifdef USE_SSE
+#  include <xmmintrin.h>
+#endif
+
+namespace prec {
+// -------------------------------------------------------------------------- //
+// MatchBuffer
+// -------------------------------------------------------------------------- //
+  /**
+   * MatchBuffer stores keypoint coordinates of a list of matches in a structure-of-arrays
+   * layout, so that fit errors for all the matches can be evaluated in one pass over
+   * contiguous memory. Arrays are padded with zeros up to a multiple of 4 elements.
+   */
+  class MatchBuffer {
+  private:
+    std::size_t n;
+    std::vector<float> x0, y0, x1, y1;
+
+    static std::size_t pad(std::size_t n) {
+      return (n + 3) & ~static_cast<std::size_t>(3);
+    }
+
+  public:
+    explicit MatchBuffer(std::size_t n): n(n), x0(pad(n), 0.0f), y0(pad(n), 0.0f), x1(pad(n), 0.0f), y1(pad(n), 0.0f) {}
+
+    void set(std::size_t index, const Match& m) {
+      assert(index < this->n);
+      this->x0[index] = m.getKey(0).getX();
+      this->y0[index] = m.getKey(0).getY();
+      this->x1[index] = m.getKey(1).getX();
+      this->y1[index] = m.getKey(1).getY();
+    }
+
+    /** @return                        Number of matches stored. */
+    std::size_t size() const { return this->n; }
+
+    /** @return                        Size of coordinate arrays, always a multiple of 4. */
+    std::size_t getPaddedSize() const { return this->x0.size(); }
+
+    const float* getX0() const { return &this->x0[0]; }
+    const float* getY0() const { return &this->y0[0]; }
+    const float* getX1() const { return &this->x1[0]; }
+    const float* getY1() const { return &this->y1[0]; }
+  };
+
+
+// -------------------------------------------------------------------------- //
+// Fit error kernels
+// -------------------------------------------------------------------------- //
+  /**
+   * For each match at positions [begin, end) of the given buffer, calculates squared distance 
+   * between the keypoint in the first image and the keypoint in the second image transformed 
+   * with the given affine transformation.
+   *
+   * @param m                          Affine transformation, last row is ignored.
+   * @param points                     Matches.
+   * @param begin                      First position, must be a multiple of 4.
+   * @param end                        Position past the last one. Errors may also be written up to the next multiple of 4.
+   * @param errors                     (out) Array of at least points.getPaddedSize() elements to write errors to.
+   */
+  inline void calculateAffineFitErrors(const arx::Matrix3f& m, const MatchBuffer& points, std::size_t begin, std::size_t end, float* errors) {
+    assert(begin % 4 == 0 && end <= points.size());
+    const float* x0 = points.getX0();
+    const float* y0 = points.getY0();
+    const float* x1 = points.getX1();
+    const float* y1 = points.getY1();
+
+#ifdef USE_SSE
+    const __m128 m00 = _mm_set1_ps(m(0, 0)), m01 = _mm_set1_ps(m(0, 1)), m02 = _mm_set1_ps(m(0, 2));
+    const __m128 m10 = _mm_set1_ps(m(1, 0)), m11 = _mm_set1_ps(m(1, 1)), m12 = _mm_set1_ps(m(1, 2));
+    for(std::size_t i = begin; i < end; i += 4) {
+      __m128 vx1 = _mm_loadu_ps(x1 + i);
+      __m128 vy1 = _mm_loadu_ps(y1 + i);
+      __m128 dx = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m00, vx1), _mm_mul_ps(m01, vy1)), m02), _mm_loadu_ps(x0 + i));
+      __m128 dy = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m10, vx1), _mm_mul_ps(m11, vy1)), m12), _mm_loadu_ps(y0 + i));
+      _mm_storeu_ps(errors + i, _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)));
+    }
+#else
+    const float m00 = m(0, 0), m01 = m(0, 1), m02 = m(0, 2);
+    const float m10 = m(1, 0), m11 = m(1, 1), m12 = m(1, 2);
+    for(std::size_t i = begin; i < end; i++) {
+      float dx = m00 * x1[i] + m01 * y1[i] + m02 - x0[i];
+      float dy = m10 * x1[i] + m11 * y1[i] + m12 - y0[i];
+      errors[i] = dx * dx + dy * dy;
+    }
+#endif
+  }
+
+  /**
+   * For each match at positions [begin, end) of the given buffer, calculates squared distance 
+   * between the keypoint in the first image and the keypoint in the second image transformed 
+   * with the given projective transformation.
+   *
+   * @param m                          Projective transformation.
+   * @param points                     Matches.
+   * @param begin                      First position, must be a multiple of 4.
+   * @param end                        Position past the last one. Errors may also be written up to the next multiple of 4.
+   * @param errors                     (out) Array of at least points.getPaddedSize() elements to write errors to.
+   */
+  inline void calculateProjectiveFitErrors(const arx::Matrix3f& m, const MatchBuffer& points, std::size_t begin, std::size_t end, float* errors) {
+    assert(begin % 4 == 0 && end <= points.size());
+    const float* x0 = points.getX0();
+    const float* y0 = points.getY0();
+    const float* x1 = points.getX1();
+    const float* y1 = points.getY1();
+
+    /* Points that are mapped to infinity get infinite or NaN error, which never passes the 
+     * threshold, so no special handling is needed. */
+#ifdef USE_SSE
+    const __m128 m00 = _mm_set1_ps(m(0, 0)), m01 = _mm_set1_ps(m(0, 1)), m02 = _mm_set1_ps(m(0, 2));
+    const __m128 m10 = _mm_set1_ps(m(1, 0)), m11 = _mm_set1_ps(m(1, 1)), m12 = _mm_set1_ps(m(1, 2));
+    const __m128 m20 = _mm_set1_ps(m(2, 0)), m21 = _mm_set1_ps(m(2, 1)), m22 = _mm_set1_ps(m(2, 2));
+    const __m128 one = _mm_set1_ps(1.0f);
+    for(std::size_t i = begin; i < end; i += 4) {
+      __m128 vx1 = _mm_loadu_ps(x1 + i);
+      __m128 vy1 = _mm_loadu_ps(y1 + i);
+      __m128 invW = _mm_div_ps(one, _mm_add_ps(_mm_add_ps(_mm_mul_ps(m20, vx1), _mm_mul_ps(m21, vy1)), m22));
+      __m128 px = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m00, vx1), _mm_mul_ps(m01, vy1)), m02), invW);
+      __m128 py = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m10, vx1), _mm_mul_ps(m11, vy1)), m12), invW);
+      __m128 dx = _mm_sub_ps(px, _mm_loadu_ps(x0 + i));
+      __m128 dy = _mm_sub_ps(py, _mm_loadu_ps(y0 + i));
+      _mm_storeu_ps(errors + i, _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)));
+    }
+#else
+    const float m00 = m(0, 0), m01 = m(0, 1), m02 = m(0, 2);
+    const float m10 = m(1, 0), m11 = m(1, 1), m12 = m(1, 2);
+    const float m20 = m(2, 0), m21 = m(2, 1), m22 = m(2, 2);
+    for(std::size_t i = begin; i < end; i++) {
+      float invW = 1.0f / (m20 * x1[i] + m21 * y1[i] + m22);
+      float dx = (m00 * x1[i] + m01 * y1[i] + m02) * invW - x0[i];
+      float dy = (m10 * x1[i] + m11 * y1[i] + m12) * invW - y0[i];
+      errors[i] = dx * dx + dy * dy;
+    }
+#endif
+  }
+
+} // namespace prec
+
+#endif // __MATCHBUFFER_H__
@@ -1,11 +1,14 @@
 #include "config.h"
 #include <cmath>
 #include <cassert>
+#include <algorithm>
 #include <arx/Collections.h>
 #include <arx/KDTree.h>
 #include "Matcher.h"
 #include "Ransac.h"
 #include "ImageMatchModel.h"
+#include "HomographyMatchModel.h"
+#include "RotationMatchModel.h"
 
 using namespace std;
 using namespace arx;
@@ -20,8 +23,8 @@ namespace prec {
       unsigned int minimumMatches;
       unsigned int maximumMatches;
       bool useRANSAC;
+      Matcher::VerificationModel verificationModel;
 
-      typedef RANSAC<ImageMatchModel> RANSAC;
       typedef arx::Map<arx::UnorderedPair<int>, ImageMatch> MatchMap;
       typedef arx::Set<arx::UnorderedPair<SIFT, SIFTPtrComparer> > KeyPointPairSet; // TODO: hash_set may be faster
 
@@ -140,12 +143,40 @@ namespace prec {
        * @param minimumMatches Minimum number of matches required in final result
        * @param maximumMatches Number of best matches to keep, or zero to keep all
        * @useRANSAC Use RANSAC filtering?
+       * @param verificationModel Transformation model to use in RANSAC
        */
-      MatcherImpl(unsigned int minimumMatches, unsigned int maximumMatches, bool useRANSAC):
-        minimumMatches(minimumMatches), maximumMatches(maximumMatches), useRANSAC(useRANSAC) {
+      MatcherImpl(unsigned int minimumMatches, unsigned int maximumMatches, bool useRANSAC, Matcher::VerificationModel verificationModel):
+        minimumMatches(minimumMatches), maximumMatches(maximumMatches), useRANSAC(useRANSAC), verificationModel(verificationModel) {
         assert(minimumMatches <= maximumMatches);
       }
 
+      /**
+       * Filters matches of the given ImageMatch with RANSAC, leaving only the inliers of the best model.
+       *
+       * @param im ImageMatch to filter, its matches must be sorted by descriptor distance
+       * @param minPointsToFitModel Smallest number of matches to be able to fit the model
+       * @returns true if the model was found, false otherwise
+       */
+      template<class Model>
+      bool verify(ImageMatch& im, unsigned int minPointsToFitModel) {
+        /* For RANSAC we need at least minimal sample plus one for verification */
+        if(im.getMatches().size() <= minPointsToFitModel)
+          return false;
+
+        /* Create RANSAC algorithm processor */
+        RANSAC<Model, Match, true> ransac(minPointsToFitModel, minimumMatches);
+
+        /* Fit PROSAC. */
+        Model model;
+        if(!ransac.fitProgressive(model, im.getMatches(), MATCH_INLIER_FRACTION, MATCH_TARGET_PROBABILITY, sqr(MATCH_MAX_ERROR), MATCH_RANDOM_SUPPORT_PROBABILITY))
+          return false;
+
+        /* Overwrite matches with RANSAC checked ones. */
+        im.setTransform(model.getTransform());
+        im.setMatches(model.getInliers());
+        return true;
+      }
+
       /**
        * @param imageList List of imageList to match
        * @returns List of panoramas found
@@ -209,22 +240,31 @@ namespace prec {
             continue;
           }
 
-          /* For RANSAC we need at least one match pair plus one for verification */
-          if(useRANSAC && im.getMatches().size() >= 3) {
-            /* Create RANSAC algorithm processor */
-            RANSAC ransac(2, minimumMatches);
+          /* Verify matches with RANSAC. */
+          if(useRANSAC) {
+            /* PROSAC needs matches sorted by descriptor distance, best first. */
+            sort(im.getMatches().begin(), im.getMatches().end(), MatchDistComparer());
+
+            bool verified = false;
+            switch(verificationModel) {
+            case Matcher::SIMILARITY_MODEL:
+              verified = verify<ImageMatchModel>(im, 2);
+              break;
+            case Matcher::HOMOGRAPHY_MODEL:
+              verified = verify<HomographyMatchModel>(im, 4);
+              break;
+            case Matcher::ROTATION_MODEL:
+              verified = verify<RotationMatchModel>(im, 2);
+              break;
+            default:
+              assert(false);
+            }
 
-            /* Fit RANSAC. */
-            ImageMatchModel model;
-            if(!ransac.fit(model, im.getMatches(), 0.5f, 0.95f, sqr(0.01f))) { // TODO: magic numbers?
+            if(!verified) {
               matchMap.erase(i);
               continue;
             }
 
-            /* Overwrite matches with RANSAC checked ones. */
-            im.setMatchModel(model);
-            im.setMatches(model.getInliers());
-
 /*
             Image3f result(2000, 2000);
             result.fill(Color3f(0));
@@ -240,7 +280,7 @@ namespace prec {
             result.draw(im1.getOriginal(), 
               toCenter * 
               Matrix3f::scale(1.0f / im1.getKeyPointScaleFactor()) *
-              im.getMatchModel().getAffineTransform() * 
+              im.getTransform() * 
               Matrix3f::scale(im1.getKeyPointScaleFactor()) *
               Matrix3f::translation(-im1.getOriginal().getWidth() / 2.0f, -im1.getOriginal().getHeight() / 2.0f));
             result.saveToFile("result.jpg");
@@ -324,8 +364,8 @@ namespace prec {
 // -------------------------------------------------------------------------- //
 // Matcher
 // -------------------------------------------------------------------------- //
-  Matcher::Matcher(unsigned int minimumMatches, unsigned int maximumMatches, bool useRANSAC): 
-    impl(new detail::MatcherImpl(minimumMatches, maximumMatches, useRANSAC)) {}
+  Matcher::Matcher(unsigned int minimumMatches, unsigned int maximumMatches, bool useRANSAC, VerificationModel verificationModel): 
+    impl(new detail::MatcherImpl(minimumMatches, maximumMatches, useRANSAC, verificationModel)) {}
 
   ArrayList<Panorama> Matcher::matchImages(ArrayList<PanoImage> images) {
     return impl->matchImages(images);
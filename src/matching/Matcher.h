@@ -24,7 +24,14 @@ namespace prec {
     arx::shared_ptr<detail::MatcherImpl> impl;
   
   public:
-    Matcher(unsigned int minimumMatches, unsigned int maximumMatches, bool useRANSAC = true);
+    /** Transformation model used to verify matches between two images with RANSAC. */
+    enum VerificationModel {
+      SIMILARITY_MODEL,  /**< Similarity transformation, see ImageMatchModel. */
+      HOMOGRAPHY_MODEL,  /**< Full homography, see HomographyMatchModel. */
+      ROTATION_MODEL     /**< Camera rotation with known focal length, see RotationMatchModel. */
+    };
+
+    Matcher(unsigned int minimumMatches, unsigned int maximumMatches, bool useRANSAC = true, VerificationModel verificationModel = SIMILARITY_MODEL);
     arx::ArrayList<Panorama> matchImages(arx::ArrayList<PanoImage> imageList);
     
 #if 0
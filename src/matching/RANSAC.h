@@ -3,11 +3,391 @@
 
 #include <exception>
 #include <limits>
+#include <vector>
+#include <algorithm>
+#include <cmath>
 #include <cstdlib>
 #include <ctime>
 #include <arx/Collections.h>
 
 namespace prec {
+  namespace detail {
+    /**
+     * RANSACScorer evaluates fit errors of data points against a model. Points are stored in the
+     * given order, and are addressed by their positions in it. This implementation is used for 
+     * models that can only evaluate points one by one.
+     */
+    template<class Model, class Point, bool hasBatchFitError>
+    class RANSACScorer {
+    private:
+      arx::ArrayList<Point> points;
+      std::vector<float> errors;
+
+    public:
+      template<class ArrayOfPoint>
+      RANSACScorer(const ArrayOfPoint& points, const std::vector<std::size_t>& order): errors(order.size()) {
+        this->points.reserve(order.size());
+        for(std::size_t i = 0; i < order.size(); i++)
+          this->points.push_back(points[order[i]]);
+      }
+
+      /**
+       * Evaluates fit errors of points at positions [begin, end).
+       *
+       * @param model                  Model to evaluate points against.
+       * @param begin                  First position, must be a multiple of 4.
+       * @param end                    Position past the last one.
+       * @return                       Array of fit errors, indexed by position.
+       */
+      const float* score(const Model& model, std::size_t begin, std::size_t end) {
+        for(std::size_t i = begin; i < end; i++)
+          this->errors[i] = model.calculateFitError(this->points[i]);
+        return &this->errors[0];
+      }
+    };
+
+    /**
+     * Specialization of RANSACScorer for models that provide batch fit error evaluation. Points are 
+     * copied into model-defined buffer once, and then evaluated in one call per range.
+     */
+    template<class Model, class Point>
+    class RANSACScorer<Model, Point, true> {
+    private:
+      typename Model::point_buffer_type buffer;
+      std::vector<float> errors;
+
+    public:
+      template<class ArrayOfPoint>
+      RANSACScorer(const ArrayOfPoint& points, const std::vector<std::size_t>& order): buffer(order.size()) {
+        for(std::size_t i = 0; i < order.size(); i++)
+          this->buffer.set(i, points[order[i]]);
+        this->errors.resize(this->buffer.getPaddedSize());
+      }
+
+      const float* score(const Model& model, std::size_t begin, std::size_t end) {
+        model.calculateFitErrors(this->buffer, begin, end, &this->errors[0]);
+        return &this->errors[0];
+      }
+    };
+
+
+    /**
+     * SPRT implements Wald's sequential probability ratio test, used to reject bad hypotheses after 
+     * checking only a few points (see <i> Randomized RANSAC with Sequential Probability Ratio Test </i> 
+     * by Matas and Chum). Here epsilon is the probability that a point is consistent with a good 
+     * model, and delta is the probability that a point is consistent with a bad one. Both are 
+     * re-estimated during the run: epsilon from the best model found so far, delta from the models 
+     * rejected by the test.
+     */
+    class SPRT {
+    private:
+      float epsilon, delta;
+      float threshold;           /* Likelihood ratio at which a model is rejected. */
+      double rejectedDeltaSum;   /* Sum of consistent point fractions over rejected models. */
+      unsigned int rejectedN;    /* Number of rejected models. */
+
+      void updateThreshold() {
+        /* Time needed to fit a model, measured in single point evaluations, and number of models per sample. */
+        const float fitTime = 200.0f;
+        const float modelsPerSample = 1.0f;
+
+        /* Optimal threshold satisfies A = K + log(A), this iteration converges in a few steps. */
+        float c = (1 - this->delta) * log((1 - this->delta) / (1 - this->epsilon)) + this->delta * log(this->delta / this->epsilon);
+        float k = fitTime * c / modelsPerSample + 1;
+        this->threshold = k;
+        for(int i = 0; i < 10; i++)
+          this->threshold = k + log(this->threshold);
+      }
+
+      void setDelta(float delta) {
+        /* Test makes no sense when a bad model explains points as well as a good one. */
+        this->delta = std::max(0.001f, std::min(delta, this->epsilon * 0.5f));
+      }
+
+    public:
+      SPRT(float epsilon, float delta): epsilon(std::min(epsilon, 0.99f)), rejectedDeltaSum(0.0), rejectedN(0) {
+        setDelta(delta);
+        updateThreshold();
+      }
+
+      /** @return                      Likelihood ratio at which a model is rejected. */
+      float getThreshold() const { return this->threshold; }
+
+      /** @return                      Likelihood ratio multiplier for a point consistent with the model. */
+      float getConsistentFactor() const { return this->delta / this->epsilon; }
+
+      /** @return                      Likelihood ratio multiplier for a point inconsistent with the model. */
+      float getInconsistentFactor() const { return (1 - this->delta) / (1 - this->epsilon); }
+
+      /** @return                      Probability that a good model passes the test. */
+      float getAcceptanceProbability() const { return 1 - 1 / this->threshold; }
+
+      /**
+       * Updates delta estimate with a rejected model.
+       *
+       * @param testedN                Number of points evaluated before rejection.
+       * @param consistentN            Number of evaluated points consistent with the model.
+       */
+      void addRejected(std::size_t testedN, std::size_t consistentN) {
+        this->rejectedDeltaSum += static_cast<double>(consistentN) / testedN;
+        this->rejectedN++;
+
+        /* Thresholds are recalculated only when the estimate changes significantly. */
+        float newDelta = static_cast<float>(this->rejectedDeltaSum / this->rejectedN);
+        if(fabs(newDelta - this->delta) > 0.05f * this->delta) {
+          setDelta(newDelta);
+          updateThreshold();
+        }
+      }
+
+      /**
+       * Updates epsilon estimate with inlier fraction of a new best model.
+       */
+      void addAccepted(float inlierFraction) {
+        inlierFraction = std::min(inlierFraction, 0.99f);
+        if(inlierFraction > this->epsilon) {
+          this->epsilon = inlierFraction;
+          setDelta(this->delta);
+          updateThreshold();
+        }
+      }
+    };
+
+
+    /**
+     * RANSACRun holds the state of a single RANSAC run: scratch buffers, fit error evaluator and
+     * the best model found so far. Samplers only choose which points go into a sample, fitting
+     * and scoring of hypotheses is done here.
+     *
+     * When useSPRT is true, points are evaluated in random order and evaluation of a hypothesis
+     * is aborted as soon as SPRT decides that it is bad.
+     *
+     * When the model supports least squares fitting, each new best model is refined using its 
+     * inliers (LO-RANSAC).
+     */
+    template<class Model, class Point, class ArrayOfPoint, bool useSPRT>
+    class RANSACRun {
+    private:
+      const ArrayOfPoint& points;
+      unsigned int minPointsToFitModel;
+      unsigned int minPointsToAcceptModel;
+      float maxFitError;
+
+      /* Everything the main loop needs is allocated beforehand. Inside the loop we work with point
+       * indexes only, actual inliers are materialized once, after the best model is found. */
+      std::vector<std::size_t> sampleIndexes;     /* Indexes of picked points. */
+      arx::ArrayList<Point> sample;                /* Picked points. */
+      arx::ArrayList<Point> localSample;           /* Inliers used for local optimization. */
+      std::vector<std::size_t> inlierIndexes;      /* Indexes of inliers of the current model. */
+      std::vector<std::size_t> bestInlierIndexes;  /* Indexes of inliers of the best model. */
+      float bestModelCost;                         /* Cost of the best model in terms of cost function. */
+      Model model;                                 /* Current model. */
+      std::vector<std::size_t> order;              /* Order in which points are evaluated. */
+      RANSACScorer<Model, Point, Model::has_batch_fit_error> scorer; /* Fit error evaluator. */
+      SPRT sprt;                                   /* Preemptive test, used only if useSPRT is true. */
+
+      static std::vector<std::size_t> makeOrder(std::size_t n) {
+        std::vector<std::size_t> result(n);
+        for(std::size_t i = 0; i < n; i++)
+          result[i] = i;
+        if(useSPRT)
+          std::random_shuffle(result.begin(), result.end());
+        return result;
+      }
+
+      /**
+       * Evaluates the current model against all the points, filling inlierIndexes.
+       *
+       * @param preemptive             Use SPRT to abort evaluation of bad models?
+       * @param cost                   (out) Cost of the current model in terms of cost function.
+       * @return                       false if the model was rejected by SPRT, true otherwise.
+       */
+      bool evaluate(bool preemptive, float& cost) {
+        cost = 0.0f;
+
+        /* Check all points for fit. With SPRT, points are evaluated in small chunks so that bad
+         * models can be rejected early. */
+        const std::size_t pointsN = this->order.size();
+        const std::size_t chunkSize = preemptive ? 16 : pointsN;
+        const float threshold = this->sprt.getThreshold();
+        const float consistentFactor = this->sprt.getConsistentFactor();
+        const float inconsistentFactor = this->sprt.getInconsistentFactor();
+        float likelihoodRatio = 1.0f;
+        this->inlierIndexes.clear();
+        for(std::size_t begin = 0; begin < pointsN; begin += chunkSize) {
+          std::size_t end = std::min(begin + chunkSize, pointsN);
+          const float* fitErrors = this->scorer.score(this->model, begin, end);
+          for(std::size_t j = begin; j < end; j++) {
+            float fitError = fitErrors[j];
+            if(fitError < this->maxFitError) {
+              this->inlierIndexes.push_back(this->order[j]);
+              cost += fitError;
+              likelihoodRatio *= consistentFactor;
+            } else {
+              cost += this->maxFitError;
+              likelihoodRatio *= inconsistentFactor;
+            }
+
+            if(preemptive && likelihoodRatio > threshold) {
+              this->sprt.addRejected(j + 1, this->inlierIndexes.size());
+              return false;
+            }
+          }
+        }
+        return true;
+      }
+
+      /**
+       * Makes the current model the best one if it is acceptable and better than the best one.
+       *
+       * @return                       true if the current model became the new best model, false otherwise.
+       */
+      bool accept(Model& bestModel, float cost) {
+        /* Test whether we can accept current model. */
+        if(this->inlierIndexes.size() < this->minPointsToAcceptModel)
+          return false;
+
+        /* Compare with the best one. */
+        if(cost >= this->bestModelCost)
+          return false;
+
+        /* Models may share their data on copy, so we swap them instead. Old best model becomes 
+         * a scratch one and will be overwritten on the next successful fit. */
+        std::swap(bestModel, this->model);
+        this->bestInlierIndexes.swap(this->inlierIndexes);
+        this->bestModelCost = cost;
+        if(useSPRT)
+          std::sort(this->bestInlierIndexes.begin(), this->bestInlierIndexes.end());
+        return true;
+      }
+
+      /**
+       * Local optimization step of LO-RANSAC (see <i> Locally Optimized RANSAC </i> by Chum, Matas 
+       * and Kittler). Model is refitted to all the inliers of the best model, which is repeated
+       * while it keeps improving the cost.
+       */
+      void optimizeLocally(Model& bestModel) {
+        const int maxIterations = 4;
+        for(int i = 0; i < maxIterations; i++) {
+          this->localSample.clear();
+          for(std::size_t j = 0; j < this->bestInlierIndexes.size(); j++)
+            this->localSample.push_back(this->points[this->bestInlierIndexes[j]]);
+
+          float cost;
+          if(!this->model.fit(this->localSample) || !evaluate(false, cost) || !accept(bestModel, cost))
+            break;
+        }
+      }
+
+    public:
+      /**
+       * Constructor.
+       *
+       * @param points                 List of observed data points.
+       * @param minPointsToFitModel    Smallest number of points to be able to fit the model.
+       * @param minPointsToAcceptModel Smallest number of points required for a model to be accepted.
+       * @param maxFitError            Threshold value for determining when a point fits a model. 
+       * @param inlierFraction         Initial guess for the fraction of good points.
+       * @param randomSupportProbability Initial guess for the probability that a point fits an incorrect model.
+       */
+      RANSACRun(const ArrayOfPoint& points, unsigned int minPointsToFitModel, unsigned int minPointsToAcceptModel, float maxFitError, float inlierFraction, float randomSupportProbability): 
+        points(points), minPointsToFitModel(minPointsToFitModel), minPointsToAcceptModel(minPointsToAcceptModel), maxFitError(maxFitError), 
+        sampleIndexes(minPointsToFitModel), bestModelCost(std::numeric_limits<float>::max()), order(makeOrder(points.size())), 
+        scorer(points, order), sprt(inlierFraction, randomSupportProbability) {
+        this->sample.resize(minPointsToFitModel);
+        if(Model::has_least_squares_fit)
+          this->localSample.reserve(points.size());
+        this->inlierIndexes.reserve(points.size());
+        this->bestInlierIndexes.reserve(points.size());
+      }
+
+      /**
+       * Fills first count positions of the sample with distinct points picked uniformly at random 
+       * from the first n points.
+       */
+      void drawSample(unsigned int count, std::size_t n) {
+        /* Sample is small, so linear search for duplicates is faster than any set. */
+        for(unsigned int k = 0; k < count; k++) {
+          std::size_t index;
+          do {
+            index = static_cast<std::size_t>(static_cast<unsigned long long>(n) * rand() / (static_cast<unsigned long long>(RAND_MAX) + 1));
+          } while(std::find(this->sampleIndexes.begin(), this->sampleIndexes.begin() + k, index) != this->sampleIndexes.begin() + k);
+          setSample(k, index);
+        }
+      }
+
+      /**
+       * Puts the point with the given index into the given position of the sample.
+       */
+      void setSample(unsigned int position, std::size_t index) {
+        this->sampleIndexes[position] = index;
+        this->sample[position] = this->points[index];
+      }
+
+      /**
+       * Fits a model to the current sample and evaluates it against all the points. If the model
+       * becomes the new best one and it supports least squares fitting, it is locally optimized.
+       *
+       * @param bestModel              (in/out) The best model found so far.
+       * @return                       true if the fitted model became the new best model, false otherwise.
+       */
+      bool tryModel(Model& bestModel) {
+        /* Fit model. */
+        if(!this->model.fit(this->sample))
+          return false;
+
+        /* Evaluate it. */
+        float cost;
+        if(!evaluate(useSPRT, cost) || !accept(bestModel, cost))
+          return false;
+
+        /* Refine the new best model. */
+        if(Model::has_least_squares_fit)
+          optimizeLocally(bestModel);
+
+        if(useSPRT)
+          this->sprt.addAccepted(static_cast<float>(this->bestInlierIndexes.size()) / this->order.size());
+        return true;
+      }
+
+      /**
+       * Adjusts the fraction of good points to account for good models rejected by SPRT, so that
+       * the adjusted value can be used to estimate the number of iterations.
+       */
+      float getEffectiveInlierFraction(float inlierFraction) const {
+        if(!useSPRT)
+          return inlierFraction;
+        return inlierFraction * pow(this->sprt.getAcceptanceProbability(), 1.0f / this->minPointsToFitModel);
+      }
+
+      /**
+       * @return                       Indexes of inliers of the best model, in ascending order.
+       */
+      const std::vector<std::size_t>& getBestInlierIndexes() const {
+        return this->bestInlierIndexes;
+      }
+
+      /**
+       * Stores inliers in the best model.
+       *
+       * @return                       true if the best model was found, false otherwise.
+       */
+      bool finish(Model& bestModel) const {
+        if(this->bestModelCost == std::numeric_limits<float>::max())
+          return false;
+
+        /* Materialize inliers of the best model. */
+        arx::ArrayList<Point> inliers;
+        inliers.reserve(this->bestInlierIndexes.size());
+        for(std::size_t i = 0; i < this->bestInlierIndexes.size(); i++)
+          inliers.push_back(this->points[this->bestInlierIndexes[i]]);
+        bestModel.setInliers(inliers);
+        return true;
+      }
+    };
+
+  } // namespace detail
+
   /**
    * RANSAC class implements RANdom SAmple Consensus algorithm for parameter estimation of a 
    * mathematical model from a set of observed data points which contains outliers
@@ -42,12 +422,24 @@ namespace prec {
    * A New Robust Estimator with Application to Estimating Image Geometry </i> for details).
    *
    * 
+   * In case the model provides batch fit error evaluation (see GenericRANSACModel), it is used
+   * instead of per-point calculateFitError calls.
+   *
+   * Models that provide least squares fitting are locally optimized each time a new best model is
+   * found, by refitting them to all of their inliers (LO-RANSAC).
+   *
+   * If useSPRT is true, evaluation of each hypothesis is aborted as soon as sequential probability
+   * ratio test decides that it is bad (see detail::SPRT). This greatly reduces the time spent on
+   * bad hypotheses when the fraction of inliers is low, at the cost of rejecting a good hypothesis
+   * now and then, which is accounted for in the number of iterations.
+   *
    * @param Model                      Class representing a mathematical model for observed data.
    * @param Point                      Single point.
+   * @param useSPRT                    Use early rejection of bad hypotheses?
    *
    * @see GenericRANSACModel
    */
-  template<class Model, class Point = typename Model::point_type>
+  template<class Model, class Point = typename Model::point_type, bool useSPRT = false>
   class RANSAC {
   private:
     unsigned int minPointsToAcceptModel; /**< Smallest number of points required for a model to be accepted. */
@@ -85,69 +477,130 @@ namespace prec {
       time_t seed;
       srand(static_cast<unsigned int>(time(&seed)));
 
-      /* Estimate the number of iterations required. */
-      unsigned int requiredIterations = estimateNumberOfIterations(targetProbability, inlierFraction, minPointsToFitModel, 1.0f); /* TODO: why 1.0? */
+      /* Prepare. Initial guess for delta is only used by SPRT, and is quickly re-estimated. */
+      std::size_t pointsN = points.size();
+      detail::RANSACRun<Model, Point, ArrayOfPoint, useSPRT> run(points, minPointsToFitModel, minPointsToAcceptModel, maxFitError, inlierFraction, 0.01f);
 
-      /* Prepare. */
-      float bestModelCost = std::numeric_limits<float>::max(); /* Cost of bestModel in terms of cost function. */
+      /* Estimate the number of iterations required. */
+      unsigned int requiredIterations = estimateNumberOfIterations(targetProbability, run.getEffectiveInlierFraction(inlierFraction), minPointsToFitModel, 1.0f); /* TODO: why 1.0? */
 
       /* Iterate. */
       for(unsigned int i = 0; i < requiredIterations; i++) {
-        arx::ArrayList<Point> maybeInliers; /* List of possible inliers. */
-        arx::Set<std::size_t> usedPoints; /* Set of point indexes that were randomly picked as possible inliers. */
+        /* Build random sample and check it. */
+        run.drawSample(minPointsToFitModel, pointsN);
+        if(!run.tryModel(bestModel))
+          continue;
 
-        /* Build random samples. */
-        while(true) {
-          std::size_t index = static_cast<std::size_t>(static_cast<unsigned long long>(points.size()) * rand() / (RAND_MAX + 1));
-          if(usedPoints.contains(index))
-            continue;
-          usedPoints.insert(index);
-          maybeInliers.push_back(points[index]);
-          if(maybeInliers.size() == minPointsToFitModel)
-            break;
+        /* Update requiredIterations if needed */
+        float currentInlierFraction = (float) run.getBestInlierIndexes().size() / pointsN;
+        if(currentInlierFraction > inlierFraction) {
+          inlierFraction = currentInlierFraction;
+          requiredIterations = estimateNumberOfIterations(targetProbability, run.getEffectiveInlierFraction(inlierFraction), minPointsToFitModel, 1.0f); /* TODO: why 1.0? */
         }
+      }
 
-        /* Fit model. */
-        Model model;
-        if(!model.fit(maybeInliers))
-          continue;
+      return run.finish(bestModel);
+    }
 
-        /* Cost of the current model in terms of cost function. */
-        float cost = 0.0f;
+    /**
+     * Finds the best model fitting the given data using PROSAC (PROgressive SAmple Consensus, see
+     * <i> Matching with PROSAC - Progressive Sample Consensus </i> by Chum and Matas). Points must be 
+     * sorted by quality, best first. Samples are drawn from progressively larger sets of top-ranked 
+     * points, so for well-ranked data a good sample is usually found much earlier than with uniform 
+     * sampling. The set grows so that after growthIterations samples it contains all the points, and
+     * then sampling is uniform. Hence in the worst case, e.g. when the ranking is unrelated to point
+     * quality, PROSAC degrades to plain RANSAC.
+     *
+     * Run terminates when the best model found so far satisfies both non-randomness and maximality
+     * criteria for some set of top-ranked points, or when the number of iterations reaches 
+     * growthIterations plus the one required for uniform sampling.
+     *
+     * @param bestModel                (out) The best model found.
+     * @param points                   List of observed data points, sorted by quality, best first.
+     * @param inlierFraction           Fraction of the sample points which are good.
+     * @param targetProbability        Required probability to find a good sample.
+     * @param maxFitError              Threshold value for determining when a point fits a model. 
+     * @param randomSupportProbability Probability that a point fits an incorrect model by chance.
+     * @param growthIterations         Number of samples after which all the points are sampled (T_N in the paper).
+     * @return                         true if the best model was found, false otherwise.
+     */
+    template<class ArrayOfPoint>
+    bool fitProgressive(Model& bestModel, const ArrayOfPoint& points, float inlierFraction, float targetProbability, float maxFitError, float randomSupportProbability, unsigned int growthIterations = 200000) const {
+      /* Check data set size. */
+      if(points.size() < minPointsToFitModel)
+        throw std::runtime_error("List of data is smaller than minimum fit requires.");
+
+      /* Initialize random number generator. */
+      time_t seed;
+      srand(static_cast<unsigned int>(time(&seed)));
+
+      /* Prepare. */
+      const std::size_t pointsN = points.size();
+      const unsigned int m = minPointsToFitModel;
+      detail::RANSACRun<Model, Point, ArrayOfPoint, useSPRT> run(points, minPointsToFitModel, minPointsToAcceptModel, maxFitError, inlierFraction, randomSupportProbability);
+
+      /* Upper bound on the number of iterations: growth of the sampled set, then uniform sampling. */
+      const unsigned int maxIterations = growthIterations + estimateNumberOfIterations(targetProbability, run.getEffectiveInlierFraction(inlierFraction), m, 1.0f);
 
-        /* Clear maybeInliers. Old inliers will get there on the next step. */
-        maybeInliers.clear();
+      /* Minimal number of inliers among n top-ranked points for a model to be non-random. */
+      std::vector<std::size_t> minNonRandomInliers(pointsN + 1, 0);
+      for(std::size_t n = m; n <= pointsN; n++)
+        minNonRandomInliers[n] = estimateMinNonRandomInliers(n, m, randomSupportProbability, 0.05f);
 
-        /* Check all points for fit. */
-        for(unsigned int i = 0; i < points.size(); i++) {
-          float fitError = model.calculateFitError(points[i]);
-          if(fitError < maxFitError) {
-            maybeInliers.push_back(points[i]);
-            cost += fitError;
-          } else
-            cost += maxFitError;
+      /* State of the sampler. Here tn is the average number of samples drawn from U_n among 
+       * growthIterations samples, and tnPrime is its integer counterpart. Growth must not depend 
+       * on the termination length, otherwise the sampled set stops growing together with it. */
+      std::size_t n = m;                 /* Size of the set of top-ranked points we sample from. */
+      std::size_t nStar = pointsN;       /* Size of the set termination length is estimated for. */
+      unsigned int kStar = maxIterations; /* Required number of iterations. */
+      double tn = static_cast<double>(growthIterations);
+      for(unsigned int i = 0; i < m; i++)
+        tn *= static_cast<double>(m - i) / (pointsN - i);
+      unsigned int tnPrime = 1;
+
+      /* Iterate. */
+      for(unsigned int t = 1; t <= kStar; t++) {
+        /* Grow the set of top-ranked points. */
+        if(t > tnPrime && n < nStar) {
+          double tnNext = tn * (n + 1) / (n + 1 - m);
+          n++;
+          tnPrime += static_cast<unsigned int>(ceil(tnNext - tn));
+          tn = tnNext;
         }
 
-        /* Test whether we can accept current model. */
-        if(maybeInliers.size() < minPointsToAcceptModel)
+        /* Build sample. While the set grows, samples drawn from U_{n-1} were already tried, so the 
+         * n-th point is always included. Once it stops growing, U_n is sampled uniformly. */
+        if(t <= tnPrime) {
+          run.drawSample(m - 1, n - 1);
+          run.setSample(m - 1, n - 1);
+        } else
+          run.drawSample(m, n);
+
+        /* Check it. */
+        if(!run.tryModel(bestModel))
           continue;
 
-        /* Compare with the best one. */
-        if(cost < bestModelCost) {
-          bestModel = model;
-          bestModelCost = cost;
-          bestModel.setInliers(maybeInliers);
-
-          /* Update requiredIterations if needed */
-          float currentInlierFraction = (float) maybeInliers.size() / points.size();
-          if(currentInlierFraction > inlierFraction) {
-            inlierFraction = currentInlierFraction;
-            requiredIterations = estimateNumberOfIterations(targetProbability, inlierFraction, minPointsToFitModel, 1.0f); /* TODO: why 1.0? */
+        /* Find the size of top-ranked set that minimizes the number of iterations, while 
+         * satisfying non-randomness criterion. Inlier indexes are sorted, so we can count 
+         * inliers of all the sets going from the largest set down. */
+        const std::vector<std::size_t>& inlierIndexes = run.getBestInlierIndexes();
+        std::size_t inliersN = inlierIndexes.size();
+        for(std::size_t size = pointsN; size >= m; size--) {
+          while(inliersN > 0 && inlierIndexes[inliersN - 1] >= size)
+            inliersN--;
+          if(inliersN < minNonRandomInliers[size])
+            continue;
+
+          float fraction = run.getEffectiveInlierFraction(static_cast<float>(inliersN) / size);
+          unsigned int k = (fraction >= 1.0f) ? 1 : estimateNumberOfIterations(targetProbability, fraction, m, 0.0f);
+          if(k < kStar) {
+            kStar = k;
+            nStar = size;
           }
         }
       }
 
-      return bestModelCost != std::numeric_limits<float>::max();
+      return run.finish(bestModel);
     }
 
     /**
@@ -197,16 +650,63 @@ namespace prec {
       float successProbability = pow(inlierFraction, (int) minPointsToFitModel); /* Probability of success in a single iteration. */
       return (unsigned int) (log(1 - targetProbability) / log(1 - successProbability) + sdFactor * sqrt(1 - successProbability) / successProbability) + 1;
     }
+
+    /**
+     * Calculate the minimal number of inliers among n top-ranked points required for a model to be
+     * considered non-random. This is the non-randomness criterion used in PROSAC termination.
+     *
+     * Number of points that fit an incorrect model by chance follows binomial distribution, as
+     * the points of the sample fit the model by definition:
+     *
+     * \f[
+     * P_n(i) = \binom{n - p}{i - p} \beta^{i - p} (1 - \beta)^{n - i}
+     * \f]
+     *
+     * where \f$\beta\f$ is the probability that a point fits an incorrect model and \f$p\f$ is 
+     * the number of points required to fit the model. The result is the smallest \f$I\f$ for 
+     * which \f$\sum_{i=I}^n{P_n(i)} < \psi\f$.
+     *
+     * @param n                        Number of top-ranked points.
+     * @param minPointsToFitModel      Minimal number of points required to fit a model.
+     * @param randomSupportProbability Probability that a point fits an incorrect model by chance.
+     * @param significance             Acceptable probability of model being random.
+     * @return                         Minimal number of inliers for a non-random model.
+     */
+    static std::size_t estimateMinNonRandomInliers(std::size_t n, unsigned int minPointsToFitModel, float randomSupportProbability, float significance) {
+      assert(n >= minPointsToFitModel);
+      assert(randomSupportProbability > 0 && randomSupportProbability < 1);
+      assert(significance > 0 && significance < 1);
+
+      /* Probabilities are calculated in log domain to avoid underflows. */
+      double logBeta = log(static_cast<double>(randomSupportProbability));
+      double logOneMinusBeta = log(1.0 - randomSupportProbability);
+      double logP = (n - minPointsToFitModel) * logOneMinusBeta; /* log P_n(i). */
+      double tail = 1.0;                                          /* sum_{j=i}^n P_n(j). */
+      for(std::size_t i = minPointsToFitModel; i <= n; i++) {
+        if(tail < significance)
+          return i;
+        tail -= exp(logP);
+        if(i < n)
+          logP += log(static_cast<double>(n - i) / (i + 1 - minPointsToFitModel)) + logBeta - logOneMinusBeta;
+      }
+      return n + 1;
+    }
   };
 
 
   /** 
    * Class GenericRANSACModel.
+   *
+   * Models that can evaluate fit errors for many points at once should define has_batch_fit_error
+   * as true, and provide point_buffer_type and calculateFitErrors. point_buffer_type must be 
+   * constructible from the number of points and provide set(index, point) and getPaddedSize() 
+   * methods.
    */
   template<class Point> 
   class GenericRANSACModel {
   private:
-    template<class Model, class OtherPoint> friend class RANSAC;
+    template<class Model, class OtherPoint, bool useSPRT> friend class RANSAC;
+    template<class Model, class OtherPoint, class ArrayOfPoint, bool useSPRT> friend class detail::RANSACRun;
 
   protected:
     arx::ArrayList<Point> inliers;
@@ -216,13 +716,17 @@ namespace prec {
   public:
     typedef Point point_type;    /**< Point type. */
 
+    enum { has_batch_fit_error = false }; /**< Does this model provide calculateFitErrors? */
+    enum { has_least_squares_fit = false }; /**< Does fit return a least squares solution for non-minimal sets of points? */
+
     /**
      * Default constructor.
      */
     GenericRANSACModel() {};
 
     /**
-     * Fits the model to the given set of points.
+     * Fits the model to the given set of points. If the model defines has_least_squares_fit as 
+     * true, then for sets larger than minimal it must return a least squares solution.
      *
      * @param points                   Set of point to fit the model to.
      * @return                         true if the fit was done, false otherwise.
@@ -237,6 +741,17 @@ namespace prec {
      */
     float calculateFitError(const Point& p) const;
 
+    /**
+     * Calculate the fitting errors of points at positions [begin, end) of a buffer against the 
+     * current model. Only required when has_batch_fit_error is true.
+     *
+     * @param points                   Buffer filled with points.
+     * @param begin                    First position, always a multiple of 4.
+     * @param end                      Position past the last one. Errors may also be written up to the next multiple of 4.
+     * @param errors                   (out) Array of points.getPaddedSize() fitting errors, indexed by position.
+     */
+    // void calculateFitErrors(const point_buffer_type& points, std::size_t begin, std::size_t end, float* errors) const;
+
     /**
      * @return                         Set of inliers determined during RANSAC run.
      */
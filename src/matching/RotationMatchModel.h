@@ -0,0 +1,199 @@
+#ifndef __ROTATIONMATCHMODEL_H__
+#define __ROTATIONMATCHMODEL_H__
+
+#include "config.h"
+#include <cmath>
+#include <arx/LinearAlgebra.h>
+#include <arx/smart_ptr.h>
+#include "RANSAC.h"
+#include "Match.h"
+#include "MatchBuffer.h"
+
+namespace prec {
+  /**
+   * RotationMatchModel implements a GenericRANSACModel concept for a camera rotating about its
+   * optical center. Focal length is assumed to be ROTATION_MODEL_FOCAL, so keypoints can be turned
+   * into rays, and the model has only 3 degrees of freedom. Minimal sample is 2 matches.
+   *
+   * For a minimal sample, rotation aligns the orthonormal frames built from the two rays of each
+   * image. For larger sets, rotation is the orthonormal polar factor of the correlation matrix of
+   * the rays, which is the least squares solution (see <i> Least-Squares Estimation of
+   * Transformation Parameters Between Two Point Patterns </i> by Umeyama). Polar factor is found
+   * with Newton iteration, so no SVD is needed.
+   */
+  class RotationMatchModel: public GenericRANSACModel<Match> {
+  private:
+    class RotationMatchModelData {
+    public:
+      arx::Matrix3f rotation;
+      arx::Matrix3f trans;
+    };
+
+    arx::shared_ptr<RotationMatchModelData> data;
+
+    /**
+     * Fills the given array with the unit ray corresponding to the given keypoint.
+     */
+    static void toRay(const SIFT& key, float* ray) {
+      ray[0] = key.getX();
+      ray[1] = key.getY();
+      ray[2] = ROTATION_MODEL_FOCAL;
+      float invNorm = 1.0f / sqrt(ray[0] * ray[0] + ray[1] * ray[1] + ray[2] * ray[2]);
+      ray[0] *= invNorm;
+      ray[1] *= invNorm;
+      ray[2] *= invNorm;
+    }
+
+    /**
+     * Builds an orthonormal frame from two unit rays. First axis is the bisector of the rays,
+     * second one lies in their plane, and the third one is orthogonal to it.
+     *
+     * @param a                        First ray.
+     * @param b                        Second ray.
+     * @param frame                    (out) Frame, its axes are stored in columns.
+     * @return                         false if the rays are nearly parallel, true otherwise.
+     */
+    static bool buildFrame(const float* a, const float* b, arx::Matrix3f& frame) {
+      float e1[3] = {a[0] + b[0], a[1] + b[1], a[2] + b[2]};
+      float e2[3] = {a[0] - b[0], a[1] - b[1], a[2] - b[2]};
+      float n1 = sqrt(e1[0] * e1[0] + e1[1] * e1[1] + e1[2] * e1[2]);
+      float n2 = sqrt(e2[0] * e2[0] + e2[1] * e2[1] + e2[2] * e2[2]);
+      if(n1 < EPS || n2 < EPS)
+        return false;
+
+      /* Sum and difference of unit vectors are orthogonal, so no orthogonalization is needed. */
+      for(int i = 0; i < 3; i++) {
+        frame[i][0] = e1[i] / n1;
+        frame[i][1] = e2[i] / n2;
+      }
+      frame[0][2] = frame[1][0] * frame[2][1] - frame[2][0] * frame[1][1];
+      frame[1][2] = frame[2][0] * frame[0][1] - frame[0][0] * frame[2][1];
+      frame[2][2] = frame[0][0] * frame[1][1] - frame[1][0] * frame[0][1];
+      return true;
+    }
+
+    /**
+     * Finds the rotation closest to the given matrix, i.e. its orthonormal polar factor.
+     *
+     * @param m                        Matrix to find rotation for.
+     * @param rotation                 (out) Rotation.
+     * @return                         false if the matrix is singular or the closest orthonormal matrix is a reflection, true otherwise.
+     */
+    static bool polarRotation(const arx::Matrix3f& m, arx::Matrix3f& rotation) {
+      /* Newton iteration for polar decomposition. It converges quadratically and preserves the sign
+       * of determinant, so reflections are easy to detect beforehand. */
+      float scale = 0.0f;
+      for(int r = 0; r < 3; r++)
+        for(int c = 0; c < 3; c++)
+          scale = std::max(scale, abs(m[r][c]));
+      if(scale < EPS)
+        return false;
+
+      rotation = m;
+      rotation /= scale;
+      float det = rotation[0][0] * (rotation[1][1] * rotation[2][2] - rotation[1][2] * rotation[2][1]) -
+                  rotation[0][1] * (rotation[1][0] * rotation[2][2] - rotation[1][2] * rotation[2][0]) +
+                  rotation[0][2] * (rotation[1][0] * rotation[2][1] - rotation[1][1] * rotation[2][0]);
+      if(!(det > EPS))
+        return false;
+
+      for(int i = 0; i < 20; i++) {
+        arx::Matrix3f inverse = rotation.inverse();
+        float change = 0.0f;
+        for(int r = 0; r < 3; r++) {
+          for(int c = 0; c < 3; c++) {
+            float value = 0.5f * (rotation[r][c] + inverse[c][r]);
+            change += abs(value - rotation[r][c]);
+            rotation[r][c] = value;
+          }
+        }
+        if(change < EPS)
+          break;
+      }
+      return true;
+    }
+
+  public:
+    enum { has_batch_fit_error = true };
+    enum { has_least_squares_fit = true };
+
+    typedef MatchBuffer point_buffer_type;
+
+    RotationMatchModel(): data(new RotationMatchModelData()) {};
+
+    bool fit(const arx::ArrayList<Match>& m) {
+      using namespace arx;
+
+      /* We need at least 2 matches. */
+      if(m.size() < 2)
+        return false;
+
+      Matrix3f& r = data->rotation;
+      if(m.size() == 2) {
+        float a0[3], b0[3], a1[3], b1[3];
+        toRay(m[0].getKey(0), a0);
+        toRay(m[1].getKey(0), b0);
+        toRay(m[0].getKey(1), a1);
+        toRay(m[1].getKey(1), b1);
+
+        /* Rotation transforms frame of the second image into frame of the first one. */
+        Matrix3f f0, f1;
+        if(!buildFrame(a0, b0, f0) || !buildFrame(a1, b1, f1))
+          return false;
+        for(int i = 0; i < 3; i++)
+          for(int j = 0; j < 3; j++)
+            r[i][j] = f0[i][0] * f1[j][0] + f0[i][1] * f1[j][1] + f0[i][2] * f1[j][2];
+      } else {
+        /* Correlation matrix. */
+        Matrix3f c(0.0f);
+        for(unsigned int k = 0; k < m.size(); k++) {
+          float r0[3], r1[3];
+          toRay(m[k].getKey(0), r0);
+          toRay(m[k].getKey(1), r1);
+          for(int i = 0; i < 3; i++)
+            for(int j = 0; j < 3; j++)
+              c[i][j] += r0[i] * r1[j];
+        }
+        if(!polarRotation(c, r))
+          return false;
+      }
+
+      /* Transformation of keypoints is K * R * K^-1, where K = diag(f, f, 1). */
+      const float f = ROTATION_MODEL_FOCAL;
+      Matrix3f& t = data->trans;
+      t[0][0] = r[0][0];     t[0][1] = r[0][1];     t[0][2] = r[0][2] * f;
+      t[1][0] = r[1][0];     t[1][1] = r[1][1];     t[1][2] = r[1][2] * f;
+      t[2][0] = r[2][0] / f; t[2][1] = r[2][1] / f; t[2][2] = r[2][2];
+      return true;
+    }
+
+    float calculateFitError(const Match& m) const {
+      using namespace arx;
+
+      /* Calculate point's expected position in the first image. */
+      Vector3f expectedV = data->trans * Vector3f(m.getKey(1).getXY());
+      if(abs(expectedV[2]) < EPS)
+        return std::numeric_limits<float>::max();
+
+      /* Now calculate the squared distance between expected and real point positions. */
+      return sqr(expectedV[0] / expectedV[2] - m.getKey(0).getX()) + sqr(expectedV[1] / expectedV[2] - m.getKey(0).getY());
+    }
+
+    void calculateFitErrors(const MatchBuffer& points, std::size_t begin, std::size_t end, float* errors) const {
+      calculateProjectiveFitErrors(data->trans, points, begin, end, errors);
+    }
+
+    /**
+     * @return                         Rotation from camera frame of the second image to camera frame of the first one.
+     */
+    const arx::Matrix3f& getRotation() const { return data->rotation; }
+
+    /**
+     * @return                         Transformation from keypoint coordinates of the second image to keypoint coordinates of the first one.
+     */
+    const arx::Matrix3f& getTransform() const { return data->trans; }
+  };
+
+} // namespace prec
+
+#endif // __ROTATIONMATCHMODEL_H__
@@ -1,6 +1,9 @@
 #include "config.h"
 
 #include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
 #include <iostream>
 #include <ctime>
 #include <cmath>
@@ -18,6 +21,7 @@
 //#include "Image.h"
 
 #include "arx/LinearAlgebra.h"
+#include "arx/SparseLinearAlgebra.h"
 #include "arx/Collections.h"
 
 //#include "LevMar.h"
@@ -27,6 +31,14 @@
 
 #include "Image.h"
 
+#include "matching/RANSAC.h"
+#include "matching/Matcher.h"
+#include "matching/HomographyMatchModel.h"
+#include "matching/RotationMatchModel.h"
+#include "PanoImage.h"
+#include "StitchPlan.h"
+#include "Stitcher.h"
+
 //#include "PanoImage.h"
 
 #include <boost/preprocessor/facilities/is_empty.hpp>
@@ -387,7 +399,564 @@ int main() {
 }
 */
 
+// -------------------------------------------------------------------------- //
+// Checks
+// -------------------------------------------------------------------------- //
+/** Number of failed checks. */
+static int failedChecks = 0;
+
+/** Reports the condition if it doesn't hold. */
+#define CHECK(CONDITION)                                                        \
+  do {                                                                          \
+    if(!(CONDITION)) {                                                          \
+      cout << __FILE__ << "(" << __LINE__ << "): check failed: " << #CONDITION << endl; \
+      failedChecks++;                                                           \
+    }                                                                           \
+  } while(false)
+
+/** Point on a plane, for RANSAC checks. */
+struct LinePoint {
+  float x, y;
+};
+
+/** 
+ * Line model for RANSAC checks. Fit error is squared distance to the line, and the fit is total 
+ * least squares, so that local optimization is exercised too.
+ */
+class LineModel: public GenericRANSACModel<LinePoint> {
+private:
+  float a, b, c; /* Line is ax + by + c = 0, where a^2 + b^2 = 1. */
+
+public:
+  enum { has_least_squares_fit = true };
+
+  bool fit(const ArrayList<LinePoint>& points) {
+    float mx = 0, my = 0;
+    for(size_t i = 0; i < points.size(); i++) {
+      mx += points[i].x;
+      my += points[i].y;
+    }
+    mx /= points.size();
+    my /= points.size();
+
+    float sxx = 0, sxy = 0, syy = 0;
+    for(size_t i = 0; i < points.size(); i++) {
+      float dx = points[i].x - mx, dy = points[i].y - my;
+      sxx += dx * dx;
+      sxy += dx * dy;
+      syy += dy * dy;
+    }
+    if(sxx + syy < EPS)
+      return false;
+
+    /* Line goes through the centroid along the principal axis. */
+    float angle = 0.5f * atan2(2 * sxy, sxx - syy);
+    this->a = -sin(angle);
+    this->b = cos(angle);
+    this->c = -(this->a * mx + this->b * my);
+    return true;
+  }
+
+  float calculateFitError(const LinePoint& p) const {
+    return sqr(this->a * p.x + this->b * p.y + this->c);
+  }
+};
+
+/**
+ * PROSAC must still find the model when the ranking is bad, i.e. all the inliers are at the 
+ * bottom of the list.
+ */
+static void checkProgressiveBadRanking() {
+  ArrayList<LinePoint> points;
+  for(int i = 0; i < 170; i++) {
+    LinePoint p = {10.0f * rand() / RAND_MAX, 10.0f * rand() / RAND_MAX};
+    points.push_back(p);
+  }
+  for(int i = 0; i < 30; i++) {
+    LinePoint p = {0.3f * i, 0.6f * i + 1};
+    points.push_back(p);
+  }
+
+  RANSAC<LineModel, LinePoint, true> ransac(2, 10);
+  LineModel model;
+  CHECK(ransac.fitProgressive(model, points, 0.1f, 0.95f, 1.0e-4f, 0.01f));
+  CHECK(model.getInliers().size() == 30);
+}
+
+/**
+ * Creates a match between keypoint (x0, y0) of the first image and keypoint (x1, y1) of the second
+ * one. Keypoint data is normally owned by keypoint lists, so keypoints created here are leaked.
+ */
+static Match makeMatch(float x0, float y0, float x1, float y1) {
+  SIFT key0(x0, y0), key1(x1, y1);
+  key0.setTag(1);
+  key1.setTag(0);
+  return Match(key0, key1, 0);
+}
+
+/**
+ * @return                             Largest absolute difference between elements of the given matrices.
+ */
+static float maxDifference(const Matrix3f& a, const Matrix3f& b) {
+  float result = 0.0f;
+  for(int r = 0; r < 3; r++)
+    for(int c = 0; c < 3; c++)
+      result = max(result, abs(a[r][c] - b[r][c]));
+  return result;
+}
+
+/**
+ * Appends matches that the given transformation produces from keypoints of the second image at 
+ * the given points to the given list.
+ */
+static void addTransformedMatches(const Matrix3f& t, const float* xy, int n, ArrayList<Match>& matches) {
+  for(int i = 0; i < n; i++) {
+    float x1 = xy[2 * i], y1 = xy[2 * i + 1];
+    float z = t[2][0] * x1 + t[2][1] * y1 + t[2][2];
+    float x0 = (t[0][0] * x1 + t[0][1] * y1 + t[0][2]) / z;
+    float y0 = (t[1][0] * x1 + t[1][1] * y1 + t[1][2]) / z;
+    matches.push_back(makeMatch(x0, y0, x1, y1));
+  }
+}
+
+/**
+ * Normalized DLT must recover a homography from a minimal sample and from an overdetermined set of 
+ * exact matches, and must reject a minimal sample with collinear keypoints.
+ */
+static void checkHomographySolver() {
+  Matrix3f h = Matrix3f::identity();
+  h[0][0] = 1.1f;   h[0][1] = 0.05f; h[0][2] = 0.1f;
+  h[1][0] = -0.03f; h[1][1] = 0.95f; h[1][2] = -0.05f;
+  h[2][0] = 0.2f;   h[2][1] = -0.1f; h[2][2] = 1.0f;
+
+  const float corners[] = {-0.4f, -0.3f, 0.4f, -0.3f, 0.4f, 0.3f, -0.4f, 0.3f};
+  ArrayList<Match> minimal;
+  addTransformedMatches(h, corners, 4, minimal);
+  HomographyMatchModel minimalModel;
+  CHECK(minimalModel.fit(minimal));
+  CHECK(maxDifference(minimalModel.getTransform(), h) < 1.0e-3f);
+
+  float grid[2 * 20];
+  for(int i = 0; i < 20; i++) {
+    grid[2 * i] = -0.4f + 0.2f * (i % 5);
+    grid[2 * i + 1] = -0.3f + 0.2f * (i / 5);
+  }
+  ArrayList<Match> all;
+  addTransformedMatches(h, grid, 20, all);
+  HomographyMatchModel model;
+  CHECK(model.fit(all));
+  CHECK(maxDifference(model.getTransform(), h) < 1.0e-3f);
+  for(size_t i = 0; i < all.size(); i++)
+    CHECK(model.calculateFitError(all[i]) < 1.0e-8f);
+
+  /* First four points of the grid lie on one row. */
+  ArrayList<Match> collinear;
+  addTransformedMatches(h, grid, 4, collinear);
+  CHECK(!HomographyMatchModel().fit(collinear));
+}
+
+/**
+ * Rotation model must recover the rotation from a minimal sample of two matches and from an
+ * overdetermined set of exact matches.
+ */
+static void checkRotationSolver() {
+  /* Rotation by 0.3 radians about a unit axis, by Rodrigues' formula. */
+  const float f = ROTATION_MODEL_FOCAL, angle = 0.3f;
+  float axis[3] = {0.2f, 1.0f, 0.1f};
+  float norm = sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+  for(int i = 0; i < 3; i++)
+    axis[i] /= norm;
+  float s = sin(angle), c = cos(angle);
+  Matrix3f r;
+  for(int i = 0; i < 3; i++)
+    for(int j = 0; j < 3; j++)
+      r[i][j] = (i == j ? c : 0.0f) + (1 - c) * axis[i] * axis[j];
+  r[0][1] -= s * axis[2]; r[0][2] += s * axis[1];
+  r[1][0] += s * axis[2]; r[1][2] -= s * axis[0];
+  r[2][0] -= s * axis[1]; r[2][1] += s * axis[0];
+
+  /* Keypoints are mapped with K * R * K^-1, where K = diag(f, f, 1). */
+  Matrix3f t = r;
+  t[0][2] *= f;
+  t[1][2] *= f;
+  t[2][0] /= f;
+  t[2][1] /= f;
+
+  float grid[2 * 20];
+  for(int i = 0; i < 20; i++) {
+    grid[2 * i] = -0.4f + 0.2f * (i % 5);
+    grid[2 * i + 1] = -0.3f + 0.2f * (i / 5);
+  }
+  ArrayList<Match> all;
+  addTransformedMatches(t, grid, 20, all);
+
+  ArrayList<Match> minimal;
+  minimal.push_back(all[0]);
+  minimal.push_back(all[19]);
+  RotationMatchModel minimalModel;
+  CHECK(minimalModel.fit(minimal));
+  CHECK(maxDifference(minimalModel.getRotation(), r) < 1.0e-3f);
+
+  RotationMatchModel model;
+  CHECK(model.fit(all));
+  CHECK(maxDifference(model.getRotation(), r) < 1.0e-3f);
+  for(size_t i = 0; i < all.size(); i++)
+    CHECK(model.calculateFitError(all[i]) < 1.0e-8f);
+}
+
+/**
+ * Cholesky solver must solve a random symmetric positive definite system, with and without a 
+ * diagonal shift, using only the lower triangle of the matrix, and must reject a matrix that is 
+ * not positive definite.
+ */
+static void checkCholeskySolver() {
+  /* Size spans several blocks of the factorization and is not a multiple of the block size. */
+  const size_t n = 2 * ARX_CHOLESKY_BLOCK_SIZE + 7;
+  const float shift = 5.0f;
+
+  MatrixXf m(n, n, 0.0f);
+  for(size_t i = 0; i < n; i++)
+    for(size_t j = 0; j < n; j++)
+      m(i, j) = 2.0f * rand() / RAND_MAX - 1.0f;
+
+  /* A = M * M^T + n * I. */
+  MatrixXf a(n, n, 0.0f);
+  for(size_t i = 0; i < n; i++) {
+    for(size_t j = 0; j < n; j++) {
+      float sum = (i == j) ? (float) n : 0.0f;
+      for(size_t k = 0; k < n; k++)
+        sum += m(i, k) * m(j, k);
+      a(i, j) = sum;
+    }
+  }
+
+  VectorXf x(n, 0.0f), b(n, 0.0f), shifted(n, 0.0f);
+  for(size_t i = 0; i < n; i++)
+    x[i] = 2.0f * rand() / RAND_MAX - 1.0f;
+  for(size_t i = 0; i < n; i++) {
+    for(size_t j = 0; j < n; j++) {
+      b[i] += a(i, j) * x[j];
+      shifted[i] += a(i, j) * x[j];
+    }
+    shifted[i] += shift * x[i];
+  }
+
+  /* Upper triangle must not be read. */
+  for(size_t i = 0; i < n; i++)
+    for(size_t j = i + 1; j < n; j++)
+      a(i, j) = 1.0e30f;
+
+  CHECK(solveCholesky(a, b));
+  CHECK(solveCholesky(a, shifted, shift));
+  float error = 0.0f, shiftedError = 0.0f;
+  for(size_t i = 0; i < n; i++) {
+    error = max(error, abs(b[i] - x[i]));
+    shiftedError = max(shiftedError, abs(shifted[i] - x[i]));
+  }
+  CHECK(error < 1.0e-3f);
+  CHECK(shiftedError < 1.0e-3f);
+
+  /* Diagonal of A doesn't exceed 2 * n, so this shift makes it negative definite. */
+  VectorXf rejected(n, 1.0f);
+  CHECK(!solveCholesky(a, rejected, -3.0f * n));
+}
+
+/**
+ * Block-sparse matrix product must agree with the dense one, and preconditioned conjugate 
+ * gradient must solve a diagonally dominant block-sparse system.
+ */
+static void checkBlockSparseSolver() {
+  typedef BlockSparseMatrix<float, 4> matrix_type;
+  const size_t blockRows = 30, n = blockRows * 4;
+
+  /* Each block row has at most 4 off-diagonal blocks with elements in [-1, 1], so a diagonal of 
+   * 20 makes the matrix diagonally dominant. */
+  matrix_type a(blockRows);
+  for(size_t i = 0; i < blockRows; i++) {
+    if(i + 1 < blockRows)
+      a.addBlock(i, i + 1);
+    if(i + 5 < blockRows)
+      a.addBlock(i, i + 5);
+  }
+  for(size_t k = 0; k < a.getBlockNumber(); k++) {
+    matrix_type::block_type& block = a.getBlock(k);
+    bool diagonal = a.getBlockRow(k) == a.getBlockCol(k);
+    for(size_t r = 0; r < 4; r++) {
+      for(size_t c = diagonal ? r : 0; c < 4; c++) {
+        block[r][c] = (diagonal && r == c) ? 20.0f : 2.0f * rand() / RAND_MAX - 1.0f;
+        if(diagonal)
+          block[c][r] = block[r][c];
+      }
+    }
+  }
+
+  vector<float> x(n), b(n);
+  for(size_t i = 0; i < n; i++)
+    x[i] = 2.0f * rand() / RAND_MAX - 1.0f;
+  a.multiply(&x[0], &b[0]);
+
+  MatrixXf dense(n, n, 0.0f);
+  a.toDense(dense);
+  float productError = 0.0f;
+  for(size_t i = 0; i < n; i++) {
+    float sum = 0.0f;
+    for(size_t j = 0; j < n; j++)
+      sum += dense(i, j) * x[j];
+    productError = max(productError, abs(sum - b[i]));
+  }
+  CHECK(productError < 1.0e-3f);
+
+  BlockSparseConjugateGradient<float, 4> solver;
+  unsigned int iterations = solver.solve(a, &b[0], 200, 1.0e-6f);
+  CHECK(iterations < 200);
+  float error = 0.0f;
+  for(size_t i = 0; i < n; i++)
+    error = max(error, abs(b[i] - x[i]));
+  CHECK(error < 1.0e-3f);
+}
+
+/**
+ * Writes the given 32-bit words into a binary file.
+ */
+static void writeWords(const string& fileName, const vector<int>& words) {
+  ofstream f(fileName.c_str(), ios_base::out | ios_base::binary);
+  f.write((const char*) &words[0], words.size() * sizeof(int));
+}
+
+/**
+ * @return                             Contents of the given binary file as 32-bit words.
+ */
+static vector<int> readWords(const string& fileName) {
+  ifstream f(fileName.c_str(), ios_base::in | ios_base::binary);
+  vector<int> result;
+  int word;
+  while(f.read((char*) &word, sizeof(int)))
+    result.push_back(word);
+  return result;
+}
+
+/**
+ * @return                             true if StitchPlan::loadFromFile rejects the given file contents.
+ */
+static bool isRejectedStitchPlan(const string& fileName, const vector<int>& words) {
+  writeWords(fileName, words);
+  try {
+    StitchPlan::loadFromFile(fileName);
+  } catch(runtime_error&) {
+    return true;
+  }
+  return false;
+}
+
+/**
+ * A stitch plan file must load, render, and save back to the same bytes. Corrupted files must be 
+ * rejected on load, before they can make render read out of bounds. The file is written by hand, so 
+ * this also pins the file format.
+ */
+static void checkStitchPlanFiles() {
+  const string fileName = "check_stitch_plan.bin", savedFileName = "check_stitch_plan_saved.bin";
+
+  /* 8x4 output of two 4x4 tiles and one 4x4 image. First tile has a run of 4 pixels in row 0, 
+   * second one - a run of 3 pixels starting at (1, 2). */
+  const int header[] = {0x50535250 /* "PRSP" */, 1, 8, 4, 4, 4, 1, 2};
+  const int sizes[] = {4, 4};
+  const int tiles[] = {0, 0, 1, 4, 0, 1};
+  const int runs[] = {0, 0, 0, 4, 0, 1, 2, 3};
+  const size_t pixelNumber = 7;
+  vector<int> words;
+  words.insert(words.end(), header, header + 8);
+  words.insert(words.end(), sizes, sizes + 2);
+  words.insert(words.end(), tiles, tiles + 6);
+  words.insert(words.end(), runs, runs + 8);
+  const size_t sxOffset = words.size();
+  for(size_t k = 0; k < 3 * pixelNumber; k++) {
+    /* Source x coordinates, then y coordinates, then weights. */
+    float value = (k < pixelNumber) ? 0.5f + 0.3f * k : 1.0f;
+    int word;
+    memcpy(&word, &value, sizeof(int));
+    words.push_back(word);
+  }
+
+  writeWords(fileName, words);
+  StitchPlan plan = StitchPlan::loadFromFile(fileName);
+  CHECK(plan.getWidth() == 8 && plan.getHeight() == 4 && plan.getImageNumber() == 1);
+
+  plan.saveToFile(savedFileName);
+  CHECK(readWords(savedFileName) == words);
+
+  /* Rendering a constant image gives its color wherever runs cover the output. */
+  ArrayList<Image3f> frame;
+  frame.push_back(Image3f(4, 4));
+  frame[0].fill(Color3f(0.25f, 0.5f, 0.75f));
+  Image4f result;
+  plan.render(frame, result, 1);
+  CHECK(result.getWidth() == 8 && result.getHeight() == 4);
+  const Color4f covered = result.getPixel(3, 0), coveredByRun = result.getPixel(6, 2), uncovered = result.getPixel(4, 0);
+  CHECK(abs(covered.r - 0.25f) < 1.0e-4f && abs(covered.g - 0.5f) < 1.0e-4f && abs(covered.b - 0.75f) < 1.0e-4f && covered.a == 1.0f);
+  CHECK(abs(coveredByRun.r - 0.25f) < 1.0e-4f && coveredByRun.a == 1.0f);
+  CHECK(uncovered.a == 0.0f);
+
+  vector<int> corrupted = words;
+  corrupted[0] = 0;
+  CHECK(isRejectedStitchPlan(fileName, corrupted));           /* Magic. */
+  corrupted = words;
+  corrupted[1] = 2;
+  CHECK(isRejectedStitchPlan(fileName, corrupted));           /* Version. */
+  corrupted = words;
+  corrupted[16] = 1;
+  CHECK(isRejectedStitchPlan(fileName, corrupted));           /* Image index of the first run. */
+  corrupted = words;
+  corrupted[23] = 4;
+  CHECK(isRejectedStitchPlan(fileName, corrupted));           /* Second run sticks out of its tile. */
+  corrupted = words;
+  float outside = 3.5f;
+  memcpy(&corrupted[sxOffset], &outside, sizeof(int));
+  CHECK(isRejectedStitchPlan(fileName, corrupted));           /* Source coordinate out of image bounds. */
+  corrupted = words;
+  corrupted.pop_back();
+  CHECK(isRejectedStitchPlan(fileName, corrupted));           /* Truncated. */
+
+  remove(fileName.c_str());
+  remove(savedFileName.c_str());
+}
+
+/**
+ * @return                             Largest absolute difference between channels of the given images of the same size.
+ */
+static float maxDifference(const Image4f& a, const Image4f& b) {
+  float result = 0.0f;
+  for(int y = 0; y < a.getHeight(); y++) {
+    for(int x = 0; x < a.getWidth(); x++) {
+      Color4f p = a.getPixel(x, y), q = b.getPixel(x, y);
+      result = max(result, max(max(abs(p.r - q.r), abs(p.g - q.g)), max(abs(p.b - q.b), abs(p.a - q.a))));
+    }
+  }
+  return result;
+}
+
+/**
+ * Multi-band blending must give the same output for different tilings. Tile sizes are not multiples 
+ * of the alignment of the pyramid, so tiles start at different positions relative to its grid.
+ */
+static void checkMultiBandTiling() {
+  /* Two textured images, the second one turned by 0.3 radians, so that they partially overlap. */
+  Panorama p;
+  for(int i = 0; i < 2; i++) {
+    Image3f image(200, 150);
+    for(int y = 0; y < image.getHeight(); y++)
+      for(int x = 0; x < image.getWidth(); x++)
+        image.setPixel(x, y, Color3f(0.5f + 0.4f * sin(0.2f * x + i), 0.5f + 0.4f * cos(0.15f * y), 0.3f + 0.2f * i));
+    string fileName = "check_tiling_" + string(1, (char) ('0' + i)) + ".bmp";
+    image.saveToFile(fileName);
+    PanoImage panoImage(fileName, 800, 600);
+    panoImage.setHomography(Homography(0.0f, 0.3f * i, 0.0f, 1.0f));
+    p.getImages().push_back(panoImage);
+    remove(fileName.c_str());
+  }
+
+  Stitcher stitcher;
+  stitcher.setBlendMode(Stitcher::MULTI_BAND_BLEND, 3);
+  stitcher.setGainCompensation(false);
+  stitcher.setThreadNumber(2);
+  stitcher.setTileSize(37);
+  Image4f narrow = stitcher.stitch(p);
+  stitcher.setTileSize(100);
+  Image4f wide = stitcher.stitch(p);
+  CHECK(narrow.getWidth() == wide.getWidth() && narrow.getHeight() == wide.getHeight());
+  if(narrow.getWidth() == wide.getWidth() && narrow.getHeight() == wide.getHeight())
+    CHECK(maxDifference(narrow, wide) < 1.0e-4f);
+}
+
+// -------------------------------------------------------------------------- //
+// Match model comparison
+// -------------------------------------------------------------------------- //
+/**
+ * Matches each pair of the given images without verification and then with each verification
+ * model. Prints the number of tentative matches and the numbers and rates of inliers of each model
+ * for every pair that has tentative matches, and time spent on verification by each model.
+ *
+ * @param fileNames                    Image files.
+ */
+static void compareMatchModels(const vector<string>& fileNames) {
+  /* Matches beyond maximumMatches are dropped, so it must exceed any realistic inlier count. At the
+   * same time, Matcher needs at least twice as many keypoints in total. */
+  const unsigned int minimumMatches = 8, maximumMatches = 500;
+  const int runN = 4;
+  const char* runNames[runN] = {"tentative", "similarity", "homography", "rotation"};
+  const Matcher::VerificationModel models[runN] = {Matcher::SIMILARITY_MODEL, Matcher::SIMILARITY_MODEL, Matcher::HOMOGRAPHY_MODEL, Matcher::ROTATION_MODEL};
+
+  ArrayList<PanoImage> images;
+  for(size_t i = 0; i < fileNames.size(); i++)
+    images.push_back(PanoImage(fileNames[i], 800, 600));
+
+  cout << setw(40) << left << "pair" << right;
+  for(int r = 0; r < runN; r++)
+    cout << setw(18) << runNames[r];
+  cout << endl;
+
+  double seconds[runN] = {0};
+  size_t totals[runN] = {0};
+  for(size_t i = 0; i < images.size(); i++) {
+    for(size_t j = i + 1; j < images.size(); j++) {
+      ArrayList<PanoImage> imagePair;
+      imagePair.push_back(images[i]);
+      imagePair.push_back(images[j]);
+
+      /* Run 0 doesn't verify matches, so it gives the tentative ones and the time of matching itself. */
+      size_t counts[runN];
+      for(int r = 0; r < runN; r++) {
+        Matcher matcher(minimumMatches, maximumMatches, r > 0, models[r]);
+        clock_t start = clock();
+        ArrayList<Panorama> panoramas = matcher.matchImages(imagePair);
+        seconds[r] += (double) (clock() - start) / CLOCKS_PER_SEC;
+
+        counts[r] = 0;
+        for(size_t k = 0; k < panoramas.size(); k++)
+          if(panoramas[k].getImageMatches().size() > 0)
+            counts[r] = panoramas[k].getImageMatches()[0].getMatches().size();
+        totals[r] += counts[r];
+      }
+      if(counts[0] == 0)
+        continue;
+
+      cout << setw(40) << left << (fileNames[i] + " " + fileNames[j]) << right << setw(18) << counts[0];
+      for(int r = 1; r < runN; r++)
+        cout << setw(10) << counts[r] << " (" << setw(3) << 100 * counts[r] / counts[0] << "%)";
+      cout << endl;
+    }
+  }
+
+  cout << setw(40) << left << "total" << right << setw(18) << totals[0];
+  for(int r = 1; r < runN; r++)
+    cout << setw(10) << totals[r] << " (" << setw(3) << (totals[0] > 0 ? 100 * totals[r] / totals[0] : 0) << "%)";
+  cout << endl;
+  cout << setw(40) << left << "verification time, s" << right << setw(18) << "";
+  for(int r = 1; r < runN; r++)
+    cout << setw(18) << fixed << setprecision(3) << seconds[r] - seconds[0];
+  cout << endl;
+}
+
 int main(int argc, char** argv) {
+  checkProgressiveBadRanking();
+  checkHomographySolver();
+  checkRotationSolver();
+  checkCholeskySolver();
+  checkBlockSparseSolver();
+  checkStitchPlanFiles();
+  checkMultiBandTiling();
+  if(failedChecks > 0)
+    return 1;
+
+  /* Usage: test --compare-models image0 image1 ... */
+  if(argc > 2 && string(argv[1]) == "--compare-models") {
+    compareMatchModels(vector<string>(argv + 2, argv + argc));
+    return 0;
+  }
+
+  /* Experiments below need an image. */
+  if(argc < 2)
+    return 0;
+
   Image1f image = Image1f::loadFromFile(argv[1]);
 
   for(int i = 1; i <= 500; i++)